@@ -147,6 +147,22 @@ static void *tkStubsPtr, *tkPlatStubsPtr, *tkIntStubsPtr, *tkIntPlatStubsPtr, *t
 #endif /* FFI_CLOSURES */
 #endif /* HAVE_CLOSURES */
 
+/*
+ * Whether to compile native call stubs for simple callouts, see jit_compile().
+ * Enabled with configure --enable-jit.  Only implemented for the x86-64
+ * System V ABI, and requires mmap() and mprotect() for executable memory.
+ */
+#ifndef USE_JIT
+#define USE_JIT 0
+#endif
+#if USE_JIT && !(USE_LIBFFI && defined(__x86_64__) && !defined(__ILP32__) && !defined(_WIN32))
+#undef USE_JIT
+#define USE_JIT 0
+#endif
+#if USE_JIT
+#include <sys/mman.h>
+#endif
+
 #if defined(HAVE_LONG_DOUBLE) && defined(HAVE_LONG_DOUBLE_WIDER)
 /*
  * Cannot support wider long doubles because they don't fit in Tcl_Obj.
@@ -573,15 +589,30 @@ enum ffidl_typecode {
 #define HAVE_INT64	1
 #endif
 
+/*
+ * Whether to call simple callouts through the specialized thunks generated
+ * by ffidl_thunks.tcl at build time, see thunk_lookup().  The thunks use
+ * SINT64_T, so a 64 bit integer type is required.
+ */
+#ifndef USE_THUNKS
+#define USE_THUNKS 0
+#endif
+#if USE_THUNKS && !defined(HAVE_INT64)
+#undef USE_THUNKS
+#define USE_THUNKS 0
+#endif
+
 #if defined(HAVE_INT64)
 #  if defined(TCL_WIDE_INT_IS_LONG)
 #    define HAVE_WIDE_INT		0
 #    define Ffidl_NewInt64Obj		Tcl_NewLongObj
+#    define Ffidl_SetInt64Obj		Tcl_SetLongObj
 #    define Ffidl_GetInt64FromObj	Tcl_GetLongFromObj
 #    define Ffidl_Int64			long
 #  else
 #    define HAVE_WIDE_INT		1
 #    define Ffidl_NewInt64Obj		Tcl_NewWideIntObj
+#    define Ffidl_SetInt64Obj		Tcl_SetWideIntObj
 #    define Ffidl_GetInt64FromObj	Tcl_GetWideIntFromObj
 #    define Ffidl_Int64			Tcl_WideInt
 #  endif
@@ -622,6 +653,9 @@ enum ffidl_typecode {
 static Tcl_Obj *Ffidl_NewPointerObj(void *ptr) {
   return Tcl_NewLongObj((long)ptr);
 }
+static void Ffidl_SetPointerObj(Tcl_Obj *obj, void *ptr) {
+  Tcl_SetLongObj(obj, (long)ptr);
+}
 static int Ffidl_GetPointerFromObj(Tcl_Interp *interp, Tcl_Obj *obj, void **ptr) {
   int status;
   long l;
@@ -634,6 +668,9 @@ static int Ffidl_GetPointerFromObj(Tcl_Interp *interp, Tcl_Obj *obj, void **ptr)
 static Tcl_Obj *Ffidl_NewPointerObj(void *ptr) {
   return Tcl_NewWideIntObj((Tcl_WideInt)ptr);
 }
+static void Ffidl_SetPointerObj(Tcl_Obj *obj, void *ptr) {
+  Tcl_SetWideIntObj(obj, (Tcl_WideInt)ptr);
+}
 static int Ffidl_GetPointerFromObj(Tcl_Interp *interp, Tcl_Obj *obj, void **ptr) {
   int status;
   Tcl_WideInt w;
@@ -760,10 +797,36 @@ typedef union ffidl_tclobj_value ffidl_tclobj_value;
 typedef struct ffidl_type ffidl_type;
 typedef struct ffidl_client ffidl_client;
 typedef struct ffidl_cif ffidl_cif;
+typedef struct ffidl_sig ffidl_sig;
 typedef struct ffidl_callout ffidl_callout;
 typedef struct ffidl_callback ffidl_callback;
+typedef struct ffidl_callback_frame ffidl_callback_frame;
+typedef struct ffidl_callback_event ffidl_callback_event;
+typedef struct ffidl_callback_pool ffidl_callback_pool;
+typedef struct ffidl_callback_batch ffidl_callback_batch;
+typedef struct ffidl_callback_batch_event ffidl_callback_batch_event;
 typedef struct ffidl_closure ffidl_closure;
+typedef struct ffidl_closure_pool ffidl_closure_pool;
+typedef struct ffidl_callback_handle ffidl_callback_handle;
+typedef struct ffidl_trampoline ffidl_trampoline;
+typedef struct ffidl_userdata_slot ffidl_userdata_slot;
+typedef struct ffidl_native ffidl_native;
 typedef struct ffidl_lib ffidl_lib;
+typedef struct ffidl_frame ffidl_frame;
+typedef struct ffidl_map ffidl_map;
+typedef struct ffidl_memo ffidl_memo;
+typedef struct ffidl_memo_cache ffidl_memo_cache;
+typedef struct ffidl_async ffidl_async;
+
+/*
+ * Converters used by callouts, see callout_prep().
+ */
+typedef int (ffidl_arg_converter)(Tcl_Interp *interp, ffidl_callout *callout,
+				  int i, Tcl_Obj *obj, void **argp);
+typedef Tcl_Obj *(ffidl_ret_converter)(Tcl_Obj *obj, void *ret);
+#if USE_THUNKS
+typedef void (ffidl_thunk)(void (*fn)(void), void **args, void *ret);
+#endif
 
 /*
  * Can hold the (C) values extracted from Tcl_Objs, as specified by the type's
@@ -832,7 +895,9 @@ struct ffidl_type {
  * a hashtable for ffidl::callout definitions,
  * a hashtable for cif's keyed by signature,
  * a hashtable of libs loaded by ffidl::symbol,
- * a hashtable of callbacks keyed by proc name
+ * a hashtable of callbacks keyed by proc name,
+ * a hashtable of idle callback closures keyed by signature,
+ * the trampolines and userdata handles of -userdata callbacks
  */
 struct ffidl_client {
   Tcl_HashTable types;
@@ -840,6 +905,25 @@ struct ffidl_client {
   Tcl_HashTable callouts;
   Tcl_HashTable libs;
   Tcl_HashTable callbacks;
+  unsigned long callback_epoch;	/* Changed whenever a callback is redefined. */
+  Tcl_HashTable anonymous;	/* Anonymous callbacks, keyed by function
+				 * pointer or userdata handle. */
+  Tcl_HashTable closures;	/* Idle closures, keyed by cif signature. */
+  Tcl_HashTable trampolines;	/* Trampolines of -userdata callbacks, keyed
+				 * by userdata argument and cif signature. */
+  ffidl_userdata_slot *userdata; /* -userdata callbacks, by handle. */
+  int nuserdata;		/* Number of userdata slots. */
+  int freeuserdata;		/* First free userdata slot, or -1. */
+  Tcl_Mutex userdata_mutex;	/* Guards userdata against other threads. */
+#if TCL_THREADS
+  Tcl_ThreadId userdata_owner;	/* Thread changing the userdata slots. */
+  int marshal_closed;		/* Whether the interp or its thread is gone,
+				 * so callbacks can no longer be marshalled
+				 * to it, under callback_event_mutex. */
+#endif
+  Tcl_Interp *interp;		/* Interp of the client. */
+  long async_id;		/* Id of the last -async call. */
+  int async_pending;		/* -async calls queued or running. */
 };
 
 /*
@@ -848,38 +932,264 @@ struct ffidl_client {
  * cif and convert arguments, and an array of void*
  * used to pass converted arguments into ffi_call.
  */
+/*
+ * The prepared part of a cif, shared by all the cifs, of any client, whose
+ * protocol and types are the same, whatever names they were spelled with,
+ * and kept in the process wide registry, see sig_get().  It is never
+ * changed once prepared.
+ */
+struct ffidl_sig {
+   int refs;		   /* Cifs using it, under registry_mutex. */
+   Tcl_HashEntry *entry;   /* Entry in registry_sigs. */
+   int protocol;	   /* Calling convention. */
+   ffidl_type *rtype;	   /* Type of return value. */
+   int argc;		   /* Number of arguments. */
+   ffidl_type **atypes;	   /* Type of each argument. */
+#if USE_LIBFFI
+   ffi_type **lib_atypes;  /* Libffi's argument types. */
+   ffi_cif lib_cif;	   /* Libffi's internal data. */
+#endif
+};
+
+/*
+ * A cif of a client, a copy of the shared ffidl_sig's fields, with the
+ * client's own reference counting and closures.
+ */
 struct ffidl_cif {
    int refs;		   /* Reference counting. */
    ffidl_client *client;   /* Backpointer to the ffidl_client. */
+   ffidl_sig *sig;	   /* Shared prepared signature. */
    int protocol;	   /* Calling convention. */
    ffidl_type *rtype;	   /* Type of return value. */
    int argc;		   /* Number of arguments. */
    ffidl_type **atypes;	   /* Type of each argument. */
+   char **anames;	   /* Type name of each argument, as written. */
 #if USE_LIBFFI
    ffi_type **lib_atypes;	/* Pointer to storage area for libffi's internal
 				 * argument types. */
    ffi_cif lib_cif;		/* Libffi's internal data. */
+#if USE_CALLBACKS
+   ffidl_closure_pool *closures; /* Idle closures for callbacks, kept by
+				  * the client, or NULL. */
+#endif
+#endif
+};
+
+/*
+ * values for ffidl_callout.flags
+ */
+#define FFIDL_CALLOUT_RESULTVAR	0x001	/* struct result stored in a variable */
+#define FFIDL_CALLOUT_THREADSAFE 0x002	/* may be called from any thread */
+#define FFIDL_CALLOUT_PURE	0x004	/* result depends only on the arguments */
+#define FFIDL_CALLOUT_ASYNC	0x008	/* called on the async pool */
+
+/*
+ * The default number of results remembered by a callout defined with
+ * -memoize.
+ */
+#ifndef FFIDL_MEMO_SIZE
+#define FFIDL_MEMO_SIZE 256
 #endif
+
+/*
+ * A result remembered by a -memoize callout, keyed by its arguments' C
+ * values, in the cache's least recently used list.
+ */
+struct ffidl_memo {
+  ffidl_memo *prev, *next; /* Neighbours in the LRU list. */
+  Tcl_HashEntry *entry;	   /* Entry in the cache's table. */
+  ffidl_value rvalue;	   /* Return value, followed by the rest of a
+			    * struct return value. */
+};
+
+struct ffidl_memo_cache {
+  Tcl_HashTable table;	   /* Results keyed by argument values. */
+  int size;		   /* Maximum number of results. */
+  int nkey;		   /* Length of a key in ints. */
+  int rsize;		   /* Size of a return value. */
+  int *key;		   /* Key of the current call. */
+  ffidl_memo *head, *tail; /* Most and least recently used results. */
 };
 
 /*
  * The ffidl_callout contains a cif pointer,
  * a function address, the ffidl_client
- * which defined the callout, and a usage
- * string.
+ * which defined the callout, the converters
+ * for its arguments and return value, and a
+ * usage string.
  */
 struct ffidl_callout {
   ffidl_cif *cif;
   void (*fn)(void);
   ffidl_client *client;
-  void *ret;		   /* Where to store the return value. */
-  void **args;		   /* Where to store each of the arguments' values. */
+  int flags;		   /* FFIDL_CALLOUT_* options. */
+  ptrdiff_t *offsets;	   /* Offset of each argument's value in a frame's
+			    * value area, -1 for structs. */
+  ffidl_frame *frames;	   /* Free frames, for more than FFIDL_FRAME_ARGS
+			    * arguments. */
+  ffidl_arg_converter **converters; /* Converter for each argument. */
+  ffidl_ret_converter *ret_converter; /* Converter for the return value, NULL
+				       * for void and struct returns. */
   char *usage;
+  int nbound;		   /* Number of leading arguments bound by
+			    * ::ffidl::curry. */
+  Tcl_Obj **bound;	   /* Values of the bound arguments. */
+  ffidl_value *bound_values; /* Value area holding the bound arguments
+			    * converted ahead, see callout_bind(). */
+  ffidl_memo_cache *memo;  /* Remembered results, for -memoize. */
+  ffidl_callback_handle *handle; /* Anonymous callback fn belongs to, kept
+				  * alive by the callout, or NULL. */
 #if USE_LIBFFI && USE_LIBFFI_RAW_API
   int use_raw_api;		/* Whether to use libffi's raw API. */
 #endif
+#if USE_JIT
+  void (*jit)(void **args, void *ret); /* Native call stub, once it is
+				 * executable, or NULL. */
+  void *jit_code;		/* Compiled stub, or NULL. */
+  struct ffidl_jit_page *jit_page; /* Code page holding the stub. */
+  int jit_calls;		/* Calls made before the stub was executable. */
+#endif
+#if USE_THUNKS
+  ffidl_thunk *thunk;		/* Specialized call thunk, or NULL. */
+#endif
+};
+
+/*
+ * The ffidl_frame holds the argument and return value storage of one callout
+ * invocation, so that callouts are re-entrant.  Frames for up to
+ * FFIDL_FRAME_ARGS arguments are allocated on the C stack, larger ones are
+ * kept in the callout's frame pool, see callout_frame_get().
+ */
+#define FFIDL_FRAME_ARGS 8
+
+struct ffidl_frame {
+  ffidl_frame *next;	   /* Next free frame in the pool. */
+  void *ret;		   /* Where to store the return value. */
+  void **args;		   /* Where to store each of the arguments' values. */
+  ffidl_value *values;	   /* Argument value area. */
+  ffidl_value rvalue;	   /* Return value area. */
+};
+
+/*
+ * The default and largest number of threads used by ::ffidl::parallel-map.
+ */
+#ifndef FFIDL_MAP_THREADS
+#define FFIDL_MAP_THREADS 4
+#endif
+#define FFIDL_MAP_MAXTHREADS 64
+
+/*
+ * An element-wise call of a callout over packed arguments, made by
+ * ::ffidl::map.  The broadcast arguments are converted once into the
+ * frame, the packed ones are copied into it before each call.
+ */
+struct ffidl_map {
+  ffidl_callout *callout;  /* Callout to call. */
+  int n;		   /* Number of calls. */
+  int npacked;		   /* Number of packed arguments. */
+  int *packed;		   /* Index of each packed argument. */
+  unsigned char **data;	   /* Elements of each packed argument. */
+  ffidl_type *otype;	   /* Type of the packed results. */
+  unsigned char *out;	   /* Packed results. */
+};
+
+#if TCL_THREADS
+/*
+ * The worker threads running the tasks of ::ffidl::parallel-map.  The pool
+ * is shared by all interpreters and threads of the process, it grows up to
+ * the largest number of threads asked for and its threads wait for tasks
+ * until the process exits.
+ */
+typedef struct ffidl_map_task ffidl_map_task;
+struct ffidl_map_task {
+  ffidl_map_task *next;	   /* Next task in the queue. */
+  ffidl_map *map;	   /* Map to run. */
+  ffidl_frame *frame;	   /* The task's own argument frame. */
+  int from, to;		   /* Calls to make. */
+  int *pending;		   /* Tasks of the map still to be finished. */
+};
+
+static Tcl_Mutex map_pool_mutex;
+static Tcl_Condition map_pool_work;	/* a task was queued, or exiting */
+static Tcl_Condition map_pool_done;	/* a task was finished */
+static ffidl_map_task *map_pool_queue;
+static Tcl_ThreadId map_pool_threads[FFIDL_MAP_MAXTHREADS];
+static int map_pool_size;
+static int map_pool_exiting;
+
+/*
+ * The default number of threads running the calls of -async callouts, and
+ * the largest number that -async may ask for.
+ */
+#ifndef FFIDL_ASYNC_THREADS
+#define FFIDL_ASYNC_THREADS 16
+#endif
+#define FFIDL_ASYNC_MAXTHREADS 1024
+
+/*
+ * A coroutine waiting in ::ffidl::await for a call of an -async callout.
+ * It is shared by the waiting coroutine and the call, and freed when both
+ * are done with it.
+ */
+typedef struct ffidl_await {
+  int refCount;
+  int state;		   /* FFIDL_AWAIT_* */
+  Tcl_Interp *interp;
+  Tcl_Obj *coroutine;	   /* Full name of the coroutine, kept up to date
+			    * by a command trace, or NULL once deleted. */
+  Tcl_Obj *name;	   /* Name of the callout. */
+  Tcl_Obj *result;	   /* Converted return value, once done. */
+  Tcl_TimerToken timer;	   /* Timeout, or NULL. */
+} ffidl_await;
+
+#define FFIDL_AWAIT_WAITING	0
+#define FFIDL_AWAIT_DONE	1	/* the call completed */
+#define FFIDL_AWAIT_TIMEOUT	2	/* the wait timed out */
+#define FFIDL_AWAIT_ABANDONED	3	/* the coroutine went away */
+
+/*
+ * A call of an -async callout.  Its arguments are converted into its own
+ * frame, and the Tcl_Objs they point into are kept until it completes.  A
+ * worker of the async pool makes the call, then queues the call itself, as
+ * an event, to the calling thread, which passes the result to the
+ * completion command or to the waiting coroutine.
+ */
+struct ffidl_async {
+  Tcl_Event header;	   /* Completion event. */
+  ffidl_async *next;	   /* Next call in the pool's queue. */
+  ffidl_callout *callout;
+  Tcl_Interp *interp;
+  Tcl_ThreadId owner;	   /* Calling thread. */
+  long id;		   /* Id returned for the call. */
+  Tcl_Obj *command;	   /* Completion command prefix, or NULL. */
+  ffidl_await *await;	   /* Waiting coroutine, or NULL. */
+  Tcl_Obj *result;	   /* Bytearray of a struct return value, or NULL. */
+  ffidl_frame *frame;	   /* Argument and return value storage. */
+  ffidl_frame stackFrame;  /* Frame of calls with few arguments. */
+  void *args[FFIDL_FRAME_ARGS];
+  ffidl_value values[FFIDL_FRAME_ARGS];
+  int nobjs;		   /* Number of kept Tcl_Objs. */
+  Tcl_Obj **objs;	   /* Kept Tcl_Objs. */
 };
 
+/*
+ * The worker threads of -async callouts, shared by all interpreters and
+ * threads of the process.  A worker is started whenever a call is queued
+ * while none is idle, up to the largest number of threads asked for.
+ */
+static Tcl_Mutex async_pool_mutex;
+static Tcl_Condition async_pool_work;	/* a call was queued, or exiting */
+static ffidl_async *async_pool_head;
+static ffidl_async *async_pool_tail;
+static Tcl_ThreadId async_pool_threads[FFIDL_ASYNC_MAXTHREADS];
+static int async_pool_busy[FFIDL_ASYNC_MAXTHREADS]; /* worker is in a call */
+static int async_pool_size;
+static int async_pool_limit = FFIDL_ASYNC_THREADS;
+static int async_pool_idle;		/* workers waiting for calls */
+static int async_pool_queued;		/* calls waiting for workers */
+static int async_pool_generation;	/* changed when the workers must exit */
+#endif
+
 #if USE_CALLBACKS
 /*
  * The ffidl_closure contains a ffi_closure structure,
@@ -893,6 +1203,50 @@ struct ffidl_closure {
    callback_t lib_closure;
 #endif
 };
+
+#if USE_LIBFFI
+/*
+ * The number of closures allocated at once for the callbacks of a cif, and
+ * the largest number of idle closures kept for reuse.
+ */
+#ifndef FFIDL_CLOSURE_CHUNK
+#define FFIDL_CLOSURE_CHUNK 8
+#endif
+#ifndef FFIDL_CLOSURE_POOL_SIZE
+#define FFIDL_CLOSURE_POOL_SIZE 64
+#endif
+
+/*
+ * The idle closures of a cif signature, handed to callbacks with that
+ * signature instead of allocating executable memory for each of them.  They
+ * outlive the cifs of the signature, until the client is deleted.
+ */
+struct ffidl_closure_pool {
+  int count;
+  ffidl_closure idle[FFIDL_CLOSURE_POOL_SIZE];
+};
+#endif
+/*
+ * Callbacks whose command prefix and arguments fit in this many words
+ * build the command of each invocation on the C stack, larger ones in a
+ * frame taken from the callback's pool.
+ */
+#ifndef FFIDL_CALLBACK_STACK_OBJS
+#define FFIDL_CALLBACK_STACK_OBJS 8
+#endif
+
+/*
+ * Flags of ffidl_callback.
+ */
+#define FFIDL_CALLBACK_MARSHAL	0x001	/* run on the interp's thread */
+
+/*
+ * A pooled command word array of a callback invocation, followed by its
+ * cmdc+argc Tcl_Obj pointers.
+ */
+struct ffidl_callback_frame {
+  ffidl_callback_frame *next;	/* Next free frame in the pool. */
+};
 /*
  * The ffidl_callback binds a ffidl_cif pointer to
  * a Tcl proc name, it defines the signature of the
@@ -903,12 +1257,179 @@ struct ffidl_callback {
   int cmdc;			/* Number of command prefix words. */
   Tcl_Obj **cmdv;		/* Command prefix Tcl_Objs. */
   Tcl_Interp *interp;
+  Tcl_Obj **argobjs;		/* Unshared argument Tcl_Objs left by the
+				 * previous invocation, for reuse. */
+  ffidl_callback_frame *frames;	/* Free invocation frames. */
+  int flags;			/* FFIDL_CALLBACK_* flags. */
+  ffidl_callback_batch *batch;	/* Buffered -batch invocations, or NULL. */
+#if TCL_THREADS
+  Tcl_ThreadId owner;		/* Thread of interp. */
+  ffidl_callback_pool *pool;	/* Worker interps for other threads, or
+				 * NULL. */
+#endif
+  ffidl_closure closure;
+  void *userdata;		/* Userdata handle of a -userdata callback. */
+  ffidl_trampoline *trampoline;	/* Trampoline of a -userdata callback, which
+				 * has no closure of its own, or NULL. */
+  ffidl_native *native;		/* Configuration of a native comparator or
+				 * hash function, which runs no command, or
+				 * NULL. */
+#if USE_LIBFFI && USE_LIBFFI_RAW_API
+  int use_raw_api;		/* Whether to use libffi's raw API. */
+  ptrdiff_t *offsets;		/* Raw argument offsets. */
+#endif
+};
+
+/*
+ * The closure shared by the -userdata callbacks with a cif and userdata
+ * argument: it finds the callback to invoke from the value of that
+ * argument, a handle into the client's userdata slots.
+ */
+struct ffidl_trampoline {
+  ffidl_client *client;
+  ffidl_cif *cif;
+  int index;			/* Userdata argument. */
   ffidl_closure closure;
 #if USE_LIBFFI && USE_LIBFFI_RAW_API
   int use_raw_api;		/* Whether to use libffi's raw API. */
   ptrdiff_t *offsets;		/* Raw argument offsets. */
 #endif
 };
+
+/*
+ * A userdata handle is the index of a slot plus one in its low
+ * FFIDL_USERDATA_BITS bits, and the slot's generation above them, so that
+ * the handles of freed callbacks do not find the callbacks reusing their
+ * slots.
+ */
+#define FFIDL_USERDATA_BITS 20
+#define FFIDL_USERDATA_MASK ((((size_t)1)<<FFIDL_USERDATA_BITS)-1)
+struct ffidl_userdata_slot {
+  ffidl_callback *callback;	/* Callback, or NULL if free. */
+  size_t generation;
+  int next;			/* Next free slot, or -1. */
+};
+
+/*
+ * A comparator or hash function made by ::ffidl::native-comparator or
+ * ::ffidl::native-hash: the closure of an anonymous callback calls C code
+ * configured by this, instead of a Tcl command.
+ */
+#define FFIDL_NATIVE_BYTES	0	/* key length: size bytes */
+#define FFIDL_NATIVE_LENGTH	1	/* key length: second argument */
+#define FFIDL_NATIVE_STRING	2	/* key length: up to a NUL */
+#define FFIDL_HASH_FNV1A	0
+#define FFIDL_HASH_XXHASH32	1
+struct ffidl_native {
+  ffidl_typecode typecode;	/* Compared type, FFIDL_STRUCT for bytes. */
+  size_t offset;		/* Offset of the compared field. */
+  size_t size;			/* Number of bytes compared or hashed. */
+  int descending;		/* Whether to reverse the order. */
+  int algorithm;		/* FFIDL_HASH_* */
+  int length;			/* FFIDL_NATIVE_*, how keys are delimited. */
+  UINT32_T seed;
+};
+/*
+ * The default number of invocations a -batch callback buffers before its
+ * caller has to wait for them to be delivered.
+ */
+#ifndef FFIDL_BATCH_SIZE
+#define FFIDL_BATCH_SIZE 1024
+#endif
+
+/*
+ * The buffered invocations of a -batch callback, as records of argument
+ * values, delivered to its command from the event loop of its interp.
+ */
+struct ffidl_callback_batch {
+  Tcl_Mutex mutex;
+  Tcl_Condition drained;	/* The records were taken for delivery. */
+  int columns;			/* Deliver columns rather than tuples. */
+  int scheduled;		/* Whether a delivery event is queued. */
+  int size;			/* Capacity, in records. */
+  int count;			/* Number of buffered records. */
+  size_t recsize;		/* Size of a record. */
+  size_t *offsets;		/* Offsets of the arguments in a record. */
+  char *records;
+};
+
+/* The event delivering the records of a -batch callback. */
+struct ffidl_callback_batch_event {
+  Tcl_Event header;
+  ffidl_callback *callback;
+};
+
+#if TCL_THREADS
+/*
+ * An invocation of a -thread marshal callback from another thread, queued
+ * to the thread of the callback's interp.  A synchronous invocation points
+ * to its caller's arguments and waits for done; a void one is not waited
+ * for, and its argument values, and the strings pointed to by its
+ * pointer-utf8 and pointer-utf16 arguments, follow the args array.
+ */
+struct ffidl_callback_event {
+  Tcl_Event header;
+  ffidl_callback *callback;
+  void *ret;			/* Return value, if synchronous. */
+  int *done;			/* Set when done, if synchronous. */
+  Tcl_Condition *cond;		/* Notified when done, if synchronous. */
+  void **args;			/* Argument pointers. */
+  ffidl_callback_event *next;	/* Next event in a worker pool queue, or in
+				 * callback_event_pending. */
+};
+static Tcl_Mutex callback_event_mutex;
+/* marshalled invocations not yet run, under callback_event_mutex */
+static ffidl_callback_event *callback_event_pending;
+
+/*
+ * The worker threads of a -pool callback, each running the callback's
+ * command in its own interp, and their queue of invocations.
+ */
+struct ffidl_callback_pool {
+  ffidl_callback *callback;
+  Tcl_Mutex mutex;
+  Tcl_Condition work;		/* An event was queued, or exiting. */
+  Tcl_Condition ready;		/* A worker finished its initialization. */
+  ffidl_callback_event *head;	/* Queued invocations. */
+  ffidl_callback_event *tail;
+  int exiting;			/* Whether the workers should exit. */
+  int nready;			/* Number of initialized workers. */
+  char *cmdprefix;		/* Command prefix, as a list. */
+  char *init;			/* Initialization script. */
+  char *error;			/* First initialization error, or NULL. */
+  int size;			/* Number of workers. */
+  Tcl_ThreadId *threads;	/* Worker threads. */
+};
+#endif
+#endif
+
+#if USE_CALLBACKS
+/*
+ * The callback a pointer-proc argument resolved to, cached in the argument
+ * object.  Valid as long as the client's callback epoch is unchanged and,
+ * for an unqualified name, in the namespace it was resolved in.
+ */
+typedef struct ffidl_callback_ref {
+  ffidl_client *client;
+  unsigned long epoch;
+  ffidl_callback *callback;
+  Namespace *nsPtr;		/* Resolving namespace, or NULL if qualified. */
+  long nsId;
+} ffidl_callback_ref;
+static Tcl_Mutex callback_epoch_mutex;
+static unsigned long callback_epochs;
+
+/*
+ * An anonymous callback, referenced by its entry in the client's table of
+ * anonymous callbacks until ::ffidl::callback -delete, and by the callouts
+ * calling it.  The callback is freed with the last reference, or when its
+ * interp is deleted, leaving callback NULL.
+ */
+struct ffidl_callback_handle {
+  int refs;			/* Table entry and callouts referring to it. */
+  ffidl_callback *callback;
+};
+static void callback_handle_release(ffidl_callback_handle *handle);
 #endif
 
 struct ffidl_lib {
@@ -936,11 +1457,11 @@ static const Tcl_ObjType *ffidl_double_ObjType;
  * initializing a static data pointer with the address of a data object declared
  * with the dllimport attribute, as is the case such with libffi's types.  See
  * https://docs.microsoft.com/en-us/cpp/c-language/rules-and-limitations-for-dllimport-dllexport
- * for details.  Instead, we initialize it in the client_alloc procedure.
+ * for details.  Instead, we initialize it in the registry_init procedure.
  */
 #define init_type(size,type,class,alignment) { 1/*refs*/, size, type, class|FFIDL_STATIC_TYPE, alignment, 0/*nelts*/, 0/*elements*/, 0/*libtype*/}
 
-/* NOTE: remember to update the "initialize types" section in client_alloc(). */
+/* NOTE: remember to update registry_init(). */
 static ffidl_type ffidl_type_void = init_type(0, FFIDL_VOID, FFIDL_RET|FFIDL_CBRET, 0);
 static ffidl_type ffidl_type_char = init_type(SIZEOF_CHAR, FFIDL_CHAR, FFIDL_ALL|FFIDL_GETINT, ALIGNOF_CHAR);
 static ffidl_type ffidl_type_schar = init_type(SIZEOF_CHAR, FFIDL_SCHAR, FFIDL_ALL|FFIDL_GETINT, ALIGNOF_CHAR);
@@ -985,6 +1506,20 @@ static ffidl_type ffidl_type_pointer_var   = init_type(SIZEOF_VOID_P, FFIDL_PTR_
 static ffidl_type ffidl_type_pointer_proc = init_type(SIZEOF_VOID_P, FFIDL_PTR_PROC, FFIDL_ARG, ALIGNOF_VOID_P);
 #endif
 
+/*
+ * The process wide registry of aggregate types and prepared signatures,
+ * shared by all interpreters and threads.  Typedef names stay private to
+ * each client, the types they name are interned here by their elements,
+ * so that identical definitions share one ffidl_type, and cifs share the
+ * ffidl_sig of their protocol and types.  The base types are set up once,
+ * when the first client is allocated.  The mutex guards the tables and the
+ * reference counts of the types and sigs in them.
+ */
+static Tcl_Mutex registry_mutex;
+static int registry_initialized;
+static Tcl_HashTable registry_types;	/* aggregate types keyed by elements */
+static Tcl_HashTable registry_sigs;	/* ffidl_sigs keyed by protocol and types */
+
 /*****************************************
  *
  * Functions defined in this file.
@@ -1169,7 +1704,7 @@ static int ffidlclose(Tcl_Interp *interp,
   ((Tcl_FSUnloadFileProc*)unload)((Tcl_LoadHandle)handle);
 #elif defined(USE_TCL_LOADFILE)
   status = Tcl_FSUnloadFile(interp, (Tcl_LoadHandle)handle);
-  if (status != TCL_OK) {
+  if (status != TCL_OK && interp != NULL) {
     error = Tcl_GetStringResult(interp);
   }
 #else
@@ -1185,7 +1720,7 @@ static int ffidlclose(Tcl_Interp *interp,
   }
 #endif
 #endif
-  if (status != TCL_OK) {
+  if (status != TCL_OK && interp != NULL) {
     Tcl_AppendResult(interp, "couldn't unload lib \"", libraryName, "\": ",
 		     error, (char *) NULL);
   }
@@ -1379,17 +1914,50 @@ static void type_free(ffidl_type *type)
 {
   Tcl_Free((void *)type);
 }
-/* maintain reference counts on type's */
-static void type_inc_ref(ffidl_type *type)
+/* build the registry key of an aggregate type, from its elements */
+static void type_key(ffidl_type *type, Tcl_DString *key)
 {
-  type->refs += 1;
+  char buff[32];
+  int i;
+  Tcl_DStringInit(key);
+  for (i = 0; i < type->nelts; i += 1) {
+    sprintf(buff, "%p ", (void *)type->elements[i]);
+    Tcl_DStringAppend(key, buff, -1);
+  }
 }
-static void type_dec_ref(ffidl_type *type)
+/* maintain reference counts on type's, the static ones are never freed */
+static void type_inc_ref_locked(ffidl_type *type)
 {
-  if (--type->refs == 0) {
+  if ((type->class & FFIDL_STATIC_TYPE) == 0) {
+    type->refs += 1;
+  }
+}
+static void type_dec_ref_locked(ffidl_type *type)
+{
+  if ((type->class & FFIDL_STATIC_TYPE) == 0 && --type->refs == 0) {
+    Tcl_DString key;
+    int i;
+    type_key(type, &key);
+    Tcl_DeleteHashEntry(Tcl_FindHashEntry(&registry_types, Tcl_DStringValue(&key)));
+    Tcl_DStringFree(&key);
+    for (i = 0; i < type->nelts; i += 1) {
+      type_dec_ref_locked(type->elements[i]);
+    }
     type_free(type);
   }
 }
+static void type_inc_ref(ffidl_type *type)
+{
+  Tcl_MutexLock(&registry_mutex);
+  type_inc_ref_locked(type);
+  Tcl_MutexUnlock(&registry_mutex);
+}
+static void type_dec_ref(ffidl_type *type)
+{
+  Tcl_MutexLock(&registry_mutex);
+  type_dec_ref_locked(type);
+  Tcl_MutexUnlock(&registry_mutex);
+}
 /* prep a type for use by the library */
 static int type_prep(ffidl_type *type)
 {
@@ -1458,6 +2026,41 @@ static int type_prep(ffidl_type *type)
 #endif
   return TCL_OK;
 }
+/*
+ * Return the registered aggregate type with the elements of newtype, with a
+ * reference for the caller, registering and prepping newtype if there is
+ * none yet.  newtype is freed otherwise, or if it cannot be prepped, in
+ * which case NULL is returned.
+ */
+static ffidl_type *type_intern(ffidl_type *newtype)
+{
+  Tcl_DString key;
+  Tcl_HashEntry *entry;
+  ffidl_type *type = newtype;
+  int i, isNew;
+
+  type_key(newtype, &key);
+  Tcl_MutexLock(&registry_mutex);
+  entry = Tcl_CreateHashEntry(&registry_types, Tcl_DStringValue(&key), &isNew);
+  if ( ! isNew) {
+    type = Tcl_GetHashValue(entry);
+    type->refs += 1;
+    type_free(newtype);
+  } else if (type_prep(newtype) != TCL_OK) {
+    Tcl_DeleteHashEntry(entry);
+    type_free(newtype);
+    type = NULL;
+  } else {
+    for (i = 0; i < newtype->nelts; i += 1) {
+      type_inc_ref_locked(newtype->elements[i]);
+    }
+    newtype->refs = 1;
+    Tcl_SetHashValue(entry, newtype);
+  }
+  Tcl_MutexUnlock(&registry_mutex);
+  Tcl_DStringFree(&key);
+  return type;
+}
 /*
  * cif, ie call signature, management.
  */
@@ -1476,38 +2079,51 @@ static Tcl_HashEntry *cif_find(ffidl_client *client, ffidl_cif *cif)
 {
   return entry_find(&client->cifs,(void *)cif);
 }
-/* allocate a cif and its parts */
-static ffidl_cif *cif_alloc(ffidl_client *client, int argc)
+static void sig_dec_ref(ffidl_sig *sig);
+/*
+ * Allocate a cif of a client, taking over a reference to its shared sig.
+ * The argument type names, as written in argv, are kept with the cif.
+ */
+static ffidl_cif *cif_alloc(ffidl_client *client, ffidl_sig *sig, Tcl_Obj *CONST argv[])
 {
-  /* allocate storage for:
-     the ffidl_cif,
-     the argument ffi_type pointers,
-     the argument ffidl_types,
-     the argument values,
-     and the argument value pointers. */
   ffidl_cif *cif;
-  cif = (ffidl_cif *)Tcl_Alloc(sizeof(ffidl_cif)
-			       +argc*sizeof(ffidl_type*) /* atypes */
-#if USE_LIBFFI
-			       +argc*sizeof(ffi_type*) /* lib_atypes */
-#endif /* USE_LIBFFI */
-    );
+  char *name;
+  int i, len = 0;
+  for (i = 0; i < sig->argc; i += 1) {
+    len += strlen(Tcl_GetString(argv[i])) + 1;
+  }
+  cif = (ffidl_cif *)Tcl_Alloc(sizeof(ffidl_cif) + sig->argc*sizeof(char *) + len);
   if (cif == NULL) {
     return NULL;
   }
+  /* copy the argument type names */
+  cif->anames = (char **)(cif+1);
+  name = (char *)(cif->anames+sig->argc);
+  for (i = 0; i < sig->argc; i += 1) {
+    cif->anames[i] = strcpy(name, Tcl_GetString(argv[i]));
+    name += strlen(name) + 1;
+  }
   /* initialize the cif */
   cif->refs = 0;
   cif->client = client;
-  cif->argc = argc;
-  cif->atypes = (ffidl_type **)(cif+1);
+  cif->sig = sig;
+  cif->protocol = sig->protocol;
+  cif->rtype = sig->rtype;
+  cif->argc = sig->argc;
+  cif->atypes = sig->atypes;
 #if USE_LIBFFI
-  cif->lib_atypes = (ffi_type **)(cif->atypes+argc);
+  cif->lib_atypes = sig->lib_atypes;
+  cif->lib_cif = sig->lib_cif;
+#if USE_CALLBACKS
+  cif->closures = NULL;
+#endif
 #endif /* USE_LIBFFI */
   return cif;
 }
 /* free a cif */
 void cif_free(ffidl_cif *cif)
 {
+  sig_dec_ref(cif->sig);
   Tcl_Free((void *)cif);
 }
 /* maintain reference counts on cif's */
@@ -1578,23 +2194,35 @@ static int cif_type_check_context(Tcl_Interp *interp, unsigned context,
 /**
  * Check whether we can support the raw API on the @p cif.
  */
+/* whether an argument of this type takes a raw slot holding a pointer to its value */
+#define FFIDL_RAW_STRUCT(type) (!FFI_NATIVE_RAW_API && (type)->typecode == FFIDL_STRUCT)
+
 static int cif_raw_supported(ffidl_cif *cif)
 {
   int i;
   int raw_api_supported;
 
+#if FFI_NATIVE_RAW_API
   raw_api_supported = cif->rtype->typecode != FFIDL_STRUCT;
+#else
+  raw_api_supported = 1;
+#endif
 
   for (i = 0; i < cif->argc; i++) {
-    ffidl_type *atype = cif->atypes[i];
-    /* No raw API for structs and long double (fails assertion on
-       libffi < 3.3). */
-    if (atype->typecode == FFIDL_STRUCT
-#if HAVE_LONG_DOUBLE
-	|| atype->typecode == FFIDL_LONGDOUBLE
+    ffidl_typecode typecode = cif->atypes[i]->typecode;
+    /* No raw API for long double (fails assertion on libffi < 3.3), nor
+       for structs where the raw image is the native stack, which holds
+       them by value.  Elsewhere a struct takes a slot holding a pointer to
+       its value, see cif_raw_prep_offsets(). */
+#if FFI_NATIVE_RAW_API
+    if (typecode == FFIDL_STRUCT)
+      raw_api_supported = 0;
 #endif
-      )
+#if HAVE_LONG_DOUBLE
+    if (typecode == FFIDL_LONGDOUBLE)
       raw_api_supported = 0;
+#endif
+    (void)typecode;
   }
   return raw_api_supported;
 }
@@ -1610,7 +2238,8 @@ static int cif_raw_prep_offsets(ffidl_cif *cif, ptrdiff_t *offsets)
 
   for (i = 0; i < cif->argc; i += 1) {
     offsets[i] = offset;
-    offset += cif->atypes[i]->size;
+    /* structs are passed by pointer */
+    offset += FFIDL_RAW_STRUCT(cif->atypes[i]) ? sizeof(void *) : cif->atypes[i]->size;
     /* align offset, so total bytes is correct */
     if (offset & (FFI_SIZEOF_ARG-1))
       offset = (offset|(FFI_SIZEOF_ARG-1))+1;
@@ -1623,24 +2252,90 @@ static int cif_raw_prep_offsets(ffidl_cif *cif, ptrdiff_t *offsets)
 }
 #endif
 
-/* do any library dependent prep for this cif */
-static int cif_prep(ffidl_cif *cif)
+/* do any library dependent prep for this sig */
+static int sig_prep(ffidl_sig *sig)
 {
 #if USE_LIBFFI
   ffi_type *lib_rtype;
   int i;
   ffi_type **lib_atypes;
-  lib_rtype = cif->rtype->lib_type;
-  lib_atypes = cif->lib_atypes;
-  for (i = 0; i < cif->argc; i += 1) {
-    lib_atypes[i] = cif->atypes[i]->lib_type;
+  lib_rtype = sig->rtype->lib_type;
+  lib_atypes = sig->lib_atypes;
+  for (i = 0; i < sig->argc; i += 1) {
+    lib_atypes[i] = sig->atypes[i]->lib_type;
   }
-  if (ffi_prep_cif(&cif->lib_cif, cif->protocol, cif->argc, lib_rtype, lib_atypes) != FFI_OK) {
+  if (ffi_prep_cif(&sig->lib_cif, sig->protocol, sig->argc, lib_rtype, lib_atypes) != FFI_OK) {
     return TCL_ERROR;
   }
 #endif
   return TCL_OK;
 }
+/*
+ * Return the registered sig with the given key, with a reference for the
+ * caller, registering and prepping a new one if there is none yet.  Returns
+ * NULL if it cannot be prepped.
+ */
+static ffidl_sig *sig_get(char *key, int protocol, ffidl_type *rtype, int argc, ffidl_type **atypes)
+{
+  Tcl_HashEntry *entry;
+  ffidl_sig *sig;
+  int i, isNew;
+
+  Tcl_MutexLock(&registry_mutex);
+  entry = Tcl_CreateHashEntry(&registry_sigs, key, &isNew);
+  if ( ! isNew) {
+    sig = Tcl_GetHashValue(entry);
+    sig->refs += 1;
+    Tcl_MutexUnlock(&registry_mutex);
+    return sig;
+  }
+  /* allocate storage for the ffidl_sig, the argument ffidl_types and the
+     argument ffi_types */
+  sig = (ffidl_sig *)Tcl_Alloc(sizeof(ffidl_sig)
+			       +argc*sizeof(ffidl_type*) /* atypes */
+#if USE_LIBFFI
+			       +argc*sizeof(ffi_type*) /* lib_atypes */
+#endif /* USE_LIBFFI */
+    );
+  sig->refs = 1;
+  sig->entry = entry;
+  sig->protocol = protocol;
+  sig->rtype = rtype;
+  sig->argc = argc;
+  sig->atypes = (ffidl_type **)(sig+1);
+  memcpy(sig->atypes, atypes, argc*sizeof(ffidl_type*));
+#if USE_LIBFFI
+  sig->lib_atypes = (ffi_type **)(sig->atypes+argc);
+#endif /* USE_LIBFFI */
+  if (sig_prep(sig) != TCL_OK) {
+    Tcl_DeleteHashEntry(entry);
+    Tcl_Free((void *)sig);
+    sig = NULL;
+  } else {
+    /* the types are kept as long as the sig */
+    type_inc_ref_locked(rtype);
+    for (i = 0; i < argc; i += 1) {
+      type_inc_ref_locked(atypes[i]);
+    }
+    Tcl_SetHashValue(entry, sig);
+  }
+  Tcl_MutexUnlock(&registry_mutex);
+  return sig;
+}
+static void sig_dec_ref(ffidl_sig *sig)
+{
+  int i;
+  Tcl_MutexLock(&registry_mutex);
+  if (--sig->refs == 0) {
+    Tcl_DeleteHashEntry(sig->entry);
+    type_dec_ref_locked(sig->rtype);
+    for (i = 0; i < sig->argc; i += 1) {
+      type_dec_ref_locked(sig->atypes[i]);
+    }
+    Tcl_Free((void *)sig);
+  }
+  Tcl_MutexUnlock(&registry_mutex);
+}
 
 struct ffidl_protocolmap {
   char *protocolname;
@@ -1722,8 +2417,10 @@ static int cif_parse(Tcl_Interp *interp, ffidl_client *client, Tcl_Obj *args, Tc
 {
   int argc, protocol, i;
   Tcl_Obj **argv;
-  char *protocolname;
-  Tcl_DString signature;
+  char *protocolname, buff[32];
+  Tcl_DString signature, key;
+  ffidl_type *rtype, **atypes = NULL;
+  ffidl_sig *sig;
   ffidl_cif *cif = NULL;
   /* fetch argument types */
   if (Tcl_ListObjGetElements(interp, args, &argc, &argv) == TCL_ERROR) return TCL_ERROR;
@@ -1745,28 +2442,46 @@ static int cif_parse(Tcl_Interp *interp, ffidl_client *client, Tcl_Obj *args, Tc
   /* lookup the signature in the cif hash */
   cif = cif_lookup(client, Tcl_DStringValue(&signature));
   if (cif == NULL) {
-    cif = cif_alloc(client, argc);
-    cif->protocol = protocol;
-    if (cif == NULL) {
-      Tcl_AppendResult(interp, "couldn't allocate the ffidl_cif", NULL); 
-      goto error;
-    }
+    /* the shared sig is keyed by the protocol and the types the names
+       resolve to in this client, so that signatures spelled with
+       different aliases of the same types share it */
+    atypes = (ffidl_type **)Tcl_Alloc((argc+1)*sizeof(ffidl_type *));
+    Tcl_DStringInit(&key);
+    sprintf(buff, "%d", protocol);
+    Tcl_DStringAppend(&key, buff, -1);
     /* parse return value spec */
-    if (cif_type_parse(interp, client, ret, &cif->rtype) == TCL_ERROR) {
+    if (cif_type_parse(interp, client, ret, &rtype) == TCL_ERROR) {
       goto error;
     }
+    sprintf(buff, " %p", (void *)rtype);
+    Tcl_DStringAppend(&key, buff, -1);
     /* parse arg specs */
-    for (i = 0; i < argc; i += 1)
-      if (cif_type_parse(interp, client, argv[i], &cif->atypes[i]) == TCL_ERROR) {
+    for (i = 0; i < argc; i += 1) {
+      if (cif_type_parse(interp, client, argv[i], &atypes[i]) == TCL_ERROR) {
 	goto error;
       }
+      sprintf(buff, " %p", (void *)atypes[i]);
+      Tcl_DStringAppend(&key, buff, -1);
+    }
     /* see if we done right */
-    if (cif_prep(cif) != TCL_OK) {
+    sig = sig_get(Tcl_DStringValue(&key), protocol, rtype, argc, atypes);
+    if (sig == NULL) {
       Tcl_AppendResult(interp, "type definition error", NULL);
       goto error;
     }
+    cif = cif_alloc(client, sig, argv);
+    if (cif == NULL) {
+      sig_dec_ref(sig);
+      Tcl_AppendResult(interp, "couldn't allocate the ffidl_cif", NULL);
+      goto error;
+    }
+    Tcl_Free((void *)atypes);
+    Tcl_DStringFree(&key);
     /* define the cif */
     cif_define(client, Tcl_DStringValue(&signature), cif);
+#if USE_LIBFFI && USE_CALLBACKS
+    cif->closures = entry_lookup(&client->closures, Tcl_DStringValue(&signature));
+#endif
     Tcl_ResetResult(interp);
   }
   /* free the signature string */
@@ -1777,63 +2492,457 @@ static int cif_parse(Tcl_Interp *interp, ffidl_client *client, Tcl_Obj *args, Tc
   *cifp = cif;
   return TCL_OK;
 error:
-  if (cif) {
-    cif_free(cif);
+  if (atypes) {
+    Tcl_Free((void *)atypes);
+    Tcl_DStringFree(&key);
   }
   Tcl_DStringFree(&signature);
   return TCL_ERROR;
 }
+#if USE_JIT
 /*
- * callout management
+ * Native call stubs for the x86-64 System V ABI.
+ *
+ * jit_compile() emits, for callouts whose arguments are all integer, pointer,
+ * float or double scalars passed in registers, a stub equivalent to
+ *
+ *   void stub(void **args, void *ret) { *ret = fn(*args[0], *args[1], ...); }
+ *
+ * which is called by callout_call() instead of ffi_call().  Other callouts
+ * keep using libffi.
  */
-/* define a new callout */
-static void callout_define(ffidl_client *client, char *pname, ffidl_callout *callout)
+#define JIT_MAX_CODE 256
+
+/*
+ * The stubs are packed into shared code pages.  The page being filled is
+ * writable, and made read and execute only, for good, once it is full or
+ * one of its stubs has been called JIT_SEAL_CALLS times through libffi;
+ * later stubs go to a new page.  So no page is ever writable and
+ * executable at once, no stub runs from a page which is still written,
+ * and callouts called once after their definition still share pages.  A
+ * page is unmapped with its last stub.
+ */
+typedef struct ffidl_jit_page {
+  unsigned char *base;
+  size_t size;
+  size_t used;			/* Bytes taken by stubs. */
+  int refs;			/* Stubs in the page, plus one while filled. */
+  int sealed;			/* Whether the page is executable. */
+} ffidl_jit_page;
+static Tcl_Mutex jit_mutex;
+static ffidl_jit_page *jit_fill;	/* Page being filled, or NULL. */
+#define JIT_PAGE_SIZE 4096
+#define JIT_SEAL_CALLS 64
+
+/* drop a reference to a code page, unmapping it with the last; under jit_mutex */
+static void jit_page_release(ffidl_jit_page *page)
 {
-  entry_define(&client->callouts,pname,(void*)callout);
+  if (--page->refs == 0) {
+    munmap(page->base, page->size);
+    Tcl_Free((void *)page);
+  }
 }
-/* lookup an existing callout */
-static ffidl_callout *callout_lookup(ffidl_client *client, char *pname)
+
+/* copy a stub into the page being filled, starting a new page if needed */
+static unsigned char *jit_page_alloc(unsigned char *code, size_t size, ffidl_jit_page **pagep)
 {
-  return entry_lookup(&client->callouts,pname);
-}
-/* find a callout by it's ffidl_callout */
-static Tcl_HashEntry *callout_find(ffidl_client *client, ffidl_callout *callout)
+  ffidl_jit_page *page;
+  unsigned char *stub = NULL;
+
+  Tcl_MutexLock(&jit_mutex);
+  if (jit_fill != NULL && jit_fill->used + size > jit_fill->size) {
+    /* stubs already in the page are sealed when first called */
+    jit_page_release(jit_fill);
+    jit_fill = NULL;
+  }
+  if (jit_fill == NULL) {
+    void *mem = mmap(NULL, JIT_PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (mem != MAP_FAILED) {
+      jit_fill = (ffidl_jit_page *)Tcl_Alloc(sizeof(ffidl_jit_page));
+      jit_fill->base = (unsigned char *)mem;
+      jit_fill->size = JIT_PAGE_SIZE;
+      jit_fill->used = 0;
+      jit_fill->refs = 1;
+      jit_fill->sealed = 0;
+    }
+  }
+  if ((page = jit_fill) != NULL) {
+    stub = page->base + page->used;
+    memcpy(stub, code, size);
+    /* keep the stubs 16 byte aligned */
+    page->used += (size + 15) & ~(size_t)15;
+    page->refs += 1;
+  }
+  *pagep = page;
+  Tcl_MutexUnlock(&jit_mutex);
+  return stub;
+}
+
+/*
+ * Make the callout's stub executable, sealing its page, unless the page is
+ * still filled and the callout was not called often yet.  Returns the
+ * stub, or NULL to call through libffi, for good if the page cannot be
+ * made executable.
+ */
+static void (*jit_publish(ffidl_callout *callout))(void **, void *)
+{
+  ffidl_jit_page *page = callout->jit_page;
+
+  Tcl_MutexLock(&jit_mutex);
+  if (page == jit_fill && ++callout->jit_calls < JIT_SEAL_CALLS) {
+    Tcl_MutexUnlock(&jit_mutex);
+    return NULL;
+  }
+  if (!page->sealed) {
+    if (mprotect(page->base, page->size, PROT_READ|PROT_EXEC) == 0) {
+      page->sealed = 1;
+    } else {
+      callout->jit_code = NULL;
+    }
+    if (page == jit_fill) {
+      jit_fill = NULL;
+      jit_page_release(page);
+    }
+  }
+  if (callout->jit_code != NULL) {
+    callout->jit = (void (*)(void **, void *))callout->jit_code;
+  }
+  Tcl_MutexUnlock(&jit_mutex);
+  return callout->jit;
+}
+
+/* Emit a load of the integer at [r10] into general purpose register reg. */
+static unsigned char *jit_emit_int_load(unsigned char *p, int reg, size_t size, int is_signed)
+{
+  unsigned char rex = 0x41 | (reg >= 8 ? 0x04 : 0);	/* REX.B for r10 */
+  unsigned char modrm = ((reg & 7) << 3) | 2;		/* [r10] */
+  switch (size) {
+  case 1:
+  case 2:
+    /* movsx/movzx r32, byte/word [r10] */
+    *p++ = rex;
+    *p++ = 0x0F;
+    *p++ = (is_signed ? 0xBE : 0xB6) | (size == 2 ? 1 : 0);
+    *p++ = modrm;
+    break;
+  case 4:
+    /* mov r32, [r10] */
+    *p++ = rex;
+    *p++ = 0x8B;
+    *p++ = modrm;
+    break;
+  default:
+    /* mov r64, [r10] */
+    *p++ = rex | 0x08;
+    *p++ = 0x8B;
+    *p++ = modrm;
+    break;
+  }
+  return p;
+}
+
+/* Emit a load of the float or double at [r10] into register xmm. */
+static unsigned char *jit_emit_sse_load(unsigned char *p, int xmm, size_t size)
+{
+  *p++ = size == 4 ? 0xF3 : 0xF2;	/* movss or movsd */
+  *p++ = 0x41;				/* REX.B for r10 */
+  *p++ = 0x0F;
+  *p++ = 0x10;
+  *p++ = (xmm << 3) | 2;		/* xmm, [r10] */
+  return p;
+}
+
+/* Return whether the type is passed and returned in general purpose registers. */
+static int jit_type_is_int(ffidl_type *type)
+{
+  switch (type->typecode) {
+  case FFIDL_INT:
+  case FFIDL_UINT8:
+  case FFIDL_SINT8:
+  case FFIDL_UINT16:
+  case FFIDL_SINT16:
+  case FFIDL_UINT32:
+  case FFIDL_SINT32:
+#if HAVE_INT64
+  case FFIDL_UINT64:
+  case FFIDL_SINT64:
+#endif
+  case FFIDL_PTR:
+  case FFIDL_PTR_BYTE:
+  case FFIDL_PTR_OBJ:
+  case FFIDL_PTR_UTF8:
+  case FFIDL_PTR_UTF16:
+  case FFIDL_PTR_VAR:
+#if USE_CALLBACKS
+  case FFIDL_PTR_PROC:
+#endif
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/* Return whether the type is passed and returned in SSE registers. */
+static int jit_type_is_sse(ffidl_type *type)
+{
+  return type->typecode == FFIDL_FLOAT || type->typecode == FFIDL_DOUBLE;
+}
+
+/* Return whether the integer type is signed. */
+static int jit_type_is_signed(ffidl_type *type)
+{
+  switch (type->typecode) {
+  case FFIDL_INT:
+  case FFIDL_SINT8:
+  case FFIDL_SINT16:
+  case FFIDL_SINT32:
+#if HAVE_INT64
+  case FFIDL_SINT64:
+#endif
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/*
+ * Compile a native call stub for the callout, if its signature allows it.
+ * Leaves callout->jit NULL otherwise.
+ */
+static void jit_compile(ffidl_callout *callout)
+{
+  /* rdi, rsi, rdx, rcx, r8, r9 */
+  static const int int_regs[] = { 7, 6, 2, 1, 8, 9 };
+  ffidl_cif *cif = callout->cif;
+  ffidl_type *rtype = cif->rtype;
+  unsigned char code[JIT_MAX_CODE], *p = code;
+  int i, nint = 0, nsse = 0;
+  unsigned long long fn = (unsigned long long)(size_t)callout->fn;
+
+  callout->jit = NULL;
+  callout->jit_code = NULL;
+  callout->jit_page = NULL;
+  callout->jit_calls = 0;
+
+  if (cif->protocol != FFI_DEFAULT_ABI) return;
+  if (rtype->typecode != FFIDL_VOID && !jit_type_is_int(rtype) && !jit_type_is_sse(rtype)) return;
+  for (i = 0; i < cif->argc; i += 1) {
+    if (jit_type_is_int(cif->atypes[i])) {
+      if (++nint > 6) return;
+    } else if (jit_type_is_sse(cif->atypes[i])) {
+      if (++nsse > 8) return;
+    } else {
+      return;
+    }
+  }
+
+  *p++ = 0x53;					/* push rbx (aligns the stack) */
+  *p++ = 0x48; *p++ = 0x89; *p++ = 0xF3;	/* mov rbx, rsi */
+  *p++ = 0x49; *p++ = 0x89; *p++ = 0xFB;	/* mov r11, rdi */
+  nint = nsse = 0;
+  for (i = 0; i < cif->argc; i += 1) {
+    ffidl_type *atype = cif->atypes[i];
+    /* mov r10, [r11+8*i] */
+    *p++ = 0x4D; *p++ = 0x8B; *p++ = 0x53; *p++ = (unsigned char)(8*i);
+    if (jit_type_is_sse(atype)) {
+      p = jit_emit_sse_load(p, nsse++, atype->size);
+    } else {
+      p = jit_emit_int_load(p, int_regs[nint++], atype->size, jit_type_is_signed(atype));
+    }
+  }
+  /* mov eax, nsse (for variadic functions) */
+  *p++ = 0xB8; *p++ = (unsigned char)nsse; *p++ = 0; *p++ = 0; *p++ = 0;
+  /* mov r11, fn */
+  *p++ = 0x49; *p++ = 0xBB;
+  for (i = 0; i < 8; i += 1) {
+    *p++ = (unsigned char)(fn >> (8*i));
+  }
+  *p++ = 0x41; *p++ = 0xFF; *p++ = 0xD3;	/* call r11 */
+  if (rtype->typecode == FFIDL_FLOAT) {
+    *p++ = 0xF3; *p++ = 0x0F; *p++ = 0x11; *p++ = 0x03;	/* movss [rbx], xmm0 */
+  } else if (rtype->typecode == FFIDL_DOUBLE) {
+    *p++ = 0xF2; *p++ = 0x0F; *p++ = 0x11; *p++ = 0x03;	/* movsd [rbx], xmm0 */
+  } else if (rtype->typecode != FFIDL_VOID) {
+    /* The full register is stored, as libffi does for its widened return
+       values. */
+    *p++ = 0x48; *p++ = 0x89; *p++ = 0x03;		/* mov [rbx], rax */
+  }
+  *p++ = 0x5B;					/* pop rbx */
+  *p++ = 0xC3;					/* ret */
+
+  /* the stub becomes executable when first called, see jit_publish() */
+  callout->jit_code = jit_page_alloc(code, p - code, &callout->jit_page);
+}
+
+/* Free the callout's native call stub, if any. */
+static void jit_free(ffidl_callout *callout)
+{
+  if (callout->jit_page) {
+    Tcl_MutexLock(&jit_mutex);
+    jit_page_release(callout->jit_page);
+    Tcl_MutexUnlock(&jit_mutex);
+    callout->jit_page = NULL;
+    callout->jit_code = NULL;
+    callout->jit = NULL;
+  }
+}
+#endif	/* USE_JIT */
+
+#if USE_THUNKS
+/*
+ * Specialized call thunks.
+ *
+ * ffidl_thunks.h, generated by ffidl_thunks.tcl, defines a plain C function
+ * for each signature of up to FFIDL_THUNK_MAXARGS arguments of type int,
+ * 64 bit integer, pointer or double returning one of those or void, e.g.
+ *
+ *   void ffidl_thunk_d_dd(void (*fn)(void), void **args, void *ret)
+ *   {
+ *     *(double *)ret = ((double (*)(double, double))fn)(*(double *)args[0], *(double *)args[1]);
+ *   }
+ *
+ * so that these callouts are made by the C compiler's own calling sequence
+ * instead of ffi_call(), without generating code at run time.
+ */
+#include "ffidl_thunks.h"
+
+#define THUNK_NONE	-1
+#define THUNK_VOID	0
+#define THUNK_INT	1
+#define THUNK_INT64	2
+#define THUNK_PTR	3
+#define THUNK_DOUBLE	4
+
+/* Return the thunk class of the type, or THUNK_NONE. */
+static int thunk_class(ffidl_type *type)
+{
+  switch (type->typecode) {
+  case FFIDL_VOID:
+    return THUNK_VOID;
+#if SIZEOF_INT == 4
+  case FFIDL_INT:
+#endif
+  case FFIDL_SINT32:
+    return THUNK_INT;
+#if HAVE_INT64
+  case FFIDL_SINT64:
+    return THUNK_INT64;
+#endif
+  case FFIDL_PTR:
+  case FFIDL_PTR_BYTE:
+  case FFIDL_PTR_OBJ:
+  case FFIDL_PTR_UTF8:
+  case FFIDL_PTR_UTF16:
+  case FFIDL_PTR_VAR:
+#if USE_CALLBACKS
+  case FFIDL_PTR_PROC:
+#endif
+    return THUNK_PTR;
+  case FFIDL_DOUBLE:
+    return THUNK_DOUBLE;
+  default:
+    return THUNK_NONE;
+  }
+}
+
+/* Return the thunk matching the callout's signature, or NULL. */
+static ffidl_thunk *thunk_lookup(ffidl_callout *callout)
+{
+  ffidl_cif *cif = callout->cif;
+  int i, n, tclass, index = 0, offset = 0;
+
+#if USE_LIBFFI
+  if (cif->protocol != FFI_DEFAULT_ABI) return NULL;
+#endif
+  if (cif->argc > FFIDL_THUNK_MAXARGS) return NULL;
+  /* The table holds 5*4^n thunks for each argument count n. */
+  for (n = 1, i = 0; i < cif->argc; i += 1, n *= 4) {
+    offset += 5 * n;
+  }
+  tclass = thunk_class(cif->rtype);
+  if (tclass == THUNK_NONE) return NULL;
+  index = tclass;
+  for (i = 0; i < cif->argc; i += 1) {
+    tclass = thunk_class(cif->atypes[i]);
+    if (tclass == THUNK_NONE || tclass == THUNK_VOID) return NULL;
+    index = index * 4 + tclass - 1;
+  }
+  return ffidl_thunks[offset + index];
+}
+#endif	/* USE_THUNKS */
+
+/*
+ * callout management
+ */
+/* define a new callout */
+static void callout_define(ffidl_client *client, char *pname, ffidl_callout *callout)
+{
+  entry_define(&client->callouts,pname,(void*)callout);
+}
+/* lookup an existing callout */
+static ffidl_callout *callout_lookup(ffidl_client *client, char *pname)
+{
+  return entry_lookup(&client->callouts,pname);
+}
+/* find a callout by it's ffidl_callout */
+static Tcl_HashEntry *callout_find(ffidl_client *client, ffidl_callout *callout)
 {
   return entry_find(&client->callouts,(void *)callout);
 }
+static void memo_free(ffidl_memo_cache *memo);
+
+/* free a callout, once none of its -async calls is running any more */
+static void callout_destroy(char *blockPtr)
+{
+  ffidl_callout *callout = (ffidl_callout *)blockPtr;
+#if USE_JIT
+  jit_free(callout);
+#endif
+  while (callout->frames != NULL) {
+    ffidl_frame *frame = callout->frames;
+    callout->frames = frame->next;
+    Tcl_Free((void *)frame);
+  }
+  if (callout->memo) {
+    memo_free(callout->memo);
+  }
+  if (callout->nbound) {
+    int i;
+    for (i = 0; i < callout->nbound; i += 1) {
+      Tcl_DecrRefCount(callout->bound[i]);
+    }
+    Tcl_Free((void *)callout->bound_values);
+  }
+  if (callout->handle) {
+    callback_handle_release(callout->handle);
+  }
+  cif_dec_ref(callout->cif);
+  Tcl_Free((void *)callout);
+}
 /* cleanup on ffidl_callout_call deletion */
 static void callout_delete(ClientData clientData)
 {
   ffidl_callout *callout = (ffidl_callout *)clientData;
   Tcl_HashEntry *entry = callout_find(callout->client, callout);
   if (entry) {
-    cif_dec_ref(callout->cif);
-    Tcl_Free((void *)callout);
     Tcl_DeleteHashEntry(entry);
+    Tcl_EventuallyFree((ClientData)callout, callout_destroy);
   }
 }
 /**
- * Parse an argument or return type specification.
+ * Check an argument or return type specification.
  *
- * After invoking this function, @p type points to the @c ffidl_type
- * corresponding to @p typename, and @p argp is initialized
+ * The storage for the values themselves is provided by each invocation's
+ * frame, see callout_frame_get().
  *
  * @param[in] interp Tcl interpreter.
- * @param[in] client Ffidle data.
  * @param[in] context Context where the type has been found.
- * @param[in] typename Tcl_Obj whose string representation is a type name.
- * @param[out] typePtr Points to the place to store the pointer to the parsed @c
- *     ffidl_type.
- * @param[in] valueArea Points to the area where values @p argp values should be
- *     stored.
- * @param[out] valuePtr Points to the place to store the address within @p valueArea
- *     where the arguments are to be retrieved or the return value shall be
- *     placed upon callout.
+ * @param[in] typeNameObj Tcl_Obj whose string representation is a type name.
+ * @param[in] typePtr The parsed @c ffidl_type.
  * @return TCL_OK if successful, TCL_ERROR otherwise.
  */
 static int callout_prep_value(Tcl_Interp *interp, unsigned context,
-			      Tcl_Obj *typeNameObj, ffidl_type *typePtr,
-			      ffidl_value *valueArea, void **valuePtr)
+			      Tcl_Obj *typeNameObj, ffidl_type *typePtr)
 {
   char buff[128];
 
@@ -1841,16 +2950,9 @@ static int callout_prep_value(Tcl_Interp *interp, unsigned context,
   if (cif_type_check_context(interp, context, typeNameObj, typePtr) != TCL_OK) {
     return TCL_ERROR;
   }
-  /* set arg value pointer */
   switch (typePtr->typecode) {
   case FFIDL_VOID:
-    /* libffi depends on this being NULL on some platforms ! */
-    *valuePtr = NULL;
-    break;
   case FFIDL_STRUCT:
-    /* Will be set to a pointer to the structure's contents. */
-    *valuePtr = NULL;
-    break;
   case FFIDL_INT:
   case FFIDL_FLOAT:
   case FFIDL_DOUBLE:
@@ -1874,7 +2976,6 @@ static int callout_prep_value(Tcl_Interp *interp, unsigned context,
   case FFIDL_PTR_UTF16:
   case FFIDL_PTR_VAR:
   case FFIDL_PTR_PROC:
-    *valuePtr = (void *)valueArea;
     break;
   default:
     sprintf(buff, "unknown ffidl_type.t = %d", typePtr->typecode);
@@ -1885,1451 +2986,4731 @@ static int callout_prep_value(Tcl_Interp *interp, unsigned context,
 }
 
 /*
- * Get a C value of specified type (FFIDL_GETINT, FFIDL_GETDOUBLE,
- * FFIDL_GETWIDEINT) from a Tcl_Obj .  Note that this value must still be
- * interpreted according to the type, whether it's in argument or return
- * position (libffi quirk), etc.
+ * Get a C long from a Tcl_Obj, as specified by FFIDL_GETINT.
  */
-static inline int value_convert_to_c(Tcl_Interp *interp, ffidl_type *type, Tcl_Obj *obj, ffidl_tclobj_value *out)
+static inline int value_get_long(Tcl_Interp *interp, Tcl_Obj *obj, ffidl_tclobj_value *out)
 {
   double dtmp = 0;
   long ltmp = 0;
-#if HAVE_INT64
-  Ffidl_Int64 wtmp = 0;
-#endif
-  if (type->class & FFIDL_GETINT) {
-    if (obj->typePtr == ffidl_double_ObjType) {
-      if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
-	goto fail;
-      }
-      /* Avoid undefined behaviour when casting a non-representable value. */
-      if (dtmp >= LONG_MIN && dtmp <= LONG_MAX) {
-	ltmp = (long)dtmp;
-      }
-      if (dtmp != ltmp) {
-	/* Does not round-trip; use Tcl's conversion. */
-	if (Tcl_GetLongFromObj(interp, obj, &ltmp) == TCL_ERROR) {
-	  goto fail;
-	}
-      }
-    } else if (Tcl_GetLongFromObj(interp, obj, &ltmp) == TCL_ERROR) {
-      goto fail;
+  if (obj->typePtr == ffidl_double_ObjType) {
+    if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
+      return TCL_ERROR;
     }
-    out->v_long = ltmp;
-#if HAVE_INT64
-  } else if (type->class & FFIDL_GETWIDEINT) {
-    if (obj->typePtr == ffidl_double_ObjType) {
-      if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
-	goto fail;
-      }
-      /* Avoid undefined behaviour when casting a non-representable value. */
-      if (dtmp >= INT64_MIN && dtmp <= INT64_MAX) {
-	wtmp = (Ffidl_Int64)dtmp;
-      }
-      if (dtmp != wtmp) {
-	/* Does not round-trip; use Tcl's conversion. */
-	if (Ffidl_GetInt64FromObj(interp, obj, &wtmp) == TCL_ERROR) {
-	  goto fail;
-	}
-      }
-    } else if (Ffidl_GetInt64FromObj(interp, obj, &wtmp) == TCL_ERROR) {
-      goto fail;
+    /* Avoid undefined behaviour when casting a non-representable value. */
+    if (dtmp >= LONG_MIN && dtmp <= LONG_MAX) {
+      ltmp = (long)dtmp;
     }
-    out->v_wideint = wtmp;
-#endif
-  } else if (type->class & FFIDL_GETDOUBLE) {
-    if (obj->typePtr == ffidl_int_ObjType) {
+    if (dtmp != ltmp) {
+      /* Does not round-trip; use Tcl's conversion. */
       if (Tcl_GetLongFromObj(interp, obj, &ltmp) == TCL_ERROR) {
-	goto fail;
-      }
-      /* Avoid undefined behaviour when casting a non-representable value. */
-      if (ltmp >= DBL_MIN && ltmp <= DBL_MAX) {
-	dtmp = (double)ltmp;
-      }
-      if (dtmp != ltmp) {
-	/* Does not round-trip; use Tcl's conversion. */
-	if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
-	  goto fail;
-	}
-      }
-#if HAVE_WIDE_INT
-    } else if (obj->typePtr == ffidl_wideInt_ObjType) {
-      if (Tcl_GetWideIntFromObj(interp, obj, &wtmp) == TCL_ERROR) {
-	goto fail;
-      }
-      /* Avoid undefined behaviour when casting a non-representable value. */
-      if (wtmp >= DBL_MIN && wtmp <= DBL_MAX) {
-	dtmp = (double)wtmp;
-      }
-      if (dtmp != wtmp) {
-	/* Does not round-trip; use Tcl's conversion. */
-	if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
-	  goto fail;
-	}
+	return TCL_ERROR;
       }
-#endif
-    } else if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
-      goto fail;
     }
-    out->v_double = dtmp;
+  } else if (Tcl_GetLongFromObj(interp, obj, &ltmp) == TCL_ERROR) {
+    return TCL_ERROR;
   }
+  out->v_long = ltmp;
   return TCL_OK;
-fail:
-  return TCL_ERROR;
 }
 
-
-static int callout_prep(ffidl_callout *callout)
+#if HAVE_INT64
+/*
+ * Get a C 64 bit integer from a Tcl_Obj, as specified by FFIDL_GETWIDEINT.
+ */
+static inline int value_get_wideint(Tcl_Interp *interp, Tcl_Obj *obj, ffidl_tclobj_value *out)
 {
-#if USE_LIBFFI_RAW_API
-  int i;
-  ffidl_cif *cif = callout->cif;
-
-  callout->use_raw_api = cif_raw_supported(cif);
-
-  if (callout->use_raw_api) {
-    /* rewrite callout->args[i] into a stack image */
-    ptrdiff_t *offsets;
-    offsets = (ptrdiff_t *)Tcl_Alloc(sizeof(ptrdiff_t) * cif->argc);
-    if (TCL_OK != cif_raw_prep_offsets(cif, offsets)) {
-      Tcl_Free((void *)offsets);
+  double dtmp = 0;
+  Ffidl_Int64 wtmp = 0;
+  if (obj->typePtr == ffidl_double_ObjType) {
+    if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
       return TCL_ERROR;
     }
-    /* fprintf(stderr, "using raw api for %d args\n", cif->argc); */
-    for (i = 0; i < cif->argc; i++) {
-      /* set args[i] to args[0]+offset */
-      /* fprintf(stderr, "  arg[%d] was %08x ...", i, callout->args[i]); */
-      callout->args[i] = (void *)(((char *)callout->args[0])+offsets[i]);
-      /* fprintf(stderr, " becomes %08x\n", callout->args[i]); */
+    /* Avoid undefined behaviour when casting a non-representable value. */
+    if (dtmp >= INT64_MIN && dtmp <= INT64_MAX) {
+      wtmp = (Ffidl_Int64)dtmp;
+    }
+    if (dtmp != wtmp) {
+      /* Does not round-trip; use Tcl's conversion. */
+      if (Ffidl_GetInt64FromObj(interp, obj, &wtmp) == TCL_ERROR) {
+	return TCL_ERROR;
+      }
     }
-    /* fprintf(stderr, "  final offset %d, bytes %d\n", offset, bytes); */
-    Tcl_Free((void *)offsets);
+  } else if (Ffidl_GetInt64FromObj(interp, obj, &wtmp) == TCL_ERROR) {
+    return TCL_ERROR;
   }
-#endif
+  out->v_wideint = wtmp;
   return TCL_OK;
 }
+#endif
 
-/* make a call */
-/* consider what happens if we reenter using the same cif */  
-static void callout_call(ffidl_callout *callout)
+/*
+ * Get a C double from a Tcl_Obj, as specified by FFIDL_GETDOUBLE.
+ */
+static inline int value_get_double(Tcl_Interp *interp, Tcl_Obj *obj, ffidl_tclobj_value *out)
 {
-  ffidl_cif *cif = callout->cif;
-#if USE_LIBFFI
-#if USE_LIBFFI_RAW_API
-  if (callout->use_raw_api)
-    ffi_raw_call(&cif->lib_cif, callout->fn, callout->ret, (ffi_raw *)callout->args[0]);
-  else
-    ffi_call(&cif->lib_cif, FFI_FN(callout->fn), callout->ret, callout->args);
-#else
-  ffi_call(&cif->lib_cif, FFI_FN(callout->fn), callout->ret, callout->args);
+  double dtmp = 0;
+  long ltmp = 0;
+#if HAVE_WIDE_INT
+  Tcl_WideInt wtmp = 0;
 #endif
-#elif USE_LIBFFCALL
-  av_alist alist;
-  int i;
-  switch (cif->rtype->typecode) {
-  case FFIDL_VOID:
-    av_start_void(alist,callout->fn);
-    break;
-  case FFIDL_INT:
-    av_start_int(alist,callout->fn,callout->ret);
-    break;
-  case FFIDL_FLOAT:
-    av_start_float(alist,callout->fn,callout->ret);
-    break;
-  case FFIDL_DOUBLE:
-    av_start_double(alist,callout->fn,callout->ret);
-    break;
-  case FFIDL_UINT8:
-    av_start_uint8(alist,callout->fn,callout->ret);
-    break;
-  case FFIDL_SINT8:
-    av_start_sint8(alist,callout->fn,callout->ret);
-    break;
-  case FFIDL_UINT16:
-    av_start_uint16(alist,callout->fn,callout->ret);
-    break;
-  case FFIDL_SINT16:
-    av_start_sint16(alist,callout->fn,callout->ret);
-    break;
-  case FFIDL_UINT32:
-    av_start_uint32(alist,callout->fn,callout->ret);
-    break;
-  case FFIDL_SINT32:
-    av_start_sint32(alist,callout->fn,callout->ret);
-    break;
-#if HAVE_INT64
-  case FFIDL_UINT64:
-    av_start_uint64(alist,callout->fn,callout->ret);
-    break;
-  case FFIDL_SINT64:
-    av_start_sint64(alist,callout->fn,callout->ret);
-    break;
-#endif
-  case FFIDL_STRUCT:
-    _av_start_struct(alist,callout->fn,cif->rtype->size,cif->rtype->splittable,callout->ret);
-    break;
-  case FFIDL_PTR:
-  case FFIDL_PTR_OBJ:
-  case FFIDL_PTR_UTF8:
-  case FFIDL_PTR_UTF16:
-  case FFIDL_PTR_BYTE:
-  case FFIDL_PTR_VAR:
-#if USE_CALLBACKS
-  case FFIDL_PTR_PROC:
+  if (obj->typePtr == ffidl_int_ObjType) {
+    if (Tcl_GetLongFromObj(interp, obj, &ltmp) == TCL_ERROR) {
+      return TCL_ERROR;
+    }
+    /* Avoid undefined behaviour when casting a non-representable value. */
+    if (ltmp >= DBL_MIN && ltmp <= DBL_MAX) {
+      dtmp = (double)ltmp;
+    }
+    if (dtmp != ltmp) {
+      /* Does not round-trip; use Tcl's conversion. */
+      if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
+	return TCL_ERROR;
+      }
+    }
+#if HAVE_WIDE_INT
+  } else if (obj->typePtr == ffidl_wideInt_ObjType) {
+    if (Tcl_GetWideIntFromObj(interp, obj, &wtmp) == TCL_ERROR) {
+      return TCL_ERROR;
+    }
+    /* Avoid undefined behaviour when casting a non-representable value. */
+    if (wtmp >= DBL_MIN && wtmp <= DBL_MAX) {
+      dtmp = (double)wtmp;
+    }
+    if (dtmp != wtmp) {
+      /* Does not round-trip; use Tcl's conversion. */
+      if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
+	return TCL_ERROR;
+      }
+    }
 #endif
-    av_start_ptr(alist,callout->fn,void *,callout->ret);
-    break;
+  } else if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
+    return TCL_ERROR;
   }
+  out->v_double = dtmp;
+  return TCL_OK;
+}
 
-  for (i = 0; i < cif->argc; i += 1) {
-    switch (cif->atypes[i]->typecode) {
-    case FFIDL_VOID:
-      continue;
-    case FFIDL_INT:
-      av_int(alist,*(int *)callout->args[i]);
-      continue;
-    case FFIDL_FLOAT:
-      av_float(alist,*(float *)callout->args[i]);
-      continue;
-    case FFIDL_DOUBLE:
-      av_double(alist,*(double *)callout->args[i]);
-      continue;
-    case FFIDL_UINT8:
-      av_uint8(alist,*(UINT8_T *)callout->args[i]);
-      continue;
-    case FFIDL_SINT8:
-      av_sint8(alist,*(SINT8_T *)callout->args[i]);
-      continue;
-    case FFIDL_UINT16:
-      av_uint16(alist,*(UINT16_T *)callout->args[i]);
-      continue;
-    case FFIDL_SINT16:
-      av_sint16(alist,*(SINT16_T *)callout->args[i]);
-      continue;
-    case FFIDL_UINT32:
-      av_uint32(alist,*(UINT32_T *)callout->args[i]);
-      continue;
-    case FFIDL_SINT32:
-      av_sint32(alist,*(SINT32_T *)callout->args[i]);
-      continue;
+/*
+ * Get a C value of specified type (FFIDL_GETINT, FFIDL_GETDOUBLE,
+ * FFIDL_GETWIDEINT) from a Tcl_Obj .  Note that this value must still be
+ * interpreted according to the type, whether it's in argument or return
+ * position (libffi quirk), etc.
+ */
+static inline int value_convert_to_c(Tcl_Interp *interp, ffidl_type *type, Tcl_Obj *obj, ffidl_tclobj_value *out)
+{
+  if (type->class & FFIDL_GETINT) {
+    return value_get_long(interp, obj, out);
 #if HAVE_INT64
-    case FFIDL_UINT64:
-      av_uint64(alist,*(UINT64_T *)callout->args[i]);
-      continue;
-    case FFIDL_SINT64:
-      av_sint64(alist,*(SINT64_T *)callout->args[i]);
-      continue;
-#endif
-    case FFIDL_STRUCT:
-      _av_struct(alist,cif->atypes[i]->size,cif->atypes[i]->alignment,callout->args[i]);
-      continue;
-    case FFIDL_PTR:
-    case FFIDL_PTR_OBJ:
-    case FFIDL_PTR_UTF8:
-    case FFIDL_PTR_UTF16:
-    case FFIDL_PTR_BYTE:
-    case FFIDL_PTR_VAR:
-#if USE_CALLBACKS
-    case FFIDL_PTR_PROC:
+  } else if (type->class & FFIDL_GETWIDEINT) {
+    return value_get_wideint(interp, obj, out);
 #endif
-      av_ptr(alist,void *,*(void **)callout->args[i]);
-      continue;
-    }
-    /* Note: change "continue" to "break" if further work must be done here. */
+  } else if (type->class & FFIDL_GETDOUBLE) {
+    return value_get_double(interp, obj, out);
   }
-  av_call(alist);
-#endif
+  return TCL_OK;
 }
+
 /*
- * lib management, but note we never free a lib
- * because we cannot know how often it is used.
+ * Argument and return value converters.
+ *
+ * callout_prep() selects one converter for each argument and one for the
+ * return value, according to their types, so that tcl_ffidl_call() merely
+ * runs the selected converters instead of dispatching on the type code of
+ * every argument on every call.
  */
-/* define a new lib */
-static void lib_define(ffidl_client *client, char *lname, void *handle, void* unload)
-{
-  ffidl_lib *libentry = (ffidl_lib *)Tcl_Alloc(sizeof(ffidl_lib));
-  libentry->loadHandle = handle;
-  libentry->unloadProc = unload;
-  entry_define(&client->libs,lname,libentry);
+#define FFIDL_ARG_CONVERTER(name, ctype, getter, member)			\
+static int callout_arg_##name(Tcl_Interp *interp, ffidl_callout *callout,	\
+			      int i, Tcl_Obj *obj, void **argp)		\
+{									\
+  ffidl_tclobj_value obj_value;						\
+  if (getter(interp, obj, &obj_value) != TCL_OK) {			\
+    Tcl_AppendResult(interp, ", converting callout argument value", NULL); \
+    return TCL_ERROR;							\
+  }									\
+  *(ctype *)*argp = (ctype)obj_value.member;				\
+  return TCL_OK;							\
 }
-/* lookup an existing type */
-static ffidl_LoadHandle lib_lookup(ffidl_client *client,
-				   char *lname,
-				   ffidl_UnloadProc *unload)
+
+FFIDL_ARG_CONVERTER(int, int, value_get_long, v_long)
+FFIDL_ARG_CONVERTER(float, float, value_get_double, v_double)
+FFIDL_ARG_CONVERTER(double, double, value_get_double, v_double)
+#if HAVE_LONG_DOUBLE
+FFIDL_ARG_CONVERTER(longdouble, long double, value_get_double, v_double)
+#endif
+FFIDL_ARG_CONVERTER(uint8, UINT8_T, value_get_long, v_long)
+FFIDL_ARG_CONVERTER(sint8, SINT8_T, value_get_long, v_long)
+FFIDL_ARG_CONVERTER(uint16, UINT16_T, value_get_long, v_long)
+FFIDL_ARG_CONVERTER(sint16, SINT16_T, value_get_long, v_long)
+FFIDL_ARG_CONVERTER(uint32, UINT32_T, value_get_long, v_long)
+FFIDL_ARG_CONVERTER(sint32, SINT32_T, value_get_long, v_long)
+#if HAVE_INT64
+FFIDL_ARG_CONVERTER(uint64, UINT64_T, value_get_wideint, v_wideint)
+FFIDL_ARG_CONVERTER(sint64, SINT64_T, value_get_wideint, v_wideint)
+#endif
+#if FFIDL_POINTER_IS_LONG
+FFIDL_ARG_CONVERTER(pointer, void *, value_get_long, v_long)
+#else
+FFIDL_ARG_CONVERTER(pointer, void *, value_get_wideint, v_wideint)
+#endif
+
+static int callout_arg_struct(Tcl_Interp *interp, ffidl_callout *callout,
+			      int i, Tcl_Obj *obj, void **argp)
 {
-  ffidl_lib *libentry = entry_lookup(&client->libs,lname);
-  if (libentry) {
-    if (unload) {
-      *unload = libentry->unloadProc;
-    }
-    return libentry->loadHandle;
-  } else {
-    return NULL;
+  char buff[128];
+  int itmp;
+  size_t size = callout->cif->atypes[i]->size;
+  if (obj->typePtr != ffidl_bytearray_ObjType) {
+    sprintf(buff, "parameter %d must be a binary string", i);
+    Tcl_AppendResult(interp, buff, NULL);
+    return TCL_ERROR;
   }
+  *argp = (void *)Tcl_GetByteArrayFromObj(obj, &itmp);
+  if (itmp != size) {
+    sprintf(buff, "parameter %d is the wrong size, %u bytes instead of %lu.", i, itmp, (long)size);
+    Tcl_AppendResult(interp, buff, NULL);
+    return TCL_ERROR;
+  }
+  return TCL_OK;
 }
-#if USE_CALLBACKS
-/*
- * callback management
- */
-/* free a defined callback */
-static void callback_free(ffidl_callback *callback)
+
+#if USE_LIBFFI_RAW_API
+/* a structure argument in a raw image, passed by pointer in its slot */
+static int callout_arg_struct_raw(Tcl_Interp *interp, ffidl_callout *callout,
+				  int i, Tcl_Obj *obj, void **argp)
 {
-  if (callback) {
-    int i;
-    cif_dec_ref(callback->cif);
-    for (i = 0; i < callback->cmdc; i++) {
-      Tcl_DecrRefCount(callback->cmdv[i]);
-    }
-#if USE_LIBFFI
-    ffi_closure_free(callback->closure.lib_closure);
-#elif USE_LIBFFCALL
-    free_callback(callback->closure.lib_closure);
-#endif
-    Tcl_Free((void *)callback);
+  void *bytes;
+  if (callout_arg_struct(interp, callout, i, obj, &bytes) != TCL_OK) {
+    return TCL_ERROR;
   }
+  *(void **)*argp = bytes;
+  return TCL_OK;
 }
-/* define a new callback */
-static void callback_define(ffidl_client *client, char *cname, ffidl_callback *callback)
+#endif
+
+static int callout_arg_pointer_obj(Tcl_Interp *interp, ffidl_callout *callout,
+				   int i, Tcl_Obj *obj, void **argp)
 {
-  ffidl_callback *old_callback = NULL;
-  /* if callback is already defined, clean it up. */
-  old_callback = entry_lookup(&client->callbacks,cname);
-  callback_free(old_callback);
-  entry_define(&client->callbacks,cname,(void*)callback);
+  *(void **)*argp = (void *)obj;
+  return TCL_OK;
 }
-/* lookup an existing callback */
-static ffidl_callback *callback_lookup(ffidl_client *client, char *cname)
+
+static int callout_arg_pointer_utf8(Tcl_Interp *interp, ffidl_callout *callout,
+				    int i, Tcl_Obj *obj, void **argp)
 {
-  return entry_lookup(&client->callbacks,cname);
+  *(void **)*argp = (void *)Tcl_GetString(obj);
+  return TCL_OK;
 }
-/* find a callback by it's ffidl_callback */
-/*
-static Tcl_HashEntry *callback_find(ffidl_client *client, ffidl_callback *callback)
+
+static int callout_arg_pointer_utf16(Tcl_Interp *interp, ffidl_callout *callout,
+				     int i, Tcl_Obj *obj, void **argp)
 {
-  return entry_find(&client->callbacks,(void *)callback);
+  *(void **)*argp = (void *)Tcl_GetUnicode(obj);
+  return TCL_OK;
 }
-*/
-/* delete a callback definition */
-/*
-static void callback_delete(ffidl_client *client, ffidl_callback *callback)
+
+static int callout_arg_pointer_byte(Tcl_Interp *interp, ffidl_callout *callout,
+				    int i, Tcl_Obj *obj, void **argp)
 {
-  Tcl_HashEntry *entry = callback_find(client, callback);
-  if (entry) {
-    callback_free(callback);
-    Tcl_DeleteHashEntry(entry);
+  char buff[128];
+  int itmp;
+  if (obj->typePtr != ffidl_bytearray_ObjType) {
+    sprintf(buff, "parameter %d must be a binary string", i);
+    Tcl_AppendResult(interp, buff, NULL);
+    return TCL_ERROR;
   }
+  *(void **)*argp = (void *)Tcl_GetByteArrayFromObj(obj, &itmp);
+  return TCL_OK;
 }
-*/
-#if USE_LIBFFI
-/* call a tcl proc from a libffi closure */
-static void callback_callback(ffi_cif *fficif, void *ret, ffi_raw *args, void *user_data)
+
+static int callout_arg_pointer_var(Tcl_Interp *interp, ffidl_callout *callout,
+				   int i, Tcl_Obj *obj, void **argp)
 {
-  ffidl_callback *callback = (ffidl_callback *)user_data;
-  Tcl_Interp *interp = callback->interp;
-  ffidl_cif *cif = callback->cif;
-  Tcl_Obj **objv, *obj;
   char buff[128];
-  int i, status;
-  ffidl_tclobj_value obj_value = {0};
-  /* test for valid scope */
-  if (interp == NULL) {
-    Tcl_Panic("callback called out of scope!\n");
+  int itmp;
+  Tcl_Obj *varNameObj = obj;
+  obj = Tcl_ObjGetVar2(interp, varNameObj, NULL, TCL_LEAVE_ERR_MSG);
+  if (obj == NULL) return TCL_ERROR;
+  if (obj->typePtr != ffidl_bytearray_ObjType) {
+    sprintf(buff, "parameter %d must be a binary string", i);
+    Tcl_AppendResult(interp, buff, NULL);
+    return TCL_ERROR;
   }
-  /* initialize argument list */
-  objv = callback->cmdv+callback->cmdc;
-  /* fetch and convert argument values */
-  for (i = 0; i < cif->argc; i += 1) {
-    void *argp;
-#if USE_LIBFFI_RAW_API
-    if (callback->use_raw_api) {
-      ptrdiff_t offset = callback->offsets[i] - callback->offsets[0];
-      argp = (void *)(((char *)args)+offset);
-    } else {
-      argp = args[i].ptr;
+  if (Tcl_IsShared(obj)) {
+    obj = Tcl_ObjSetVar2(interp, varNameObj, NULL, Tcl_DuplicateObj(obj), TCL_LEAVE_ERR_MSG);
+    if (obj == NULL) {
+      return TCL_ERROR;
     }
-#else
-    argp = args[i].ptr;
+  }
+  *(void **)*argp = (void *)Tcl_GetByteArrayFromObj(obj, &itmp);
+  Tcl_InvalidateStringRep(obj);
+  return TCL_OK;
+}
+
+#if USE_CALLBACKS
+static ffidl_callback *callback_lookup(ffidl_client *client, char *cname);
+static ffidl_callback_handle *callback_handle_lookup(ffidl_client *client, Tcl_Obj *obj);
+static void *callback_native(ffidl_callback *callback);
+static void *callback_address(ffidl_callback *callback);
+static int tcl_ffidl_call(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
+
+static void callback_ref_free(Tcl_Obj *obj)
+{
+  Tcl_Free((char *)obj->internalRep.twoPtrValue.ptr1);
+}
+static void callback_ref_dup(Tcl_Obj *src, Tcl_Obj *dup)
+{
+  ffidl_callback_ref *ref = (ffidl_callback_ref *)Tcl_Alloc(sizeof(ffidl_callback_ref));
+  *ref = *(ffidl_callback_ref *)src->internalRep.twoPtrValue.ptr1;
+  dup->internalRep.twoPtrValue.ptr1 = ref;
+  dup->typePtr = src->typePtr;
+}
+static const Tcl_ObjType ffidl_callback_ObjType = {
+  "ffidl-callback", callback_ref_free, callback_ref_dup, NULL, NULL
+};
+
+static int callout_arg_pointer_proc(Tcl_Interp *interp, ffidl_callout *callout,
+				    int i, Tcl_Obj *obj, void **argp)
+{
+  ffidl_client *client = callout->client;
+  ffidl_callback_ref *ref;
+  ffidl_callback *callback;
+  Namespace *nsPtr = NULL;
+  Tcl_DString ds;
+  char *name;
+  if (obj->typePtr == &ffidl_callback_ObjType) {
+    ref = (ffidl_callback_ref *)obj->internalRep.twoPtrValue.ptr1;
+    if (ref->client == client && ref->epoch == client->callback_epoch &&
+	(ref->nsPtr == NULL ||
+	 (ref->nsPtr == ((Interp *)interp)->varFramePtr->nsPtr &&
+	  ref->nsId == ref->nsPtr->nsId))) {
+      callback = ref->callback;
+      goto resolved;
+    }
+  }
+  name = Tcl_GetString(obj);
+  Tcl_DStringInit(&ds);
+  if (!strstr(name, "::")) {
+    Tcl_Namespace *ns;
+    ns = Tcl_GetCurrentNamespace(interp);
+    nsPtr = (Namespace *)ns;
+    if (ns != Tcl_GetGlobalNamespace(interp)) {
+      Tcl_DStringAppend(&ds, ns->fullName, -1);
+    }
+    Tcl_DStringAppend(&ds, "::", 2);
+    Tcl_DStringAppend(&ds, name, -1);
+    name = Tcl_DStringValue(&ds);
+  }
+  callback = callback_lookup(client, name);
+  Tcl_DStringFree(&ds);
+  if (callback == NULL) {
+    /* or the value of an anonymous callback */
+    ffidl_callback_handle *handle = callback_handle_lookup(client, obj);
+    if (handle != NULL) {
+      callback = handle->callback;
+      nsPtr = NULL;
+    }
+  }
+  if (callback == NULL) {
+    Tcl_AppendResult(interp, "no callback named \"", Tcl_GetString(obj), "\" is defined", NULL);
+    return TCL_ERROR;
+  }
+  /* remember the callback in the argument, for the next call */
+  if (obj->typePtr == &ffidl_callback_ObjType) {
+    ref = (ffidl_callback_ref *)obj->internalRep.twoPtrValue.ptr1;
+  } else {
+    ref = (ffidl_callback_ref *)Tcl_Alloc(sizeof(ffidl_callback_ref));
+    TclFreeIntRep(obj);
+    obj->internalRep.twoPtrValue.ptr1 = ref;
+    obj->typePtr = &ffidl_callback_ObjType;
+  }
+  ref->client = client;
+  ref->epoch = client->callback_epoch;
+  ref->callback = callback;
+  ref->nsPtr = nsPtr;
+  ref->nsId = nsPtr ? nsPtr->nsId : 0;
+ resolved:
+  /* pass the function of a callout directly, rather than calling it through Tcl */
+  if ((*(void **)*argp = callback_native(callback)) != NULL) {
+    return TCL_OK;
+  }
+  *(void **)*argp = callback_address(callback);
+  return TCL_OK;
+}
 #endif
-    switch (cif->atypes[i]->typecode) {
-    case FFIDL_INT:
-      objv[i] = Tcl_NewLongObj((long)(*(int *)argp));
-      break;
-    case FFIDL_FLOAT:
-      objv[i] = Tcl_NewDoubleObj((double)(*(float *)argp));
-      break;
-    case FFIDL_DOUBLE:
-      objv[i] = Tcl_NewDoubleObj(*(double *)argp);
-      break;
+
+/*
+ * Return value converters store the value into obj, which must be unshared,
+ * or into a new Tcl_Obj when obj is NULL, and return the object used.
+ */
+#define FFIDL_RET_CONVERTER(name, type, newobj, setobj, ctype)		\
+static Tcl_Obj *callout_ret_##name(Tcl_Obj *obj, void *ret)		\
+{									\
+  ctype value = (ctype)FFIDL_RVALUE_PEEK_UNWIDEN(type, ret);		\
+  if (obj == NULL) {							\
+    return newobj(value);						\
+  }									\
+  setobj(obj, value);							\
+  return obj;								\
+}
+
+FFIDL_RET_CONVERTER(int, INT, Tcl_NewLongObj, Tcl_SetLongObj, long)
+FFIDL_RET_CONVERTER(float, FLOAT, Tcl_NewDoubleObj, Tcl_SetDoubleObj, double)
+FFIDL_RET_CONVERTER(double, DOUBLE, Tcl_NewDoubleObj, Tcl_SetDoubleObj, double)
 #if HAVE_LONG_DOUBLE
-    case FFIDL_LONGDOUBLE:
-      objv[i] = Tcl_NewDoubleObj((double)(*(long double *)argp));
-      break;
-#endif
-    case FFIDL_UINT8:
-      objv[i] = Tcl_NewLongObj((long)(*(UINT8_T *)argp));
-      break;
-    case FFIDL_SINT8:
-      objv[i] = Tcl_NewLongObj((long)(*(SINT8_T *)argp));
-      break;
-    case FFIDL_UINT16:
-      objv[i] = Tcl_NewLongObj((long)(*(UINT16_T *)argp));
-      break;
-    case FFIDL_SINT16:
-      objv[i] = Tcl_NewLongObj((long)(*(SINT16_T *)argp));
-      break;
-    case FFIDL_UINT32:
-      objv[i] = Tcl_NewLongObj((long)(*(UINT32_T *)argp));
-      break;
-    case FFIDL_SINT32:
-      objv[i] = Tcl_NewLongObj((long)(*(SINT32_T *)argp));
-      break;
+FFIDL_RET_CONVERTER(longdouble, LONGDOUBLE, Tcl_NewDoubleObj, Tcl_SetDoubleObj, double)
+#endif
+FFIDL_RET_CONVERTER(uint8, UINT8, Tcl_NewLongObj, Tcl_SetLongObj, long)
+FFIDL_RET_CONVERTER(sint8, SINT8, Tcl_NewLongObj, Tcl_SetLongObj, long)
+FFIDL_RET_CONVERTER(uint16, UINT16, Tcl_NewLongObj, Tcl_SetLongObj, long)
+FFIDL_RET_CONVERTER(sint16, SINT16, Tcl_NewLongObj, Tcl_SetLongObj, long)
+FFIDL_RET_CONVERTER(uint32, UINT32, Tcl_NewLongObj, Tcl_SetLongObj, long)
+FFIDL_RET_CONVERTER(sint32, SINT32, Tcl_NewLongObj, Tcl_SetLongObj, long)
 #if HAVE_INT64
-    case FFIDL_UINT64:
-      objv[i] = Ffidl_NewInt64Obj((Ffidl_Int64)(*(UINT64_T *)argp));
-      break;
-    case FFIDL_SINT64:
-      objv[i] = Ffidl_NewInt64Obj((Ffidl_Int64)(*(SINT64_T *)argp));
-      break;
+FFIDL_RET_CONVERTER(uint64, UINT64, Ffidl_NewInt64Obj, Ffidl_SetInt64Obj, Ffidl_Int64)
+FFIDL_RET_CONVERTER(sint64, SINT64, Ffidl_NewInt64Obj, Ffidl_SetInt64Obj, Ffidl_Int64)
 #endif
-    case FFIDL_STRUCT:
-      objv[i] = Tcl_NewByteArrayObj((unsigned char *)argp, cif->atypes[i]->size);
-      break;
-    case FFIDL_PTR:
-      objv[i] = Ffidl_NewPointerObj((*(void **)argp));
-      break;
-    case FFIDL_PTR_OBJ:
-      objv[i] = *(Tcl_Obj **)argp;
-      break;
-    case FFIDL_PTR_UTF8:
-      objv[i] = Tcl_NewStringObj(*(char **)argp, -1);
-      break;
-    case FFIDL_PTR_UTF16:
-      objv[i] = Tcl_NewUnicodeObj(*(Tcl_UniChar **)argp, -1);
-      break;
-    default:
-      sprintf(buff, "unimplemented type for callback argument: %d", cif->atypes[i]->typecode);
-      Tcl_AppendResult(interp, buff, NULL);
-      while (i-- >= 0) {
-	Tcl_DecrRefCount(objv[i]);
-      }
-      goto escape;
-    }
-    Tcl_IncrRefCount(objv[i]);
-  }
-  /* call */
-  status = Tcl_EvalObjv(interp, callback->cmdc+cif->argc, callback->cmdv, TCL_EVAL_GLOBAL);
-  /* clean up arguments */
-  for (i = 0; i < cif->argc; i++) {
-    Tcl_DecrRefCount(objv[i]);
-  }
-  if (status == TCL_ERROR) {
-    goto escape;
+FFIDL_RET_CONVERTER(pointer, PTR, Ffidl_NewPointerObj, Ffidl_SetPointerObj, void *)
+
+static Tcl_Obj *callout_ret_pointer_obj(Tcl_Obj *obj, void *ret)
+{
+  return FFIDL_RVALUE_PEEK_UNWIDEN(PTR, ret);
+}
+
+static Tcl_Obj *callout_ret_pointer_utf8(Tcl_Obj *obj, void *ret)
+{
+  if (obj == NULL) {
+    return Tcl_NewStringObj(FFIDL_RVALUE_PEEK_UNWIDEN(PTR, ret), -1);
   }
-  /* fetch return value */
-  obj = Tcl_GetObjResult(interp);
-  if (TCL_OK != value_convert_to_c(interp, cif->rtype, obj, &obj_value)) {
-    Tcl_AppendResult(interp, ", converting callback return value", NULL);
-    goto escape;
+  Tcl_SetStringObj(obj, FFIDL_RVALUE_PEEK_UNWIDEN(PTR, ret), -1);
+  return obj;
+}
+
+static Tcl_Obj *callout_ret_pointer_utf16(Tcl_Obj *obj, void *ret)
+{
+  if (obj == NULL) {
+    return Tcl_NewUnicodeObj(FFIDL_RVALUE_PEEK_UNWIDEN(PTR, ret), -1);
   }
-  /* convert return value */
-  switch (cif->rtype->typecode) {
-  case FFIDL_VOID:	break;
-  case FFIDL_INT:	FFIDL_RVALUE_POKE_WIDENED(INT, ret, obj_value.v_long); break;
-  case FFIDL_FLOAT:	FFIDL_RVALUE_POKE_WIDENED(FLOAT, ret, obj_value.v_double); break;
-  case FFIDL_DOUBLE:	FFIDL_RVALUE_POKE_WIDENED(DOUBLE, ret, obj_value.v_double); break;
+  Tcl_SetUnicodeObj(obj, FFIDL_RVALUE_PEEK_UNWIDEN(PTR, ret), -1);
+  return obj;
+}
+
+/*
+ * Store a return value at dst as an unwidened value of its type, in the
+ * layout described by ::ffidl::info format.  Structures are returned in
+ * place and need no packing.
+ */
+#define FFIDL_RVALUE_PACK(type, dst, ret) (*(FFIDL_RVALUE_TYPE(type) *)(dst) = FFIDL_RVALUE_PEEK_UNWIDEN(type, ret))
+
+static void callout_ret_pack(ffidl_type *type, void *dst, void *ret)
+{
+  switch (type->typecode) {
+  case FFIDL_INT:	FFIDL_RVALUE_PACK(INT, dst, ret); break;
+  case FFIDL_FLOAT:	FFIDL_RVALUE_PACK(FLOAT, dst, ret); break;
+  case FFIDL_DOUBLE:	FFIDL_RVALUE_PACK(DOUBLE, dst, ret); break;
 #if HAVE_LONG_DOUBLE
-  case FFIDL_LONGDOUBLE:FFIDL_RVALUE_POKE_WIDENED(LONGDOUBLE, ret, obj_value.v_long); break;
-#endif
-  case FFIDL_UINT8:	FFIDL_RVALUE_POKE_WIDENED(UINT8, ret, obj_value.v_long); break;
-  case FFIDL_SINT8:	FFIDL_RVALUE_POKE_WIDENED(SINT8, ret, obj_value.v_long); break;
-  case FFIDL_UINT16:	FFIDL_RVALUE_POKE_WIDENED(UINT16, ret, obj_value.v_long); break;
-  case FFIDL_SINT16:	FFIDL_RVALUE_POKE_WIDENED(SINT16, ret, obj_value.v_long); break;
-  case FFIDL_UINT32:	FFIDL_RVALUE_POKE_WIDENED(UINT32, ret, obj_value.v_long); break;
-  case FFIDL_SINT32:	FFIDL_RVALUE_POKE_WIDENED(SINT32, ret, obj_value.v_long); break;
+  case FFIDL_LONGDOUBLE:FFIDL_RVALUE_PACK(LONGDOUBLE, dst, ret); break;
+#endif
+  case FFIDL_UINT8:	FFIDL_RVALUE_PACK(UINT8, dst, ret); break;
+  case FFIDL_SINT8:	FFIDL_RVALUE_PACK(SINT8, dst, ret); break;
+  case FFIDL_UINT16:	FFIDL_RVALUE_PACK(UINT16, dst, ret); break;
+  case FFIDL_SINT16:	FFIDL_RVALUE_PACK(SINT16, dst, ret); break;
+  case FFIDL_UINT32:	FFIDL_RVALUE_PACK(UINT32, dst, ret); break;
+  case FFIDL_SINT32:	FFIDL_RVALUE_PACK(SINT32, dst, ret); break;
 #if HAVE_INT64
-  case FFIDL_UINT64:	FFIDL_RVALUE_POKE_WIDENED(UINT64, ret, obj_value.v_wideint); break;
-  case FFIDL_SINT64:	FFIDL_RVALUE_POKE_WIDENED(SINT64, ret, obj_value.v_wideint); break;
-#endif
-  case FFIDL_STRUCT:
-    {
-      int len;
-      void *bytes = Tcl_GetByteArrayFromObj(obj, &len);
-      if (len != cif->rtype->size) {
-	Tcl_ResetResult(interp);
-	sprintf(buff, "byte array for callback struct return has %u bytes instead of %lu", len, (long)(cif->rtype->size));
-	Tcl_AppendResult(interp, buff, NULL);
-	goto escape;
-      }
-      memcpy(ret, bytes, cif->rtype->size);
-      break;
-    }
-#if FFIDL_POINTER_IS_LONG
-  case FFIDL_PTR:	FFIDL_RVALUE_POKE_WIDENED(PTR, ret, obj_value.v_long); break;
-#else
-  case FFIDL_PTR:	FFIDL_RVALUE_POKE_WIDENED(PTR, ret, obj_value.v_wideint); break;
+  case FFIDL_UINT64:	FFIDL_RVALUE_PACK(UINT64, dst, ret); break;
+  case FFIDL_SINT64:	FFIDL_RVALUE_PACK(SINT64, dst, ret); break;
 #endif
-  case FFIDL_PTR_OBJ:	FFIDL_RVALUE_POKE_WIDENED(PTR, ret, obj); break;
-  default:
-    Tcl_ResetResult(interp);
-    sprintf(buff, "unimplemented type for callback return: %d", cif->rtype->typecode);
-    Tcl_AppendResult(interp, buff, NULL);
-    goto escape;
+  case FFIDL_PTR:
+  case FFIDL_PTR_UTF8:
+  case FFIDL_PTR_UTF16:	FFIDL_RVALUE_PACK(PTR, dst, ret); break;
+  default:		break;
   }
-  /* done */
-  return;
-escape:
-  Tcl_BackgroundError(interp);
-  memset(ret, 0, cif->rtype->size);
 }
-#elif USE_LIBFFCALL
-static void callback_callback(void *user_data, va_alist alist)
+
+/*
+ * Store a return value of type rtype at dst as a value of type otype,
+ * converting between integer, floating point and pointer values like a C
+ * cast would.
+ */
+static void callout_ret_convert(ffidl_type *otype, void *dst, ffidl_type *rtype, void *ret)
 {
-  ffidl_callback *callback = (ffidl_callback *)user_data;
-  Tcl_Interp *interp = callback->interp;
-  ffidl_cif *cif = callback->cif;
-  Tcl_Obj **objv, *obj;
-  char buff[128];
-  int i, status;
-  ffidl_tclobj_value obj_value = {0};
-  /* test for valid scope */
-  if (interp == NULL) {
-    Tcl_Panic("callback called out of scope!\n");
+#if HAVE_INT64
+  Ffidl_Int64 w = 0;
+#else
+  long w = 0;
+#endif
+  double d = 0;
+  int isdouble = 0;
+
+  if (otype->typecode == rtype->typecode) {
+    callout_ret_pack(rtype, dst, ret);
+    return;
   }
-  /* initialize argument list */
-  objv = callback->cmdv+callback->cmdc;
-  /* start */
-  switch (cif->rtype->typecode) {
-  case FFIDL_VOID:	va_start_void(alist); break;
-  case FFIDL_INT:	va_start_int(alist); break;
-  case FFIDL_FLOAT:	va_start_float(alist); break;
-  case FFIDL_DOUBLE:	va_start_double(alist); break;
-  case FFIDL_UINT8:	va_start_uint8(alist); break;
-  case FFIDL_SINT8:	va_start_sint8(alist); break;
-  case FFIDL_UINT16:	va_start_uint16(alist); break;
-  case FFIDL_SINT16:	va_start_sint16(alist); break;
-  case FFIDL_UINT32:	va_start_uint32(alist); break;
-  case FFIDL_SINT32:	va_start_sint32(alist); break;
+  switch (rtype->typecode) {
+  case FFIDL_FLOAT:	d = FFIDL_RVALUE_PEEK_UNWIDEN(FLOAT, ret); isdouble = 1; break;
+  case FFIDL_DOUBLE:	d = FFIDL_RVALUE_PEEK_UNWIDEN(DOUBLE, ret); isdouble = 1; break;
+#if HAVE_LONG_DOUBLE
+  case FFIDL_LONGDOUBLE:d = FFIDL_RVALUE_PEEK_UNWIDEN(LONGDOUBLE, ret); isdouble = 1; break;
+#endif
+  case FFIDL_INT:	w = FFIDL_RVALUE_PEEK_UNWIDEN(INT, ret); break;
+  case FFIDL_UINT8:	w = FFIDL_RVALUE_PEEK_UNWIDEN(UINT8, ret); break;
+  case FFIDL_SINT8:	w = FFIDL_RVALUE_PEEK_UNWIDEN(SINT8, ret); break;
+  case FFIDL_UINT16:	w = FFIDL_RVALUE_PEEK_UNWIDEN(UINT16, ret); break;
+  case FFIDL_SINT16:	w = FFIDL_RVALUE_PEEK_UNWIDEN(SINT16, ret); break;
+  case FFIDL_UINT32:	w = FFIDL_RVALUE_PEEK_UNWIDEN(UINT32, ret); break;
+  case FFIDL_SINT32:	w = FFIDL_RVALUE_PEEK_UNWIDEN(SINT32, ret); break;
 #if HAVE_INT64
-  case FFIDL_UINT64:	va_start_uint64(alist); break;
-  case FFIDL_SINT64:	va_start_sint64(alist); break;
+  case FFIDL_UINT64:	w = FFIDL_RVALUE_PEEK_UNWIDEN(UINT64, ret); break;
+  case FFIDL_SINT64:	w = FFIDL_RVALUE_PEEK_UNWIDEN(SINT64, ret); break;
 #endif
-  case FFIDL_STRUCT:	_va_start_struct(alist,cif->rtype->size,cif->rtype->alignment,cif->rtype->splittable); break;
-  case FFIDL_PTR:	va_start_ptr(alist,void *); break;
-  case FFIDL_PTR_OBJ:	va_start_ptr(alist,Tcl_Obj *); break;
-  default:
-    Tcl_ResetResult(interp);
-    sprintf(buff, "unimplemented type for callback return: %d", cif->rtype->typecode);
-    Tcl_AppendResult(interp, buff, NULL);
-    goto escape;
+  case FFIDL_PTR:
+  case FFIDL_PTR_UTF8:
+  case FFIDL_PTR_UTF16:	w = (size_t)FFIDL_RVALUE_PEEK_UNWIDEN(PTR, ret); break;
+  default:		return;
   }
-  /* fetch and convert argument values */
+#define FFIDL_CAST_STORE(ctype) (*(ctype *)dst = isdouble ? (ctype)d : (ctype)w)
+  switch (otype->typecode) {
+  case FFIDL_INT:	FFIDL_CAST_STORE(int); break;
+  case FFIDL_FLOAT:	FFIDL_CAST_STORE(float); break;
+  case FFIDL_DOUBLE:	FFIDL_CAST_STORE(double); break;
+#if HAVE_LONG_DOUBLE
+  case FFIDL_LONGDOUBLE:FFIDL_CAST_STORE(long double); break;
+#endif
+  case FFIDL_UINT8:	FFIDL_CAST_STORE(UINT8_T); break;
+  case FFIDL_SINT8:	FFIDL_CAST_STORE(SINT8_T); break;
+  case FFIDL_UINT16:	FFIDL_CAST_STORE(UINT16_T); break;
+  case FFIDL_SINT16:	FFIDL_CAST_STORE(SINT16_T); break;
+  case FFIDL_UINT32:	FFIDL_CAST_STORE(UINT32_T); break;
+  case FFIDL_SINT32:	FFIDL_CAST_STORE(SINT32_T); break;
+#if HAVE_INT64
+  case FFIDL_UINT64:	FFIDL_CAST_STORE(UINT64_T); break;
+  case FFIDL_SINT64:	FFIDL_CAST_STORE(SINT64_T); break;
+#endif
+  case FFIDL_PTR:
+    *(void **)dst = (void *)(size_t)(isdouble ? (size_t)d : (size_t)w);
+    break;
+  default:		break;
+  }
+#undef FFIDL_CAST_STORE
+}
+
+/*
+ * Select the converter for each argument and for the return value, and set
+ * up the argument pointers for the raw API if it is used.
+ */
+static int callout_prep(Tcl_Interp *interp, ffidl_callout *callout)
+{
+  int i;
+  char buff[128];
+  ffidl_cif *cif = callout->cif;
+
   for (i = 0; i < cif->argc; i++) {
+    ffidl_arg_converter *converter;
     switch (cif->atypes[i]->typecode) {
-    case FFIDL_INT:
-      objv[i] = Tcl_NewLongObj((long)va_arg_int(alist));
-      break;
-    case FFIDL_FLOAT:
-      objv[i] = Tcl_NewDoubleObj((double)va_arg_float(alist));
-      break;
-    case FFIDL_DOUBLE:
-      objv[i] = Tcl_NewDoubleObj(va_arg_double(alist));
-      break;
-    case FFIDL_UINT8:
-      objv[i] = Tcl_NewLongObj((long)va_arg_uint8(alist));
-      break;
-    case FFIDL_SINT8:
-      objv[i] = Tcl_NewLongObj((long)va_arg_sint8(alist));
-      break;
-    case FFIDL_UINT16:
-      objv[i] = Tcl_NewLongObj((long)va_arg_uint16(alist));
-      break;
-    case FFIDL_SINT16:
-      objv[i] = Tcl_NewLongObj((long)va_arg_sint16(alist));
-      break;
-    case FFIDL_UINT32:
-      objv[i] = Tcl_NewLongObj((long)va_arg_uint32(alist));
-      break;
-    case FFIDL_SINT32:
-      objv[i] = Tcl_NewLongObj((long)va_arg_sint32(alist));
-      break;
+    case FFIDL_INT:		converter = callout_arg_int; break;
+    case FFIDL_FLOAT:		converter = callout_arg_float; break;
+    case FFIDL_DOUBLE:		converter = callout_arg_double; break;
+#if HAVE_LONG_DOUBLE
+    case FFIDL_LONGDOUBLE:	converter = callout_arg_longdouble; break;
+#endif
+    case FFIDL_UINT8:		converter = callout_arg_uint8; break;
+    case FFIDL_SINT8:		converter = callout_arg_sint8; break;
+    case FFIDL_UINT16:		converter = callout_arg_uint16; break;
+    case FFIDL_SINT16:		converter = callout_arg_sint16; break;
+    case FFIDL_UINT32:		converter = callout_arg_uint32; break;
+    case FFIDL_SINT32:		converter = callout_arg_sint32; break;
 #if HAVE_INT64
-    case FFIDL_UINT64:
-      objv[i] = Ffidl_NewInt64Obj((long)va_arg_uint64(alist));
-      break;
-    case FFIDL_SINT64:
-      objv[i] = Ffidl_NewInt64Obj((long)va_arg_sint64(alist));
-      break;
+    case FFIDL_UINT64:		converter = callout_arg_uint64; break;
+    case FFIDL_SINT64:		converter = callout_arg_sint64; break;
+#endif
+    case FFIDL_STRUCT:		converter = callout_arg_struct; break;
+    case FFIDL_PTR:		converter = callout_arg_pointer; break;
+    case FFIDL_PTR_OBJ:		converter = callout_arg_pointer_obj; break;
+    case FFIDL_PTR_UTF8:	converter = callout_arg_pointer_utf8; break;
+    case FFIDL_PTR_UTF16:	converter = callout_arg_pointer_utf16; break;
+    case FFIDL_PTR_BYTE:	converter = callout_arg_pointer_byte; break;
+    case FFIDL_PTR_VAR:		converter = callout_arg_pointer_var; break;
+#if USE_CALLBACKS
+    case FFIDL_PTR_PROC:	converter = callout_arg_pointer_proc; break;
 #endif
-    case FFIDL_STRUCT:
-      objv[i] = Tcl_NewByteArrayObj(_va_arg_struct(alist,
-						   cif->atypes[i]->size,
-						   cif->atypes[i]->alignment),
-				    cif->atypes[i]->size);
-      break;
-    case FFIDL_PTR:
-      objv[i] = Ffidl_NewPointerObj(va_arg_ptr(alist,void *));
-      break;
-    case FFIDL_PTR_OBJ:
-      objv[i] = va_arg_ptr(alist,Tcl_Obj *);
-      break;
-    case FFIDL_PTR_UTF8:
-      objv[i] = Tcl_NewStringObj(va_arg_ptr(alist,char *), -1);
-      break;
-    case FFIDL_PTR_UTF16:
-      objv[i] = Tcl_NewUnicodeObj(va_arg_ptr(alist,Tcl_UniChar *), -1);
-      break;
     default:
-      sprintf(buff, "unimplemented type for callback argument: %d", cif->atypes[i]->typecode);
+      sprintf(buff, "unknown type for argument: %d", cif->atypes[i]->typecode);
       Tcl_AppendResult(interp, buff, NULL);
-      while (i-- >= 0) {
-	Tcl_DecrRefCount(objv[i]);
-      }
-      goto escape;
+      return TCL_ERROR;
     }
-    Tcl_IncrRefCount(objv[i]);
+    callout->converters[i] = converter;
   }
-  /* call */
-  status = Tcl_EvalObjv(interp, callback->cmdc+cif->argc, callback->cmdv, TCL_EVAL_GLOBAL);
-  /* clean up arguments */
-  for (i = 0; i < cif->argc; i++) {
-    Tcl_DecrRefCount(objv[i]);
+
+  switch (cif->rtype->typecode) {
+  case FFIDL_VOID:	callout->ret_converter = NULL; break;
+  case FFIDL_INT:	callout->ret_converter = callout_ret_int; break;
+  case FFIDL_FLOAT:	callout->ret_converter = callout_ret_float; break;
+  case FFIDL_DOUBLE:	callout->ret_converter = callout_ret_double; break;
+#if HAVE_LONG_DOUBLE
+  case FFIDL_LONGDOUBLE:callout->ret_converter = callout_ret_longdouble; break;
+#endif
+  case FFIDL_UINT8:	callout->ret_converter = callout_ret_uint8; break;
+  case FFIDL_SINT8:	callout->ret_converter = callout_ret_sint8; break;
+  case FFIDL_UINT16:	callout->ret_converter = callout_ret_uint16; break;
+  case FFIDL_SINT16:	callout->ret_converter = callout_ret_sint16; break;
+  case FFIDL_UINT32:	callout->ret_converter = callout_ret_uint32; break;
+  case FFIDL_SINT32:	callout->ret_converter = callout_ret_sint32; break;
+#if HAVE_INT64
+  case FFIDL_UINT64:	callout->ret_converter = callout_ret_uint64; break;
+  case FFIDL_SINT64:	callout->ret_converter = callout_ret_sint64; break;
+#endif
+  case FFIDL_STRUCT:	callout->ret_converter = NULL; break;
+  case FFIDL_PTR:	callout->ret_converter = callout_ret_pointer; break;
+  case FFIDL_PTR_OBJ:	callout->ret_converter = callout_ret_pointer_obj; break;
+  case FFIDL_PTR_UTF8:	callout->ret_converter = callout_ret_pointer_utf8; break;
+  case FFIDL_PTR_UTF16:	callout->ret_converter = callout_ret_pointer_utf16; break;
+  default:
+    sprintf(buff, "Invalid return type: %d", cif->rtype->typecode);
+    Tcl_AppendResult(interp, buff, NULL);
+    return TCL_ERROR;
   }
-  if (status == TCL_ERROR) {
-    goto escape;
+
+  /* lay out the argument values in a frame's value area; structure
+     arguments are passed by pointer to their bytearray's contents */
+  for (i = 0; i < cif->argc; i++) {
+    if (cif->atypes[i]->typecode == FFIDL_STRUCT) {
+      callout->offsets[i] = -1;
+    } else {
+      callout->offsets[i] = i * sizeof(ffidl_value);
+    }
   }
-  /* fetch return value */
-  obj = Tcl_GetObjResult(interp);
-  if (TCL_OK != value_convert_to_c(interp, cif->rtype, obj, &obj_value)) {
-    Tcl_AppendResult(interp, ", converting callback return value", NULL);
-    goto escape;
+#if USE_LIBFFI_RAW_API
+  callout->use_raw_api = cif_raw_supported(cif);
+
+  if (callout->use_raw_api) {
+    /* lay out the argument values as a raw stack image instead */
+    if (TCL_OK != cif_raw_prep_offsets(cif, callout->offsets)) {
+      Tcl_AppendResult(interp, "raw argument layout error", NULL);
+      return TCL_ERROR;
+    }
+    for (i = 0; i < cif->argc; i++) {
+      if (FFIDL_RAW_STRUCT(cif->atypes[i])) {
+	callout->converters[i] = callout_arg_struct_raw;
+      }
+    }
   }
-  
-  /* convert return value */
-  switch (cif->rtype->typecode) {
-  case FFIDL_VOID:	va_return_void(alist); break;
-  case FFIDL_INT:	va_return_int(alist, obj_value.v_long); break;
-  case FFIDL_FLOAT:	va_return_float(alist, obj_value.v_double); break;
-  case FFIDL_DOUBLE:	va_return_double(alist, obj_value.v_double); break;
-  case FFIDL_UINT8:	va_return_uint8(alist, obj_value.v_long); break;
-  case FFIDL_SINT8:	va_return_sint8(alist, obj_value.v_long); break;
-  case FFIDL_UINT16:	va_return_uint16(alist, obj_value.v_long); break;
-  case FFIDL_SINT16:	va_return_sint16(alist, obj_value.v_long); break;
-  case FFIDL_UINT32:	va_return_uint32(alist, obj_value.v_long); break;
-  case FFIDL_SINT32:	va_return_sint32(alist, obj_value.v_long); break;
-#if HAVE_INT64
-  case FFIDL_UINT64:	va_return_uint64(alist, obj_value.v_wideint); break;
-  case FFIDL_SINT64:	va_return_sint64(alist, obj_value.v_wideint); break;
 #endif
-  case FFIDL_STRUCT:	
-    {
-      int len;
-      void *bytes = Tcl_GetByteArrayFromObj(obj, &len);
-      if (len != cif->rtype->size) {
-	Tcl_ResetResult(interp);
-	sprintf(buff, "byte array for callback struct return has %u bytes instead of %lu", len, (long)(cif->rtype->size));
-	Tcl_AppendResult(interp, buff, NULL);
-	goto escape;
-      }
-      _va_return_struct(alist, cif->rtype->size, cif->rtype->alignment, bytes);
-      break;
-    }
-  case FFIDL_PTR:	va_return_ptr(alist, void *, obj_value.v_long); break;
-  case FFIDL_PTR_OBJ:	va_return_ptr(alist, Tcl_Obj *, obj); break;
-  default:
-    Tcl_ResetResult(interp);
-    sprintf(buff, "unimplemented type for callback return: %d", cif->rtype->typecode);
-    Tcl_AppendResult(interp, buff, NULL);
-    goto escape;
-  }
-  /* done */
-  return;
-escape:
-  Tcl_BackgroundError(interp);
-}
+#if USE_JIT
+  /* a native stub, when enabled, takes precedence over a thunk */
+  jit_compile(callout);
+#endif
+#if USE_THUNKS
+#if USE_JIT
+  callout->thunk = callout->jit_code ? NULL : thunk_lookup(callout);
+#else
+  callout->thunk = thunk_lookup(callout);
 #endif
 #endif
+  return TCL_OK;
+}
+
 /*
- * Client management.
+ * Return a frame for one invocation of the callout.  Small signatures use
+ * the frame and areas provided by the caller, usually on its C stack, large
+ * ones take a frame from the callout's pool.  The frame must be given back
+ * with callout_frame_release().
  */
-/* client interp deletion callback for cleanup */
-static void client_delete(ClientData clientData, Tcl_Interp *interp)
+static ffidl_frame *callout_frame_get(ffidl_callout *callout, ffidl_frame *frame,
+				      void **args, ffidl_value *values)
 {
-  ffidl_client *client = (ffidl_client *)clientData;
-  Tcl_HashSearch search;
-  Tcl_HashEntry *entry;
+  ffidl_cif *cif = callout->cif;
+  int i;
 
-  /* there should be no callouts left */
-  for (entry = Tcl_FirstHashEntry(&client->callouts, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
-    char *name = Tcl_GetHashKey(&client->callouts, entry);
-    /* Couldn't do this while traversing the hash table anyway */
-    /* Tcl_DeleteCommand(interp, name); */
-    fprintf(stderr, "error - dangling callout in client_delete: %s\n", name);
+  if (cif->argc > FFIDL_FRAME_ARGS) {
+    if (callout->frames != NULL) {
+      /* pooled frames are already set up */
+      frame = callout->frames;
+      callout->frames = frame->next;
+      return frame;
+    }
+    frame = (ffidl_frame *)Tcl_Alloc(sizeof(ffidl_frame)
+				     +cif->argc*sizeof(ffidl_value)	/* values */
+				     +cif->argc*sizeof(void *));	/* args */
+    values = (ffidl_value *)(frame+1);
+    args = (void **)(values+cif->argc);
   }
-
-#if USE_CALLBACKS
-  /* free all callbacks */
-  for (entry = Tcl_FirstHashEntry(&client->callbacks, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
-    ffidl_callback *callback = Tcl_GetHashValue(entry);
-    callback_free(callback);
+  frame->next = NULL;
+  frame->args = args;
+  frame->values = values;
+  for (i = 0; i < cif->argc; i += 1) {
+    args[i] = callout->offsets[i] < 0 ? NULL : (char *)values + callout->offsets[i];
   }
-#endif
+  /* libffi depends on this being NULL on some platforms ! */
+  frame->ret = cif->rtype->typecode == FFIDL_VOID ? NULL : (void *)&frame->rvalue;
+  return frame;
+}
 
-  /* there should be no cifs left */
-  for (entry = Tcl_FirstHashEntry(&client->cifs, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
-    char *signature = Tcl_GetHashKey(&client->cifs, entry);
-    fprintf(stderr, "error - dangling ffidl_cif in client_delete: %s\n",signature);
+/* Give back a frame obtained from callout_frame_get(). */
+static void callout_frame_release(ffidl_callout *callout, ffidl_frame *frame)
+{
+  if (callout->cif->argc > FFIDL_FRAME_ARGS) {
+    frame->next = callout->frames;
+    callout->frames = frame;
   }
+}
 
-  /* free all allocated typedefs */
-  for (entry = Tcl_FirstHashEntry(&client->types, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
-    ffidl_type *type = Tcl_GetHashValue(entry);
-    if ((type->class & FFIDL_STATIC_TYPE) == 0) {
-      type_dec_ref(type);
+/*
+ * Whether a bound argument of this type is converted once by ::ffidl::curry,
+ * rather than on every call.  Other types point into their Tcl_Obj, or into
+ * a variable, which may change between calls.
+ */
+#define CALLOUT_BIND_AHEAD(type) \
+  ((type)->typecode != FFIDL_STRUCT && ((type)->class & (FFIDL_GETINT|FFIDL_GETDOUBLE|FFIDL_GETWIDEINT)))
+
+/* Store the values of the arguments bound by ::ffidl::curry into frame. */
+static int callout_bind(Tcl_Interp *interp, ffidl_callout *callout, ffidl_frame *frame)
+{
+  ffidl_cif *cif = callout->cif;
+  int i;
+
+  for (i = 0; i < callout->nbound; i += 1) {
+    if (CALLOUT_BIND_AHEAD(cif->atypes[i])) {
+      memcpy(frame->args[i], (char *)callout->bound_values + callout->offsets[i], cif->atypes[i]->size);
+    } else if (callout->converters[i](interp, callout, i, callout->bound[i], &frame->args[i]) != TCL_OK) {
+      return TCL_ERROR;
     }
   }
+  return TCL_OK;
+}
 
-  /* free all libs */
-  for (entry = Tcl_FirstHashEntry(&client->libs, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
-    char *libraryName = Tcl_GetHashKey(&client->libs, entry);
-    ffidl_lib *libentry = Tcl_GetHashValue(entry);
-    ffidlclose(interp, libraryName, libentry->loadHandle, libentry->unloadProc);
-    Tcl_Free((void *)libentry);
+/* make a call with the argument values and return value storage given */
+static void callout_call(ffidl_callout *callout, void **args, void *ret)
+{
+  ffidl_cif *cif = callout->cif;
+#if USE_LIBFFI
+#if USE_THUNKS
+  if (callout->thunk) {
+    callout->thunk(callout->fn, args, ret);
+    return;
   }
-
-  /* free hashtables */
-  Tcl_DeleteHashTable(&client->callouts);
-#if USE_CALLBACKS
-  Tcl_DeleteHashTable(&client->callbacks);
 #endif
-  Tcl_DeleteHashTable(&client->cifs);
-  Tcl_DeleteHashTable(&client->types);
-  Tcl_DeleteHashTable(&client->libs);
-
-  /* free client structure */
-  Tcl_Free((void *)client);
-}
-/* client allocation and initialization */
-static ffidl_client *client_alloc(Tcl_Interp *interp)
-{
-  ffidl_client *client;
-
-  /* allocate client data structure */
-  client = (ffidl_client *)Tcl_Alloc(sizeof(ffidl_client));
-
-  /* allocate hashtables for this load */
-  Tcl_InitHashTable(&client->types, TCL_STRING_KEYS);
-  Tcl_InitHashTable(&client->callouts, TCL_STRING_KEYS);
-  Tcl_InitHashTable(&client->cifs, TCL_STRING_KEYS);
-  Tcl_InitHashTable(&client->libs, TCL_STRING_KEYS);
-#if USE_CALLBACKS
-  Tcl_InitHashTable(&client->callbacks, TCL_STRING_KEYS);
+#if USE_JIT
+  if (callout->jit || (callout->jit_code && jit_publish(callout))) {
+    callout->jit(args, ret);
+    return;
+  }
 #endif
-
-  /* initialize types */
-  ffidl_type_void.lib_type = lib_type_void;
-  ffidl_type_char.lib_type = lib_type_char;
-  ffidl_type_schar.lib_type = lib_type_schar;
-  ffidl_type_uchar.lib_type = lib_type_uchar;
-  ffidl_type_sshort.lib_type = lib_type_sshort;
-  ffidl_type_ushort.lib_type = lib_type_ushort;
-  ffidl_type_sint.lib_type = lib_type_sint;
-  ffidl_type_uint.lib_type = lib_type_uint;
-  ffidl_type_slong.lib_type = lib_type_slong;
-  ffidl_type_ulong.lib_type = lib_type_ulong;
-#if HAVE_LONG_LONG
-  ffidl_type_slonglong.lib_type = lib_type_slonglong;
-  ffidl_type_ulonglong.lib_type = lib_type_ulonglong;
+#if USE_LIBFFI_RAW_API
+  if (callout->use_raw_api)
+    ffi_raw_call(&cif->lib_cif, callout->fn, ret, (ffi_raw *)args[0]);
+  else
+    ffi_call(&cif->lib_cif, FFI_FN(callout->fn), ret, args);
+#else
+  ffi_call(&cif->lib_cif, FFI_FN(callout->fn), ret, args);
 #endif
-  ffidl_type_float.lib_type = lib_type_float;
-  ffidl_type_double.lib_type = lib_type_double;
-#if HAVE_LONG_DOUBLE
-  ffidl_type_longdouble.lib_type = lib_type_longdouble;
-#endif
-  ffidl_type_sint8.lib_type = lib_type_sint8;
-  ffidl_type_uint8.lib_type = lib_type_uint8;
-  ffidl_type_sint16.lib_type = lib_type_sint16;
-  ffidl_type_uint16.lib_type = lib_type_uint16;
-  ffidl_type_sint32.lib_type = lib_type_sint32;
-  ffidl_type_uint32.lib_type = lib_type_uint32;
+#elif USE_LIBFFCALL
+  av_alist alist;
+  int i;
+#if USE_THUNKS
+  if (callout->thunk) {
+    callout->thunk(callout->fn, args, ret);
+    return;
+  }
+#endif
+  switch (cif->rtype->typecode) {
+  case FFIDL_VOID:
+    av_start_void(alist,callout->fn);
+    break;
+  case FFIDL_INT:
+    av_start_int(alist,callout->fn,ret);
+    break;
+  case FFIDL_FLOAT:
+    av_start_float(alist,callout->fn,ret);
+    break;
+  case FFIDL_DOUBLE:
+    av_start_double(alist,callout->fn,ret);
+    break;
+  case FFIDL_UINT8:
+    av_start_uint8(alist,callout->fn,ret);
+    break;
+  case FFIDL_SINT8:
+    av_start_sint8(alist,callout->fn,ret);
+    break;
+  case FFIDL_UINT16:
+    av_start_uint16(alist,callout->fn,ret);
+    break;
+  case FFIDL_SINT16:
+    av_start_sint16(alist,callout->fn,ret);
+    break;
+  case FFIDL_UINT32:
+    av_start_uint32(alist,callout->fn,ret);
+    break;
+  case FFIDL_SINT32:
+    av_start_sint32(alist,callout->fn,ret);
+    break;
 #if HAVE_INT64
-  ffidl_type_sint64.lib_type = lib_type_sint64;
-  ffidl_type_uint64.lib_type = lib_type_uint64;
-#endif
-  ffidl_type_pointer.lib_type       = lib_type_pointer;
-  ffidl_type_pointer_obj.lib_type   = lib_type_pointer;
-  ffidl_type_pointer_utf8.lib_type  = lib_type_pointer;
-  ffidl_type_pointer_utf16.lib_type = lib_type_pointer;
-  ffidl_type_pointer_byte.lib_type  = lib_type_pointer;
-  ffidl_type_pointer_var.lib_type   = lib_type_pointer;
+  case FFIDL_UINT64:
+    av_start_uint64(alist,callout->fn,ret);
+    break;
+  case FFIDL_SINT64:
+    av_start_sint64(alist,callout->fn,ret);
+    break;
+#endif
+  case FFIDL_STRUCT:
+    _av_start_struct(alist,callout->fn,cif->rtype->size,cif->rtype->splittable,ret);
+    break;
+  case FFIDL_PTR:
+  case FFIDL_PTR_OBJ:
+  case FFIDL_PTR_UTF8:
+  case FFIDL_PTR_UTF16:
+  case FFIDL_PTR_BYTE:
+  case FFIDL_PTR_VAR:
 #if USE_CALLBACKS
-  ffidl_type_pointer_proc.lib_type = lib_type_pointer;
+  case FFIDL_PTR_PROC:
 #endif
+    av_start_ptr(alist,callout->fn,void *,ret);
+    break;
+  }
 
-  type_define(client, "void", &ffidl_type_void);
-  type_define(client, "char", &ffidl_type_char);
-  type_define(client, "signed char", &ffidl_type_schar);
-  type_define(client, "unsigned char", &ffidl_type_uchar);
-  type_define(client, "short", &ffidl_type_sshort);
-  type_define(client, "unsigned short", &ffidl_type_ushort);
-  type_define(client, "int", &ffidl_type_sint);
-  type_define(client, "unsigned", &ffidl_type_uint);
-  type_define(client, "long", &ffidl_type_slong);
-  type_define(client, "unsigned long", &ffidl_type_ulong);
-#if HAVE_LONG_LONG
-  type_define(client, "long long", &ffidl_type_slonglong);
-  type_define(client, "unsigned long long", &ffidl_type_ulonglong);
-#endif
-  type_define(client, "float", &ffidl_type_float);
-  type_define(client, "double", &ffidl_type_double);
-#if HAVE_LONG_DOUBLE
-  type_define(client, "long double", &ffidl_type_longdouble);
-#endif
-  type_define(client, "sint8", &ffidl_type_sint8);
-  type_define(client, "uint8", &ffidl_type_uint8);
-  type_define(client, "sint16", &ffidl_type_sint16);
-  type_define(client, "uint16", &ffidl_type_uint16);
-  type_define(client, "sint32", &ffidl_type_sint32);
-  type_define(client, "uint32", &ffidl_type_uint32);
+  for (i = 0; i < cif->argc; i += 1) {
+    switch (cif->atypes[i]->typecode) {
+    case FFIDL_VOID:
+      continue;
+    case FFIDL_INT:
+      av_int(alist,*(int *)args[i]);
+      continue;
+    case FFIDL_FLOAT:
+      av_float(alist,*(float *)args[i]);
+      continue;
+    case FFIDL_DOUBLE:
+      av_double(alist,*(double *)args[i]);
+      continue;
+    case FFIDL_UINT8:
+      av_uint8(alist,*(UINT8_T *)args[i]);
+      continue;
+    case FFIDL_SINT8:
+      av_sint8(alist,*(SINT8_T *)args[i]);
+      continue;
+    case FFIDL_UINT16:
+      av_uint16(alist,*(UINT16_T *)args[i]);
+      continue;
+    case FFIDL_SINT16:
+      av_sint16(alist,*(SINT16_T *)args[i]);
+      continue;
+    case FFIDL_UINT32:
+      av_uint32(alist,*(UINT32_T *)args[i]);
+      continue;
+    case FFIDL_SINT32:
+      av_sint32(alist,*(SINT32_T *)args[i]);
+      continue;
 #if HAVE_INT64
-  type_define(client, "sint64", &ffidl_type_sint64);
-  type_define(client, "uint64", &ffidl_type_uint64);
+    case FFIDL_UINT64:
+      av_uint64(alist,*(UINT64_T *)args[i]);
+      continue;
+    case FFIDL_SINT64:
+      av_sint64(alist,*(SINT64_T *)args[i]);
+      continue;
 #endif
-  type_define(client, "pointer", &ffidl_type_pointer);
-  type_define(client, "pointer-obj", &ffidl_type_pointer_obj);
-  type_define(client, "pointer-utf8", &ffidl_type_pointer_utf8);
-  type_define(client, "pointer-utf16", &ffidl_type_pointer_utf16);
-  type_define(client, "pointer-byte", &ffidl_type_pointer_byte);
-  type_define(client, "pointer-var", &ffidl_type_pointer_var);
+    case FFIDL_STRUCT:
+      _av_struct(alist,cif->atypes[i]->size,cif->atypes[i]->alignment,args[i]);
+      continue;
+    case FFIDL_PTR:
+    case FFIDL_PTR_OBJ:
+    case FFIDL_PTR_UTF8:
+    case FFIDL_PTR_UTF16:
+    case FFIDL_PTR_BYTE:
+    case FFIDL_PTR_VAR:
 #if USE_CALLBACKS
-  type_define(client, "pointer-proc", &ffidl_type_pointer_proc);
+    case FFIDL_PTR_PROC:
+#endif
+      av_ptr(alist,void *,*(void **)args[i]);
+      continue;
+    }
+    /* Note: change "continue" to "break" if further work must be done here. */
+  }
+  av_call(alist);
 #endif
+}
 
-  /* arrange for cleanup on interpreter deletion */
-  Tcl_CallWhenDeleted(interp, client_delete, (ClientData)client);
+/*
+ * Memoized callouts.
+ *
+ * The results of a -memoize callout are kept in a hash table keyed by the C
+ * values of its arguments, which must all be passed by value, and bounded
+ * by dropping the least recently used result.
+ */
+#define MEMO_ARG_OK(type) (CALLOUT_BIND_AHEAD(type) || (type)->typecode == FFIDL_STRUCT)
+
+/* the number of key bytes of a value: structures leave out their padding */
+static size_t memo_key_size(ffidl_type *type)
+{
+  size_t nbytes = 0;
+  int i;
+
+  if (type->typecode != FFIDL_STRUCT) {
+    return type->size;
+  }
+  for (i = 0; i < type->nelts; i += 1) {
+    nbytes += memo_key_size(type->elements[i]);
+  }
+  return nbytes;
+}
+
+/* append the key bytes of the value at argp to key, returning the key's end */
+static char *memo_key_append(char *key, char *argp, ffidl_type *type)
+{
+  size_t offset = 0;
+  int i;
+
+  if (type->typecode != FFIDL_STRUCT) {
+    memcpy(key, argp, type->size);
+    return key + type->size;
+  }
+  for (i = 0; i < type->nelts; i += 1) {
+    ffidl_type *elt = type->elements[i];
+    offset = (offset + elt->alignment - 1) & ~(size_t)(elt->alignment - 1);
+    key = memo_key_append(key, argp + offset, elt);
+    offset += elt->size;
+  }
+  return key;
+}
+
+static ffidl_memo_cache *memo_new(ffidl_callout *callout, int size)
+{
+  ffidl_cif *cif = callout->cif;
+  ffidl_memo_cache *memo;
+  int i, nbytes = 0;
+
+  for (i = 0; i < cif->argc; i += 1) {
+    nbytes += memo_key_size(cif->atypes[i]);
+  }
+  memo = (ffidl_memo_cache *)Tcl_Alloc(sizeof(ffidl_memo_cache));
+  memo->size = size;
+  memo->nkey = (nbytes + sizeof(int) - 1) / sizeof(int);
+  if (memo->nkey == 0) {
+    memo->nkey = 1;
+  }
+  memo->rsize = cif->rtype->typecode == FFIDL_STRUCT ? cif->rtype->size : sizeof(ffidl_value);
+  memo->key = (int *)Tcl_Alloc(memo->nkey * sizeof(int));
+  memo->head = memo->tail = NULL;
+  Tcl_InitHashTable(&memo->table, memo->nkey);
+  return memo;
+}
+
+static void memo_free(ffidl_memo_cache *memo)
+{
+  while (memo->head != NULL) {
+    ffidl_memo *m = memo->head;
+    memo->head = m->next;
+    Tcl_Free((void *)m);
+  }
+  Tcl_DeleteHashTable(&memo->table);
+  Tcl_Free((void *)memo->key);
+  Tcl_Free((void *)memo);
+}
+
+/* make a call, or find its result among those remembered */
+static void memo_call(ffidl_callout *callout, void **args, void *ret)
+{
+  ffidl_memo_cache *memo = callout->memo;
+  ffidl_cif *cif = callout->cif;
+  char *key = (char *)memo->key;
+  ffidl_memo *m;
+  Tcl_HashEntry *entry;
+  int i, isnew;
+
+  /* gather the argument values into the key */
+  memo->key[memo->nkey-1] = 0;
+  for (i = 0; i < cif->argc; i += 1) {
+    void *argp = args[i];
+#if USE_LIBFFI_RAW_API
+    if (callout->use_raw_api && FFIDL_RAW_STRUCT(cif->atypes[i])) {
+      argp = *(void **)argp;
+    }
+#endif
+    key = memo_key_append(key, (char *)argp, cif->atypes[i]);
+  }
+  entry = Tcl_FindHashEntry(&memo->table, (char *)memo->key);
+  if (entry != NULL) {
+    m = (ffidl_memo *)Tcl_GetHashValue(entry);
+    memcpy(ret, &m->rvalue, memo->rsize);
+    if (m != memo->head) {
+      /* move to the front of the list */
+      m->prev->next = m->next;
+      if (m->next) m->next->prev = m->prev; else memo->tail = m->prev;
+      m->prev = NULL;
+      m->next = memo->head;
+      memo->head->prev = m;
+      memo->head = m;
+    }
+    return;
+  }
+  callout_call(callout, args, ret);
+  if (memo->table.numEntries >= memo->size) {
+    /* reuse the least recently used result */
+    m = memo->tail;
+    Tcl_DeleteHashEntry(m->entry);
+    memo->tail = m->prev;
+    if (memo->tail) memo->tail->next = NULL; else memo->head = NULL;
+  } else {
+    m = (ffidl_memo *)Tcl_Alloc(offsetof(ffidl_memo, rvalue)
+				+(memo->rsize > sizeof(ffidl_value) ? memo->rsize : sizeof(ffidl_value)));
+  }
+  memcpy(&m->rvalue, ret, memo->rsize);
+  m->entry = Tcl_CreateHashEntry(&memo->table, (char *)memo->key, &isnew);
+  Tcl_SetHashValue(m->entry, m);
+  m->prev = NULL;
+  m->next = memo->head;
+  if (memo->head) memo->head->prev = m; else memo->tail = m;
+  memo->head = m;
+}
+/*
+ * lib management, but note we never free a lib
+ * because we cannot know how often it is used.
+ */
+/* define a new lib */
+static void lib_define(ffidl_client *client, char *lname, void *handle, void* unload)
+{
+  ffidl_lib *libentry = (ffidl_lib *)Tcl_Alloc(sizeof(ffidl_lib));
+  libentry->loadHandle = handle;
+  libentry->unloadProc = unload;
+  entry_define(&client->libs,lname,libentry);
+}
+/* lookup an existing type */
+static ffidl_LoadHandle lib_lookup(ffidl_client *client,
+				   char *lname,
+				   ffidl_UnloadProc *unload)
+{
+  ffidl_lib *libentry = entry_lookup(&client->libs,lname);
+  if (libentry) {
+    if (unload) {
+      *unload = libentry->unloadProc;
+    }
+    return libentry->loadHandle;
+  } else {
+    return NULL;
+  }
+}
+#if USE_CALLBACKS
+/*
+ * callback management
+ */
+#if TCL_THREADS && USE_LIBFFI
+static void callback_pool_delete(ffidl_callback_pool *pool);
+#endif
+/* make the record buffer of a -batch callback */
+static ffidl_callback_batch *callback_batch_new(ffidl_cif *cif, int columns, int size)
+{
+  ffidl_callback_batch *batch;
+  size_t recsize = 0, align = 1;
+  int i;
+  batch = (ffidl_callback_batch *)Tcl_Alloc(sizeof(ffidl_callback_batch)+cif->argc*sizeof(size_t));
+  memset(batch, 0, sizeof(ffidl_callback_batch));
+  batch->offsets = (size_t *)(batch+1);
+  for (i = 0; i < cif->argc; i += 1) {
+    ffidl_type *type = cif->atypes[i];
+    recsize = (recsize+type->alignment-1)/type->alignment*type->alignment;
+    batch->offsets[i] = recsize;
+    recsize += type->size;
+    if (type->alignment > align) {
+      align = type->alignment;
+    }
+  }
+  batch->recsize = (recsize+align-1)/align*align;
+  batch->columns = columns;
+  batch->size = size;
+  batch->records = Tcl_Alloc(size*batch->recsize+1);
+  return batch;
+}
+static void callback_batch_free(ffidl_callback_batch *batch)
+{
+  Tcl_ConditionFinalize(&batch->drained);
+  Tcl_MutexFinalize(&batch->mutex);
+  Tcl_Free(batch->records);
+  Tcl_Free((void *)batch);
+}
+/*
+ * Allocate a userdata handle for a -userdata callback, or return NULL when
+ * there are too many of them.
+ */
+static void *userdata_alloc(ffidl_client *client, ffidl_callback *callback)
+{
+  ffidl_userdata_slot *slot;
+  int i = client->freeuserdata;
+  Tcl_MutexLock(&client->userdata_mutex);
+  if (i < 0) {
+    int n = client->nuserdata ? 2*client->nuserdata : 16;
+    if (client->nuserdata == FFIDL_USERDATA_MASK) {
+      Tcl_MutexUnlock(&client->userdata_mutex);
+      return NULL;
+    }
+    if (n > FFIDL_USERDATA_MASK) {
+      n = FFIDL_USERDATA_MASK;
+    }
+    client->userdata = (ffidl_userdata_slot *)Tcl_Realloc((char *)client->userdata, n*sizeof(ffidl_userdata_slot));
+    for (i = n; i-- > client->nuserdata; ) {
+      client->userdata[i].callback = NULL;
+      client->userdata[i].generation = 0;
+      client->userdata[i].next = i+1 < n ? i+1 : -1;
+    }
+    i = client->nuserdata;
+    client->nuserdata = n;
+  }
+  slot = &client->userdata[i];
+  client->freeuserdata = slot->next;
+  slot->callback = callback;
+  Tcl_MutexUnlock(&client->userdata_mutex);
+  return (void *)((slot->generation<<FFIDL_USERDATA_BITS)|(size_t)(i+1));
+}
+/* free the userdata handle of a -userdata callback */
+static void userdata_free(ffidl_client *client, void *userdata)
+{
+  int i = (int)(((size_t)userdata)&FFIDL_USERDATA_MASK)-1;
+  ffidl_userdata_slot *slot;
+  Tcl_MutexLock(&client->userdata_mutex);
+  slot = &client->userdata[i];
+  slot->callback = NULL;
+  slot->generation = (slot->generation+1)&(((size_t)-1)>>FFIDL_USERDATA_BITS);
+  slot->next = client->freeuserdata;
+  client->freeuserdata = i;
+  Tcl_MutexUnlock(&client->userdata_mutex);
+}
+/* find the -userdata callback of a userdata handle, or NULL */
+static ffidl_callback *userdata_lookup(ffidl_client *client, void *userdata, int locked)
+{
+  ffidl_callback *callback = NULL;
+  size_t i = (((size_t)userdata)&FFIDL_USERDATA_MASK)-1;
+  if (locked) {
+    Tcl_MutexLock(&client->userdata_mutex);
+  }
+  if (i < (size_t)client->nuserdata
+      && client->userdata[i].generation == ((size_t)userdata)>>FFIDL_USERDATA_BITS) {
+    callback = client->userdata[i].callback;
+  }
+  if (locked) {
+    Tcl_MutexUnlock(&client->userdata_mutex);
+  }
+  return callback;
+}
+
+#if USE_LIBFFI
+/* room for either kind of closure, a raw one is larger */
+#if USE_LIBFFI_RAW_API
+#define FFIDL_CLOSURE_SIZE \
+  (sizeof(ffi_raw_closure) > sizeof(ffi_closure) ? sizeof(ffi_raw_closure) : sizeof(ffi_closure))
+#else
+#define FFIDL_CLOSURE_SIZE sizeof(ffi_closure)
+#endif
+/*
+ * Take an idle closure for a callback of cif, allocating a chunk of them
+ * when there are none left.
+ */
+static int closure_alloc(ffidl_cif *cif, ffidl_closure *closure)
+{
+  ffidl_closure_pool *pool = cif->closures;
+  if (pool == NULL) {
+    /* the first callback of this signature */
+    ffidl_client *client = cif->client;
+    char *signature = Tcl_GetHashKey(&client->cifs, cif_find(client, cif));
+    pool = cif->closures = (ffidl_closure_pool *)Tcl_Alloc(sizeof(ffidl_closure_pool));
+    pool->count = 0;
+    entry_define(&client->closures, signature, (void *)pool);
+  }
+  if (pool->count == 0) {
+    while (pool->count < FFIDL_CLOSURE_CHUNK) {
+      ffidl_closure *idle = &pool->idle[pool->count];
+      idle->lib_closure = ffi_closure_alloc(FFIDL_CLOSURE_SIZE, &idle->executable);
+      if (idle->lib_closure == NULL) {
+	break;
+      }
+      pool->count += 1;
+    }
+  }
+  if (pool->count == 0) {
+    closure->lib_closure = NULL;
+    return TCL_ERROR;
+  }
+  *closure = pool->idle[--pool->count];
+  return TCL_OK;
+}
+/* return the closure of a callback of cif to the idle ones */
+static void closure_release(ffidl_cif *cif, ffidl_closure *closure)
+{
+  ffidl_closure_pool *pool = cif->closures;
+  if (pool->count < FFIDL_CLOSURE_POOL_SIZE) {
+    pool->idle[pool->count++] = *closure;
+  } else {
+    ffi_closure_free(closure->lib_closure);
+  }
+  closure->lib_closure = NULL;
+}
+#endif
+/* free a defined callback */
+static void callback_destroy(char *blockPtr)
+{
+  ffidl_callback *callback = (ffidl_callback *)blockPtr;
+  int i;
+#if TCL_THREADS && USE_LIBFFI
+  if (callback->pool != NULL) {
+    callback_pool_delete(callback->pool);
+  }
+#endif
+  if (callback->batch != NULL) {
+    callback_batch_free(callback->batch);
+  }
+  for (i = 0; i < callback->cmdc; i++) {
+    Tcl_DecrRefCount(callback->cmdv[i]);
+  }
+  for (i = 0; i < callback->cif->argc; i++) {
+    if (callback->argobjs[i] != NULL) {
+      Tcl_DecrRefCount(callback->argobjs[i]);
+    }
+  }
+  while (callback->frames != NULL) {
+    ffidl_callback_frame *frame = callback->frames;
+    callback->frames = frame->next;
+    Tcl_Free((void *)frame);
+  }
+  if (callback->trampoline != NULL) {
+    userdata_free(callback->trampoline->client, callback->userdata);
+  } else {
+#if USE_LIBFFI
+    closure_release(callback->cif, &callback->closure);
+#elif USE_LIBFFCALL
+    free_callback(callback->closure.lib_closure);
+#endif
+  }
+  cif_dec_ref(callback->cif);
+  Tcl_Free((void *)callback);
+}
+/*
+ * Free a callback, once none of its invocations is running any more: a
+ * callback may be redefined or its interp deleted from its own command.
+ */
+static void callback_free(ffidl_callback *callback)
+{
+  if (callback) {
+    Tcl_EventuallyFree((ClientData)callback, callback_destroy);
+  }
+}
+/*
+ * Return a new callback epoch.  Epochs are unique across clients, so that a
+ * cached callback never matches a client allocated at the same address.
+ */
+static unsigned long callback_epoch_next(void)
+{
+  unsigned long epoch;
+  Tcl_MutexLock(&callback_epoch_mutex);
+  epoch = ++callback_epochs;
+  Tcl_MutexUnlock(&callback_epoch_mutex);
+  return epoch;
+}
+/* define a new callback */
+static void callback_define(ffidl_client *client, char *cname, ffidl_callback *callback)
+{
+  ffidl_callback *old_callback = NULL;
+  /* if callback is already defined, clean it up. */
+  old_callback = entry_lookup(&client->callbacks,cname);
+  callback_free(old_callback);
+  entry_define(&client->callbacks,cname,(void*)callback);
+  /* invalidate the callbacks cached in pointer-proc arguments */
+  client->callback_epoch = callback_epoch_next();
+}
+/* lookup an existing callback */
+static ffidl_callback *callback_lookup(ffidl_client *client, char *cname)
+{
+  return entry_lookup(&client->callbacks,cname);
+}
+/* the function pointer native code calls a callback through */
+static void *callback_address(ffidl_callback *callback)
+{
+#if USE_LIBFFI
+  if (callback->trampoline != NULL) {
+    return (void *)FFI_FN(callback->trampoline->closure.executable);
+  }
+  return (void *)FFI_FN(callback->closure.executable);
+#elif USE_LIBFFCALL
+  return (void *)callback->closure.lib_closure;
+#endif
+}
+/*
+ * The value an anonymous callback is known by: its function pointer, or the
+ * userdata handle of a -userdata callback.
+ */
+static void *callback_handle_key(ffidl_callback *callback)
+{
+  if (callback->trampoline != NULL) {
+    return callback->userdata;
+  }
+  return callback_address(callback);
+}
+/* lookup the anonymous callback whose value obj holds */
+static ffidl_callback_handle *callback_handle_lookup(ffidl_client *client, Tcl_Obj *obj)
+{
+  Tcl_HashEntry *entry;
+  void *key;
+  if (Ffidl_GetPointerFromObj(NULL, obj, &key) != TCL_OK) {
+    return NULL;
+  }
+  entry = Tcl_FindHashEntry(&client->anonymous, (const char *)key);
+  return entry != NULL ? (ffidl_callback_handle *)Tcl_GetHashValue(entry) : NULL;
+}
+/* enter a new anonymous callback in the table, and return its value */
+static Tcl_Obj *callback_handle_new(ffidl_client *client, ffidl_callback *callback)
+{
+  ffidl_callback_handle *handle = (ffidl_callback_handle *)Tcl_Alloc(sizeof(ffidl_callback_handle));
+  void *key = callback_handle_key(callback);
+  int isNew;
+  handle->refs = 1;
+  handle->callback = callback;
+  Tcl_SetHashValue(Tcl_CreateHashEntry(&client->anonymous, (const char *)key, &isNew), handle);
+  return Ffidl_NewPointerObj(key);
+}
+/* drop a reference to an anonymous callback, freeing it with the last */
+static void callback_handle_release(ffidl_callback_handle *handle)
+{
+  if (--handle->refs > 0) {
+    return;
+  }
+  if (handle->callback != NULL) {
+    callback_free(handle->callback);
+  }
+  Tcl_Free((void *)handle);
+}
+/* remove an anonymous callback from the table, for ::ffidl::callback -delete */
+static int callback_handle_delete(Tcl_Interp *interp, ffidl_client *client, Tcl_Obj *obj)
+{
+  Tcl_HashEntry *entry;
+  void *key;
+  if (Ffidl_GetPointerFromObj(NULL, obj, &key) != TCL_OK ||
+      (entry = Tcl_FindHashEntry(&client->anonymous, (const char *)key)) == NULL) {
+    Tcl_AppendResult(interp, "no anonymous callback \"", Tcl_GetString(obj), "\" is defined", NULL);
+    return TCL_ERROR;
+  }
+  callback_handle_release((ffidl_callback_handle *)Tcl_GetHashValue(entry));
+  Tcl_DeleteHashEntry(entry);
+  /* invalidate the callbacks cached in pointer-proc arguments */
+  client->callback_epoch = callback_epoch_next();
+  return TCL_OK;
+}
+#if USE_LIBFFI
+/*
+ * The closure functions of native comparators and hash functions.
+ */
+#define FFIDL_NATIVE_COMPARE(ctype)		\
+  {						\
+    ctype x, y;					\
+    memcpy(&x, a, sizeof(ctype));		\
+    memcpy(&y, b, sizeof(ctype));		\
+    order = (x > y) - (x < y);			\
+  }
+/* int compare(const void *a, const void *b) */
+static void native_compare(ffi_cif *lib_cif, void *ret, void **args, void *user_data)
+{
+  ffidl_native *native = (ffidl_native *)user_data;
+  const char *a = *(const char **)args[0] + native->offset;
+  const char *b = *(const char **)args[1] + native->offset;
+  int order;
+  switch (native->typecode) {
+  case FFIDL_INT:	FFIDL_NATIVE_COMPARE(int); break;
+  case FFIDL_FLOAT:	FFIDL_NATIVE_COMPARE(float); break;
+  case FFIDL_DOUBLE:	FFIDL_NATIVE_COMPARE(double); break;
+#if HAVE_LONG_DOUBLE
+  case FFIDL_LONGDOUBLE:FFIDL_NATIVE_COMPARE(long double); break;
+#endif
+  case FFIDL_UINT8:	FFIDL_NATIVE_COMPARE(UINT8_T); break;
+  case FFIDL_SINT8:	FFIDL_NATIVE_COMPARE(SINT8_T); break;
+  case FFIDL_UINT16:	FFIDL_NATIVE_COMPARE(UINT16_T); break;
+  case FFIDL_SINT16:	FFIDL_NATIVE_COMPARE(SINT16_T); break;
+  case FFIDL_UINT32:	FFIDL_NATIVE_COMPARE(UINT32_T); break;
+  case FFIDL_SINT32:	FFIDL_NATIVE_COMPARE(SINT32_T); break;
+#if HAVE_INT64
+  case FFIDL_UINT64:	FFIDL_NATIVE_COMPARE(UINT64_T); break;
+  case FFIDL_SINT64:	FFIDL_NATIVE_COMPARE(SINT64_T); break;
+#endif
+  case FFIDL_PTR:	FFIDL_NATIVE_COMPARE(size_t); break;	/* addresses */
+  default:
+    order = memcmp(a, b, native->size);
+    order = (order > 0) - (order < 0);
+    break;
+  }
+  FFIDL_RVALUE_POKE_WIDENED(INT, ret, native->descending ? -order : order);
+}
+#undef FFIDL_NATIVE_COMPARE
+/* the 32 bits at p, little endian */
+static UINT32_T native_read32(const unsigned char *p)
+{
+  return (UINT32_T)p[0] | (UINT32_T)p[1]<<8 | (UINT32_T)p[2]<<16 | (UINT32_T)p[3]<<24;
+}
+#define FFIDL_ROTL32(x, r) (((x) << (r)) | ((x) >> (32 - (r))))
+/* FNV-1a, starting from its offset basis xor seed */
+static UINT32_T native_fnv1a(const unsigned char *p, size_t n, UINT32_T seed)
+{
+  UINT32_T h = 2166136261U ^ seed;
+  while (n-- > 0) {
+    h = (h ^ *p++) * 16777619U;
+  }
+  return h;
+}
+/* xxHash32 */
+#define XXH_PRIME32_1 2654435761U
+#define XXH_PRIME32_2 2246822519U
+#define XXH_PRIME32_3 3266489917U
+#define XXH_PRIME32_4 668265263U
+#define XXH_PRIME32_5 374761393U
+#define XXH_ROUND(v, p) (FFIDL_ROTL32((v) + native_read32(p) * XXH_PRIME32_2, 13) * XXH_PRIME32_1)
+static UINT32_T native_xxhash32(const unsigned char *p, size_t n, UINT32_T seed)
+{
+  const unsigned char *end = p + n;
+  UINT32_T h;
+  if (n >= 16) {
+    UINT32_T v1 = seed + XXH_PRIME32_1 + XXH_PRIME32_2;
+    UINT32_T v2 = seed + XXH_PRIME32_2;
+    UINT32_T v3 = seed;
+    UINT32_T v4 = seed - XXH_PRIME32_1;
+    do {
+      v1 = XXH_ROUND(v1, p);
+      v2 = XXH_ROUND(v2, p+4);
+      v3 = XXH_ROUND(v3, p+8);
+      v4 = XXH_ROUND(v4, p+12);
+      p += 16;
+    } while (end - p >= 16);
+    h = FFIDL_ROTL32(v1, 1) + FFIDL_ROTL32(v2, 7) + FFIDL_ROTL32(v3, 12) + FFIDL_ROTL32(v4, 18);
+  } else {
+    h = seed + XXH_PRIME32_5;
+  }
+  h += (UINT32_T)n;
+  for (; end - p >= 4; p += 4) {
+    h = FFIDL_ROTL32(h + native_read32(p) * XXH_PRIME32_3, 17) * XXH_PRIME32_4;
+  }
+  for (; p < end; p += 1) {
+    h = FFIDL_ROTL32(h + *p * XXH_PRIME32_5, 11) * XXH_PRIME32_1;
+  }
+  h ^= h >> 15;
+  h *= XXH_PRIME32_2;
+  h ^= h >> 13;
+  h *= XXH_PRIME32_3;
+  h ^= h >> 16;
+  return h;
+}
+#undef XXH_ROUND
+/*
+ * uint32 hash(const void *key), over size bytes or up to a NUL, or
+ * uint32 hash(const void *key, size_t length)
+ */
+static void native_hash(ffi_cif *lib_cif, void *ret, void **args, void *user_data)
+{
+  ffidl_native *native = (ffidl_native *)user_data;
+  const unsigned char *key = *(const unsigned char **)args[0];
+  size_t n;
+  UINT32_T h;
+  switch (native->length) {
+  case FFIDL_NATIVE_LENGTH: n = (size_t)*(void **)args[1]; break;
+  case FFIDL_NATIVE_STRING: n = strlen((const char *)key); break;
+  default: n = native->size; break;
+  }
+  if (native->algorithm == FFIDL_HASH_XXHASH32) {
+    h = native_xxhash32(key, n, native->seed);
+  } else {
+    h = native_fnv1a(key, n, native->seed);
+  }
+  FFIDL_RVALUE_POKE_WIDENED(UINT32, ret, h);
+}
+#endif
+/*
+ * Make the anonymous callback of a native hash function, or comparator,
+ * with the signature args -> ret and a copy of native, and leave its handle
+ * in the interp result.
+ */
+static int native_new(Tcl_Interp *interp, ffidl_client *client, const char *args, const char *ret,
+		      int hash, ffidl_native *native)
+{
+#if USE_LIBFFI
+  Tcl_Obj *argsObj = Tcl_NewStringObj(args, -1);
+  Tcl_Obj *returnObj = Tcl_NewStringObj(ret, -1);
+  ffidl_cif *cif = NULL;
+  ffidl_callback *callback;
+  int status;
+  Tcl_IncrRefCount(argsObj);
+  Tcl_IncrRefCount(returnObj);
+  status = cif_parse(interp, client, argsObj, returnObj, NULL, &cif);
+  Tcl_DecrRefCount(argsObj);
+  Tcl_DecrRefCount(returnObj);
+  if (status == TCL_ERROR) {
+    return TCL_ERROR;
+  }
+  callback = (ffidl_callback *)Tcl_Alloc(sizeof(ffidl_callback)
+					 /* reusable argument Tcl_Objs, unused */
+					 +cif->argc*sizeof(Tcl_Obj *)
+					 +sizeof(ffidl_native));
+  callback->cif = cif;
+  callback->interp = interp;
+  callback->cmdc = 0;
+  callback->cmdv = (Tcl_Obj **)(callback+1);
+  callback->frames = NULL;
+  callback->flags = 0;
+  callback->batch = NULL;
+#if TCL_THREADS
+  callback->owner = Tcl_GetCurrentThread();
+  callback->pool = NULL;
+#endif
+  callback->argobjs = callback->cmdv;
+  memset(callback->argobjs, 0, cif->argc*sizeof(Tcl_Obj *));
+  callback->userdata = NULL;
+  callback->trampoline = NULL;
+  callback->native = (ffidl_native *)(callback->argobjs+cif->argc);
+  *callback->native = *native;
+#if USE_LIBFFI_RAW_API
+  callback->use_raw_api = 0;
+  callback->offsets = NULL;
+#endif
+  if (closure_alloc(cif, &callback->closure) != TCL_OK) {
+    Tcl_AppendResult(interp, "libffi can't allocate closure", NULL);
+    goto error;
+  }
+  if (ffi_prep_closure_loc(callback->closure.lib_closure, &cif->lib_cif,
+			   hash ? native_hash : native_compare,
+			   (void *)callback->native, callback->closure.executable) != FFI_OK) {
+    closure_release(cif, &callback->closure);
+    Tcl_AppendResult(interp, "libffi can't make closure", NULL);
+    goto error;
+  }
+  Tcl_SetObjResult(interp, callback_handle_new(client, callback));
+  return TCL_OK;
+ error:
+  cif_dec_ref(cif);
+  Tcl_Free((void *)callback);
+  return TCL_ERROR;
+#else
+  Tcl_AppendResult(interp, "native functions require libffi", NULL);
+  return TCL_ERROR;
+#endif
+}
+/* find a callback by it's ffidl_callback */
+/*
+static Tcl_HashEntry *callback_find(ffidl_client *client, ffidl_callback *callback)
+{
+  return entry_find(&client->callbacks,(void *)callback);
+}
+*/
+/* delete a callback definition */
+/*
+static void callback_delete(ffidl_client *client, ffidl_callback *callback)
+{
+  Tcl_HashEntry *entry = callback_find(client, callback);
+  if (entry) {
+    callback_free(callback);
+    Tcl_DeleteHashEntry(entry);
+  }
+}
+*/
+/*
+ * Return obj set to the callback argument value of the type at argp, or a
+ * new Tcl_Obj if obj is NULL.  obj must be unshared.
+ */
+#define CALLBACK_ARG_OBJ(newobj, setobj, value) \
+  if (obj == NULL) return newobj(value); \
+  setobj(obj, value); \
+  return obj
+
+static Tcl_Obj *callback_arg_obj(Tcl_Obj *obj, ffidl_type *type, void *argp)
+{
+  switch (type->typecode) {
+  case FFIDL_INT:	CALLBACK_ARG_OBJ(Tcl_NewLongObj, Tcl_SetLongObj, (long)(*(int *)argp));
+  case FFIDL_FLOAT:	CALLBACK_ARG_OBJ(Tcl_NewDoubleObj, Tcl_SetDoubleObj, (double)(*(float *)argp));
+  case FFIDL_DOUBLE:	CALLBACK_ARG_OBJ(Tcl_NewDoubleObj, Tcl_SetDoubleObj, *(double *)argp);
+#if HAVE_LONG_DOUBLE
+  case FFIDL_LONGDOUBLE:CALLBACK_ARG_OBJ(Tcl_NewDoubleObj, Tcl_SetDoubleObj, (double)(*(long double *)argp));
+#endif
+  case FFIDL_UINT8:	CALLBACK_ARG_OBJ(Tcl_NewLongObj, Tcl_SetLongObj, (long)(*(UINT8_T *)argp));
+  case FFIDL_SINT8:	CALLBACK_ARG_OBJ(Tcl_NewLongObj, Tcl_SetLongObj, (long)(*(SINT8_T *)argp));
+  case FFIDL_UINT16:	CALLBACK_ARG_OBJ(Tcl_NewLongObj, Tcl_SetLongObj, (long)(*(UINT16_T *)argp));
+  case FFIDL_SINT16:	CALLBACK_ARG_OBJ(Tcl_NewLongObj, Tcl_SetLongObj, (long)(*(SINT16_T *)argp));
+  case FFIDL_UINT32:	CALLBACK_ARG_OBJ(Tcl_NewLongObj, Tcl_SetLongObj, (long)(*(UINT32_T *)argp));
+  case FFIDL_SINT32:	CALLBACK_ARG_OBJ(Tcl_NewLongObj, Tcl_SetLongObj, (long)(*(SINT32_T *)argp));
+#if HAVE_INT64
+  case FFIDL_UINT64:	CALLBACK_ARG_OBJ(Ffidl_NewInt64Obj, Ffidl_SetInt64Obj, (Ffidl_Int64)(*(UINT64_T *)argp));
+  case FFIDL_SINT64:	CALLBACK_ARG_OBJ(Ffidl_NewInt64Obj, Ffidl_SetInt64Obj, (Ffidl_Int64)(*(SINT64_T *)argp));
+#endif
+  case FFIDL_STRUCT:
+    if (obj == NULL) return Tcl_NewByteArrayObj((unsigned char *)argp, type->size);
+    Tcl_SetByteArrayObj(obj, (unsigned char *)argp, type->size);
+    return obj;
+  case FFIDL_PTR:	CALLBACK_ARG_OBJ(Ffidl_NewPointerObj, Ffidl_SetPointerObj, *(void **)argp);
+  case FFIDL_PTR_UTF8:
+    if (obj == NULL) return Tcl_NewStringObj(*(char **)argp, -1);
+    Tcl_SetStringObj(obj, *(char **)argp, -1);
+    return obj;
+  case FFIDL_PTR_UTF16:
+    if (obj == NULL) return Tcl_NewUnicodeObj(*(Tcl_UniChar **)argp, -1);
+    Tcl_SetUnicodeObj(obj, *(Tcl_UniChar **)argp, -1);
+    return obj;
+  default:
+    return NULL;
+  }
+}
+#undef CALLBACK_ARG_OBJ
+
+/*
+ * Take the argument Tcl_Obj left for reuse in slot i, if any, for the
+ * duration of an invocation.  Nested invocations of the same callback find
+ * the slot empty and make new ones.
+ */
+static Tcl_Obj *callback_arg_take(ffidl_callback *callback, int i)
+{
+  Tcl_Obj *obj = callback->argobjs[i];
+  callback->argobjs[i] = NULL;
+  return obj;
+}
+
+/* Give back the argument Tcl_Objs of an invocation, keeping unshared ones. */
+static void callback_args_release(ffidl_callback *callback, Tcl_Obj **objv)
+{
+  ffidl_cif *cif = callback->cif;
+  int i;
+  for (i = 0; i < cif->argc; i++) {
+    if (cif->atypes[i]->typecode != FFIDL_PTR_OBJ
+	&& callback->argobjs[i] == NULL && !Tcl_IsShared(objv[i])) {
+      callback->argobjs[i] = objv[i];
+    } else {
+      Tcl_DecrRefCount(objv[i]);
+    }
+  }
+}
+
+/*
+ * Return the command words of an invocation of a callback, with its
+ * command prefix filled in: stackv if they fit, else a pooled frame.
+ * Each invocation has its own, so that the callback may be re-entered
+ * from its command.
+ */
+static Tcl_Obj **callback_objv_get(ffidl_callback *callback, Tcl_Obj **stackv)
+{
+  int objc = callback->cmdc+callback->cif->argc;
+  Tcl_Obj **objv = stackv;
+  if (objc > FFIDL_CALLBACK_STACK_OBJS) {
+    ffidl_callback_frame *frame = callback->frames;
+    if (frame != NULL) {
+      callback->frames = frame->next;
+    } else {
+      frame = (ffidl_callback_frame *)Tcl_Alloc(sizeof(ffidl_callback_frame)+objc*sizeof(Tcl_Obj *));
+    }
+    objv = (Tcl_Obj **)(frame+1);
+  }
+  memcpy(objv, callback->cmdv, callback->cmdc*sizeof(Tcl_Obj *));
+  return objv;
+}
+
+/* Give back the command words returned by callback_objv_get(). */
+static void callback_objv_put(ffidl_callback *callback, Tcl_Obj **objv, Tcl_Obj **stackv)
+{
+  if (objv != stackv) {
+    ffidl_callback_frame *frame = ((ffidl_callback_frame *)objv)-1;
+    frame->next = callback->frames;
+    callback->frames = frame;
+  }
+}
+
+/*
+ * Return the function of the callout named by the command prefix of a
+ * callback, when passing it instead of the callback's closure is
+ * equivalent: the prefix is that single word, the callout has the
+ * callback's protocol and types, whatever names they were spelled with,
+ * and neither adds behaviour to the call.  Else NULL.
+ */
+static void *callback_native(ffidl_callback *callback)
+{
+  Tcl_Command token;
+  Tcl_CmdInfo info;
+  ffidl_callout *callout;
+  if (callback->cmdc != 1 || callback->flags != 0 || callback->batch != NULL
+#if TCL_THREADS
+      || callback->pool != NULL
+#endif
+      ) {
+    return NULL;
+  }
+  token = Tcl_FindCommand(callback->interp, Tcl_GetString(callback->cmdv[0]), NULL, TCL_GLOBAL_ONLY);
+  if (token == NULL || !Tcl_GetCommandInfoFromToken(token, &info) || info.objProc != tcl_ffidl_call
+      || (((Command *)token)->flags & CMD_HAS_EXEC_TRACES)) {
+    return NULL;
+  }
+  callout = (ffidl_callout *)info.objClientData;
+  if (callout->cif->sig != callback->cif->sig || callout->nbound != 0
+      || (callout->flags & (FFIDL_CALLOUT_RESULTVAR|FFIDL_CALLOUT_ASYNC))) {
+    return NULL;
+  }
+  return (void *)callout->fn;
+}
+
+/*
+ * Evaluate the command of a callback, in the global scope.  objv starts
+ * with the callback's own command prefix objects, so the command named by
+ * the first word stays resolved in its internal representation from one
+ * invocation to the next.
+ */
+static int callback_eval(ffidl_callback *callback, int objc, Tcl_Obj **objv)
+{
+  Tcl_Interp *interp = callback->interp;
+  int status = Tcl_EvalObjv(interp, objc, objv, TCL_EVAL_GLOBAL);
+  if (status == TCL_ERROR) {
+    Tcl_AppendObjToErrorInfo(interp, Tcl_ObjPrintf("\n    (ffidl callback \"%s\")", Tcl_GetString(objv[0])));
+  }
+  return status;
+}
+
+/*
+ * Deliver the buffered invocations of a -batch callback to its command,
+ * as a list of argument tuples or as a bytearray per argument.
+ */
+static void callback_batch_deliver(ffidl_callback *callback)
+{
+  ffidl_callback_batch *batch = callback->batch;
+  Tcl_Interp *interp = callback->interp;
+  ffidl_cif *cif = callback->cif;
+  Tcl_Obj **objv;
+  char *records;
+  int i, j, n, objc, status;
+
+  /* take the records, and let waiting callers go on */
+  Tcl_MutexLock(&batch->mutex);
+  n = batch->count;
+  records = n ? memcpy(Tcl_Alloc(n*batch->recsize), batch->records, n*batch->recsize) : NULL;
+  batch->count = 0;
+  Tcl_ConditionNotify(&batch->drained);
+  Tcl_MutexUnlock(&batch->mutex);
+  if (n == 0) {
+    return;
+  }
+  Tcl_Preserve((ClientData)callback);
+  Tcl_Preserve((ClientData)interp);
+  objv = (Tcl_Obj **)Tcl_Alloc((callback->cmdc+cif->argc+1)*sizeof(Tcl_Obj *));
+  memcpy(objv, callback->cmdv, callback->cmdc*sizeof(Tcl_Obj *));
+  objc = callback->cmdc;
+  if (batch->columns) {
+    for (i = 0; i < cif->argc; i += 1) {
+      size_t size = cif->atypes[i]->size;
+      Tcl_Obj *column = Tcl_NewObj();
+      unsigned char *bytes = Tcl_SetByteArrayLength(column, n*size);
+      for (j = 0; j < n; j += 1) {
+	memcpy(bytes+j*size, records+j*batch->recsize+batch->offsets[i], size);
+      }
+      objv[objc++] = column;
+    }
+  } else {
+    Tcl_Obj *tuples = Tcl_NewListObj(0, NULL);
+    for (j = 0; j < n; j += 1) {
+      Tcl_Obj *tuple = Tcl_NewListObj(0, NULL);
+      for (i = 0; i < cif->argc; i += 1) {
+	Tcl_ListObjAppendElement(NULL, tuple, callback_arg_obj(NULL, cif->atypes[i],
+							       records+j*batch->recsize+batch->offsets[i]));
+      }
+      Tcl_ListObjAppendElement(NULL, tuples, tuple);
+    }
+    objv[objc++] = tuples;
+  }
+  for (i = callback->cmdc; i < objc; i += 1) {
+    Tcl_IncrRefCount(objv[i]);
+  }
+  status = callback_eval(callback, objc, objv);
+  for (i = callback->cmdc; i < objc; i += 1) {
+    Tcl_DecrRefCount(objv[i]);
+  }
+  if (status == TCL_ERROR) {
+    Tcl_BackgroundError(interp);
+  }
+  Tcl_Free((void *)objv);
+  Tcl_Free(records);
+  Tcl_Release((ClientData)interp);
+  Tcl_Release((ClientData)callback);
+}
+
+/* deliver the invocations of a -batch callback from the event loop */
+static int callback_batch_event_proc(Tcl_Event *evPtr, int flags)
+{
+  ffidl_callback *callback = ((ffidl_callback_batch_event *)evPtr)->callback;
+  Tcl_MutexLock(&callback->batch->mutex);
+  callback->batch->scheduled = 0;
+  Tcl_MutexUnlock(&callback->batch->mutex);
+  callback_batch_deliver(callback);
+  Tcl_Release((ClientData)callback);
+  return 1;
+}
+
+#if USE_LIBFFI
+/* address of argument i of a libffi closure invocation */
+static void *callback_arg_pointer(ffidl_callback *callback, ffi_raw *args, int use_raw_api, int i)
+{
+#if USE_LIBFFI_RAW_API
+  if (use_raw_api) {
+    ptrdiff_t offset = callback->offsets[i] - callback->offsets[0];
+    if (FFIDL_RAW_STRUCT(callback->cif->atypes[i])) {
+      return *(void **)(((char *)args)+offset);
+    }
+    return (void *)(((char *)args)+offset);
+  }
+#endif
+  return args[i].ptr;
+}
+
+/*
+ * Buffer an invocation of a -batch callback, and make sure that a delivery
+ * is scheduled.  When the buffer is full, the interp's thread delivers it
+ * at once, other threads wait for it to be delivered.
+ */
+static void callback_batch_put(ffidl_callback *callback, ffi_raw *args)
+{
+  ffidl_callback_batch *batch = callback->batch;
+  ffidl_cif *cif = callback->cif;
+#if USE_LIBFFI_RAW_API
+  int use_raw_api = callback->use_raw_api;
+#else
+  int use_raw_api = 0;
+#endif
+  char *record;
+  int i;
+
+  Tcl_MutexLock(&batch->mutex);
+  while (batch->count == batch->size) {
+#if TCL_THREADS
+    if (Tcl_GetCurrentThread() != callback->owner) {
+      Tcl_ConditionWait(&batch->drained, &batch->mutex, NULL);
+      continue;
+    }
+#endif
+    Tcl_MutexUnlock(&batch->mutex);
+    callback_batch_deliver(callback);
+    Tcl_MutexLock(&batch->mutex);
+  }
+  record = batch->records+batch->count*batch->recsize;
+  for (i = 0; i < cif->argc; i += 1) {
+    memcpy(record+batch->offsets[i], callback_arg_pointer(callback, args, use_raw_api, i),
+	   cif->atypes[i]->size);
+  }
+  batch->count += 1;
+  if ( ! batch->scheduled) {
+    ffidl_callback_batch_event *event = (ffidl_callback_batch_event *)Tcl_Alloc(sizeof(ffidl_callback_batch_event));
+    event->header.proc = callback_batch_event_proc;
+    event->callback = callback;
+    batch->scheduled = 1;
+    Tcl_Preserve((ClientData)callback);
+#if TCL_THREADS
+    Tcl_ThreadQueueEvent(callback->owner, &event->header, TCL_QUEUE_TAIL);
+    Tcl_ThreadAlert(callback->owner);
+#else
+    Tcl_QueueEvent(&event->header, TCL_QUEUE_TAIL);
+#endif
+  }
+  Tcl_MutexUnlock(&batch->mutex);
+}
+
+/* call the tcl command of a callback with the arguments of a libffi closure */
+/* convert the result of a callback's command into its return value at ret */
+static int callback_return(Tcl_Interp *interp, ffidl_cif *cif, void *ret)
+{
+  Tcl_Obj *obj = Tcl_GetObjResult(interp);
+  ffidl_tclobj_value obj_value = {0};
+  char buff[128];
+  if (TCL_OK != value_convert_to_c(interp, cif->rtype, obj, &obj_value)) {
+    Tcl_AppendResult(interp, ", converting callback return value", NULL);
+    return TCL_ERROR;
+  }
+  /* convert return value */
+  switch (cif->rtype->typecode) {
+  case FFIDL_VOID:	break;
+  case FFIDL_INT:	FFIDL_RVALUE_POKE_WIDENED(INT, ret, obj_value.v_long); break;
+  case FFIDL_FLOAT:	FFIDL_RVALUE_POKE_WIDENED(FLOAT, ret, obj_value.v_double); break;
+  case FFIDL_DOUBLE:	FFIDL_RVALUE_POKE_WIDENED(DOUBLE, ret, obj_value.v_double); break;
+#if HAVE_LONG_DOUBLE
+  case FFIDL_LONGDOUBLE:FFIDL_RVALUE_POKE_WIDENED(LONGDOUBLE, ret, obj_value.v_long); break;
+#endif
+  case FFIDL_UINT8:	FFIDL_RVALUE_POKE_WIDENED(UINT8, ret, obj_value.v_long); break;
+  case FFIDL_SINT8:	FFIDL_RVALUE_POKE_WIDENED(SINT8, ret, obj_value.v_long); break;
+  case FFIDL_UINT16:	FFIDL_RVALUE_POKE_WIDENED(UINT16, ret, obj_value.v_long); break;
+  case FFIDL_SINT16:	FFIDL_RVALUE_POKE_WIDENED(SINT16, ret, obj_value.v_long); break;
+  case FFIDL_UINT32:	FFIDL_RVALUE_POKE_WIDENED(UINT32, ret, obj_value.v_long); break;
+  case FFIDL_SINT32:	FFIDL_RVALUE_POKE_WIDENED(SINT32, ret, obj_value.v_long); break;
+#if HAVE_INT64
+  case FFIDL_UINT64:	FFIDL_RVALUE_POKE_WIDENED(UINT64, ret, obj_value.v_wideint); break;
+  case FFIDL_SINT64:	FFIDL_RVALUE_POKE_WIDENED(SINT64, ret, obj_value.v_wideint); break;
+#endif
+  case FFIDL_STRUCT:
+    {
+      int len;
+      void *bytes = Tcl_GetByteArrayFromObj(obj, &len);
+      if (len != cif->rtype->size) {
+	Tcl_ResetResult(interp);
+	sprintf(buff, "byte array for callback struct return has %u bytes instead of %lu", len, (long)(cif->rtype->size));
+	Tcl_AppendResult(interp, buff, NULL);
+	return TCL_ERROR;
+      }
+      memcpy(ret, bytes, cif->rtype->size);
+      break;
+    }
+#if FFIDL_POINTER_IS_LONG
+  case FFIDL_PTR:	FFIDL_RVALUE_POKE_WIDENED(PTR, ret, obj_value.v_long); break;
+#else
+  case FFIDL_PTR:	FFIDL_RVALUE_POKE_WIDENED(PTR, ret, obj_value.v_wideint); break;
+#endif
+  case FFIDL_PTR_OBJ:	FFIDL_RVALUE_POKE_WIDENED(PTR, ret, obj); break;
+  default:
+    Tcl_ResetResult(interp);
+    sprintf(buff, "unimplemented type for callback return: %d", cif->rtype->typecode);
+    Tcl_AppendResult(interp, buff, NULL);
+    return TCL_ERROR;
+  }
+  return TCL_OK;
+}
+
+static void callback_invoke(ffidl_callback *callback, void *ret, ffi_raw *args, int use_raw_api)
+{
+  Tcl_Interp *interp = callback->interp;
+  ffidl_cif *cif = callback->cif;
+  Tcl_Obj *stackv[FFIDL_CALLBACK_STACK_OBJS], **cmdv, **objv;
+  char buff[128];
+  int i, status;
+  /* test for valid scope */
+  if (interp == NULL) {
+    Tcl_Panic("callback called out of scope!\n");
+  }
+  /* keep the callback and interp alive until the invocation is done */
+  Tcl_Preserve((ClientData)callback);
+  Tcl_Preserve((ClientData)interp);
+  /* initialize argument list */
+  cmdv = callback_objv_get(callback, stackv);
+  objv = cmdv+callback->cmdc;
+  /* fetch and convert argument values */
+  for (i = 0; i < cif->argc; i += 1) {
+    void *argp = callback_arg_pointer(callback, args, use_raw_api, i);
+    if (cif->atypes[i]->typecode == FFIDL_PTR_OBJ) {
+      objv[i] = *(Tcl_Obj **)argp;
+    } else {
+      Tcl_Obj *argobj = callback_arg_take(callback, i);
+      objv[i] = callback_arg_obj(argobj, cif->atypes[i], argp);
+      if (objv[i] == NULL) {
+	sprintf(buff, "unimplemented type for callback argument: %d", cif->atypes[i]->typecode);
+	Tcl_AppendResult(interp, buff, NULL);
+	while (i-- > 0) {
+	  Tcl_DecrRefCount(objv[i]);
+	}
+	callback_objv_put(callback, cmdv, stackv);
+	goto escape;
+      }
+      if (argobj != NULL) {
+	continue;
+      }
+    }
+    Tcl_IncrRefCount(objv[i]);
+  }
+  /* call */
+  status = callback_eval(callback, callback->cmdc+cif->argc, cmdv);
+  /* clean up arguments */
+  callback_args_release(callback, objv);
+  callback_objv_put(callback, cmdv, stackv);
+  if (status == TCL_ERROR) {
+    goto escape;
+  }
+  /* fetch and convert return value */
+  if (callback_return(interp, cif, ret) == TCL_ERROR) {
+    goto escape;
+  }
+  /* done */
+  Tcl_Release((ClientData)interp);
+  Tcl_Release((ClientData)callback);
+  return;
+escape:
+  Tcl_BackgroundError(interp);
+  if (ret != NULL) {
+    memset(ret, 0, cif->rtype->size);
+  }
+  Tcl_Release((ClientData)interp);
+  Tcl_Release((ClientData)callback);
+}
+
+#if TCL_THREADS
+/* signal the caller of a synchronous callback event that it is done */
+static void callback_event_done(ffidl_callback_event *event)
+{
+  if (event->done != NULL) {
+    Tcl_MutexLock(&callback_event_mutex);
+    *event->done = 1;
+    Tcl_ConditionNotify(event->cond);
+    Tcl_MutexUnlock(&callback_event_mutex);
+  }
+}
+
+/* take an event off callback_event_pending, must hold callback_event_mutex */
+static void callback_event_unlink(ffidl_callback_event *event)
+{
+  ffidl_callback_event **eventp = &callback_event_pending;
+  while (*eventp != NULL && *eventp != event) {
+    eventp = &(*eventp)->next;
+  }
+  if (*eventp != NULL) {
+    *eventp = event->next;
+  }
+}
+
+/* service an invocation dropped by callback_marshal_close() */
+static int callback_event_skip(Tcl_Event *evPtr, int flags)
+{
+  return 1;
+}
+
+/* run a marshalled callback invocation on the interp's thread */
+static int callback_event_proc(Tcl_Event *evPtr, int flags)
+{
+  ffidl_callback_event *event = (ffidl_callback_event *)evPtr;
+  Tcl_MutexLock(&callback_event_mutex);
+  callback_event_unlink(event);
+  Tcl_MutexUnlock(&callback_event_mutex);
+  callback_invoke(event->callback, event->ret, (ffi_raw *)event->args, 0);
+  Tcl_Release((ClientData)event->callback);
+  callback_event_done(event);
+  return 1;
+}
+
+/*
+ * Size of the string pointed to by a pointer-utf8 or pointer-utf16 callback
+ * argument, including its terminator, or 0.
+ */
+static size_t callback_arg_string_size(ffidl_type *type, void *argp)
+{
+  size_t n = 0;
+  if (type->typecode == FFIDL_PTR_UTF8 && *(char **)argp != NULL) {
+    return strlen(*(char **)argp)+1;
+  }
+  if (type->typecode == FFIDL_PTR_UTF16 && *(Tcl_UniChar **)argp != NULL) {
+    Tcl_UniChar *chars = *(Tcl_UniChar **)argp;
+    while (chars[n] != 0) {
+      n += 1;
+    }
+    return (n+1)*sizeof(Tcl_UniChar);
+  }
+  return 0;
+}
+
+/*
+ * Make an event for an invocation of a callback on another thread, which
+ * the caller waits for with callback_event_wait(), unless the callback
+ * returns void: then the event holds a copy of the argument values, and
+ * nobody waits for it.
+ */
+static ffidl_callback_event *callback_event_new(ffidl_callback *callback, void *ret, ffi_raw *args,
+						int *done, Tcl_Condition *cond)
+{
+  ffidl_cif *cif = callback->cif;
+  int i, async = cif->rtype->typecode == FFIDL_VOID;
+#if USE_LIBFFI_RAW_API
+  int use_raw_api = callback->use_raw_api;
+#else
+  int use_raw_api = 0;
+#endif
+  size_t size = sizeof(ffidl_callback_event)+cif->argc*sizeof(void *);
+  size_t offset, strings = 0;
+  ffidl_callback_event *event;
+  char *values;
+
+  if (async) {
+    size = (size+sizeof(ffidl_value)-1)/sizeof(ffidl_value)*sizeof(ffidl_value);
+    for (i = 0, offset = 0; i < cif->argc; i += 1) {
+      ffidl_type *type = cif->atypes[i];
+      offset = (offset+type->alignment-1)/type->alignment*type->alignment+type->size;
+    }
+    /* the strings go after the values, as the caller's copies may be gone
+       by the time the event runs */
+    offset = strings = (offset+sizeof(void *)-1)/sizeof(void *)*sizeof(void *);
+    for (i = 0; i < cif->argc; i += 1) {
+      void *argp = callback_arg_pointer(callback, args, use_raw_api, i);
+      offset += (callback_arg_string_size(cif->atypes[i], argp)+sizeof(void *)-1)/sizeof(void *)*sizeof(void *);
+    }
+  } else {
+    offset = 0;
+  }
+  event = (ffidl_callback_event *)Tcl_Alloc(size+offset);
+  event->callback = callback;
+  event->next = NULL;
+  event->args = (void **)(event+1);
+  values = (char *)event+size;
+  for (i = 0, offset = 0; i < cif->argc; i += 1) {
+    void *argp = callback_arg_pointer(callback, args, use_raw_api, i);
+    if (async) {
+      ffidl_type *type = cif->atypes[i];
+      size_t len = callback_arg_string_size(type, argp);
+      offset = (offset+type->alignment-1)/type->alignment*type->alignment;
+      event->args[i] = memcpy(values+offset, argp, type->size);
+      offset += type->size;
+      if (len != 0) {
+	*(void **)event->args[i] = memcpy(values+strings, *(void **)argp, len);
+	strings += (len+sizeof(void *)-1)/sizeof(void *)*sizeof(void *);
+      }
+    } else {
+      event->args[i] = argp;
+    }
+  }
+  event->ret = async ? NULL : ret;
+  event->done = async ? NULL : done;
+  event->cond = cond;
+  return event;
+}
+
+/* wait for the event of a callback not returning void to be done */
+static void callback_event_wait(ffidl_callback *callback, int *done, Tcl_Condition *cond)
+{
+  if (callback->cif->rtype->typecode != FFIDL_VOID) {
+    Tcl_MutexLock(&callback_event_mutex);
+    while ( ! *done) {
+      Tcl_ConditionWait(cond, &callback_event_mutex, NULL);
+    }
+    Tcl_MutexUnlock(&callback_event_mutex);
+  }
+  Tcl_ConditionFinalize(cond);
+}
+
+/*
+ * Queue an invocation of a callback to the thread of its interp.  Once the
+ * interp is deleted or its thread exits, a synchronous invocation returns
+ * zero instead.
+ */
+static void callback_marshal(ffidl_callback *callback, void *ret, ffi_raw *args)
+{
+  int done = 0;
+  Tcl_Condition cond = NULL;
+  ffidl_callback_event *event = callback_event_new(callback, ret, args, &done, &cond);
+  event->header.proc = callback_event_proc;
+  Tcl_MutexLock(&callback_event_mutex);
+  if (callback->cif->client->marshal_closed) {
+    Tcl_MutexUnlock(&callback_event_mutex);
+    Tcl_Free((void *)event);
+    if (ret != NULL) {
+      memset(ret, 0, callback->cif->rtype->size);
+    }
+    Tcl_ConditionFinalize(&cond);
+    return;
+  }
+  event->next = callback_event_pending;
+  callback_event_pending = event;
+  Tcl_Preserve((ClientData)callback);
+  Tcl_ThreadQueueEvent(callback->owner, &event->header, TCL_QUEUE_TAIL);
+  Tcl_ThreadAlert(callback->owner);
+  Tcl_MutexUnlock(&callback_event_mutex);
+  callback_event_wait(callback, &done, &cond);
+}
+
+/*
+ * Stop marshalling callbacks to the interp of a client, when it is deleted
+ * or its thread exits, and drop the invocations still queued to it.  The
+ * synchronous ones return zero to their callers.  Runs on the interp's
+ * thread, so none of them can be running.
+ */
+static void callback_marshal_close(ffidl_client *client)
+{
+  ffidl_callback_event **eventp, *dropped = NULL;
+  Tcl_MutexLock(&callback_event_mutex);
+  client->marshal_closed = 1;
+  eventp = &callback_event_pending;
+  while (*eventp != NULL) {
+    ffidl_callback_event *event = *eventp;
+    if (event->callback->cif->client != client) {
+      eventp = &event->next;
+      continue;
+    }
+    *eventp = event->next;
+    if (event->done != NULL) {
+      memset(event->ret, 0, event->callback->cif->rtype->size);
+      *event->done = 1;
+      Tcl_ConditionNotify(event->cond);
+    }
+    /* the event may still be serviced, but its caller may be gone */
+    event->header.proc = callback_event_skip;
+    event->ret = NULL;
+    event->done = NULL;
+    event->cond = NULL;
+    event->next = dropped;
+    dropped = event;
+  }
+  Tcl_MutexUnlock(&callback_event_mutex);
+  /* let the callbacks go with the client, not with the events */
+  for (; dropped != NULL; dropped = dropped->next) {
+    Tcl_Release((ClientData)dropped->callback);
+    dropped->callback = NULL;
+  }
+}
+
+/* the thread of a client's interp exits */
+static void callback_marshal_thread_exit(ClientData clientData)
+{
+  callback_marshal_close((ffidl_client *)clientData);
+}
+
+/* run a callback invocation in the interp of a pool worker */
+static void callback_pool_invoke(Tcl_Interp *interp, int cmdc, Tcl_Obj **objv, ffidl_callback_event *event)
+{
+  ffidl_cif *cif = event->callback->cif;
+  int i, n, status;
+  for (n = 0; n < cif->argc; n += 1) {
+    objv[cmdc+n] = callback_arg_obj(NULL, cif->atypes[n], event->args[n]);
+    if (objv[cmdc+n] == NULL) {
+      Tcl_SetObjResult(interp, Tcl_ObjPrintf("unimplemented type for callback argument: %d",
+					     cif->atypes[n]->typecode));
+      break;
+    }
+    Tcl_IncrRefCount(objv[cmdc+n]);
+  }
+  status = n < cif->argc ? TCL_ERROR : Tcl_EvalObjv(interp, cmdc+n, objv, TCL_EVAL_GLOBAL);
+  for (i = 0; i < n; i += 1) {
+    Tcl_DecrRefCount(objv[cmdc+i]);
+  }
+  if (status == TCL_ERROR || callback_return(interp, cif, event->ret) == TCL_ERROR) {
+    /* workers have no event loop, run the background error handler now */
+    Tcl_BackgroundError(interp);
+    while (Tcl_DoOneEvent(TCL_IDLE_EVENTS|TCL_DONT_WAIT))
+      ;
+    if (event->ret != NULL) {
+      memset(event->ret, 0, cif->rtype->size);
+    }
+  }
+}
+
+/* a pool worker thread: make its interp, then run queued invocations */
+static Tcl_ThreadCreateType callback_pool_worker(ClientData clientData)
+{
+  ffidl_callback_pool *pool = (ffidl_callback_pool *)clientData;
+  Tcl_Interp *interp = Tcl_CreateInterp();
+  Tcl_Obj *prefix = Tcl_NewStringObj(pool->cmdprefix, -1), **cmdv, **objv = NULL;
+  ffidl_callback_event *event;
+  int cmdc, status;
+
+  Tcl_IncrRefCount(prefix);
+  status = Tcl_Init(interp);
+  if (status == TCL_OK) {
+    status = Tcl_EvalEx(interp, pool->init, -1, TCL_EVAL_GLOBAL);
+  }
+  if (status == TCL_OK) {
+    status = Tcl_ListObjGetElements(interp, prefix, &cmdc, &cmdv);
+  }
+  if (status == TCL_OK) {
+    objv = (Tcl_Obj **)Tcl_Alloc((cmdc+pool->callback->cif->argc)*sizeof(Tcl_Obj *));
+    memcpy(objv, cmdv, cmdc*sizeof(Tcl_Obj *));
+  }
+  Tcl_MutexLock(&pool->mutex);
+  if (status != TCL_OK && pool->error == NULL) {
+    const char *error = Tcl_GetStringResult(interp);
+    pool->error = strcpy(Tcl_Alloc(strlen(error)+1), error);
+  }
+  pool->nready += 1;
+  Tcl_ConditionNotify(&pool->ready);
+  while (status == TCL_OK) {
+    while (pool->head == NULL && !pool->exiting) {
+      Tcl_ConditionWait(&pool->work, &pool->mutex, NULL);
+    }
+    if ((event = pool->head) == NULL) {
+      break;
+    }
+    if ((pool->head = event->next) == NULL) {
+      pool->tail = NULL;
+    }
+    Tcl_MutexUnlock(&pool->mutex);
+    callback_pool_invoke(interp, cmdc, objv, event);
+    callback_event_done(event);
+    Tcl_Free((void *)event);
+    Tcl_MutexLock(&pool->mutex);
+  }
+  Tcl_MutexUnlock(&pool->mutex);
+  if (objv != NULL) {
+    Tcl_Free((void *)objv);
+  }
+  Tcl_DecrRefCount(prefix);
+  Tcl_DeleteInterp(interp);
+  Tcl_FinalizeThread();
+  TCL_THREAD_CREATE_RETURN;
+}
+
+/* stop the workers of a pool, once they have run the queued invocations */
+static void callback_pool_delete(ffidl_callback_pool *pool)
+{
+  int i, result;
+  Tcl_MutexLock(&pool->mutex);
+  pool->exiting = 1;
+  Tcl_ConditionNotify(&pool->work);
+  Tcl_MutexUnlock(&pool->mutex);
+  for (i = 0; i < pool->size; i += 1) {
+    Tcl_JoinThread(pool->threads[i], &result);
+  }
+  Tcl_ConditionFinalize(&pool->work);
+  Tcl_ConditionFinalize(&pool->ready);
+  Tcl_MutexFinalize(&pool->mutex);
+  if (pool->error != NULL) {
+    Tcl_Free(pool->error);
+  }
+  Tcl_Free((void *)pool);
+}
+
+/*
+ * Start size workers for a callback, each evaluating the init script in
+ * a new interp.
+ */
+static ffidl_callback_pool *callback_pool_new(Tcl_Interp *interp, ffidl_callback *callback, int size, Tcl_Obj *init)
+{
+  Tcl_Obj *prefix = Tcl_NewListObj(callback->cmdc, callback->cmdv);
+  ffidl_callback_pool *pool;
+  const char *cmdprefix, *script = init ? Tcl_GetString(init) : "";
+  int started;
+
+  Tcl_IncrRefCount(prefix);
+  cmdprefix = Tcl_GetString(prefix);
+  pool = (ffidl_callback_pool *)Tcl_Alloc(sizeof(ffidl_callback_pool)
+					  +size*sizeof(Tcl_ThreadId)
+					  +strlen(cmdprefix)+1+strlen(script)+1);
+  memset(pool, 0, sizeof(ffidl_callback_pool));
+  pool->callback = callback;
+  pool->threads = (Tcl_ThreadId *)(pool+1);
+  pool->cmdprefix = strcpy((char *)(pool->threads+size), cmdprefix);
+  pool->init = strcpy(pool->cmdprefix+strlen(cmdprefix)+1, script);
+  Tcl_DecrRefCount(prefix);
+  for (started = 0; started < size; started += 1) {
+    if (Tcl_CreateThread(&pool->threads[started], callback_pool_worker, (ClientData)pool,
+			 TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK) {
+      break;
+    }
+  }
+  pool->size = started;
+  Tcl_MutexLock(&pool->mutex);
+  while (pool->nready < started) {
+    Tcl_ConditionWait(&pool->ready, &pool->mutex, NULL);
+  }
+  Tcl_MutexUnlock(&pool->mutex);
+  if (started < size || pool->error != NULL) {
+    Tcl_AppendResult(interp, "can't start callback pool: ",
+		     pool->error ? pool->error : "can't create thread", NULL);
+    callback_pool_delete(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+/* Queue an invocation of a callback to its worker pool. */
+static void callback_pool_call(ffidl_callback *callback, void *ret, ffi_raw *args)
+{
+  ffidl_callback_pool *pool = callback->pool;
+  int done = 0;
+  Tcl_Condition cond = NULL;
+  ffidl_callback_event *event = callback_event_new(callback, ret, args, &done, &cond);
+  Tcl_MutexLock(&pool->mutex);
+  if (pool->tail != NULL) {
+    pool->tail->next = event;
+  } else {
+    pool->head = event;
+  }
+  pool->tail = event;
+  Tcl_ConditionNotify(&pool->work);
+  Tcl_MutexUnlock(&pool->mutex);
+  callback_event_wait(callback, &done, &cond);
+}
+#endif
+
+/* call a tcl proc from a libffi closure */
+static void callback_callback(ffi_cif *fficif, void *ret, ffi_raw *args, void *user_data)
+{
+  ffidl_callback *callback = (ffidl_callback *)user_data;
+  if (callback->batch != NULL) {
+    callback_batch_put(callback, args);
+    return;
+  }
+#if TCL_THREADS
+  if (Tcl_GetCurrentThread() != callback->owner) {
+    if (callback->pool != NULL) {
+      callback_pool_call(callback, ret, args);
+      return;
+    }
+    if (callback->flags & FFIDL_CALLBACK_MARSHAL) {
+      callback_marshal(callback, ret, args);
+      return;
+    }
+  }
+#endif
+#if USE_LIBFFI_RAW_API
+  callback_invoke(callback, ret, args, callback->use_raw_api);
+#else
+  callback_invoke(callback, ret, args, 0);
+#endif
+}
+
+/*
+ * Call the -userdata callback whose handle is the userdata argument of a
+ * trampoline invocation.  Handles of freed callbacks return zero.
+ */
+static void trampoline_callback(ffi_cif *fficif, void *ret, ffi_raw *args, void *user_data)
+{
+  ffidl_trampoline *trampoline = (ffidl_trampoline *)user_data;
+  ffidl_client *client = trampoline->client;
+  ffidl_callback *callback;
+  void *argp;
+  int locked = 0;
+#if USE_LIBFFI_RAW_API
+  if (trampoline->use_raw_api) {
+    argp = (void *)(((char *)args)+trampoline->offsets[trampoline->index]-trampoline->offsets[0]);
+  } else
+#endif
+  {
+    argp = args[trampoline->index].ptr;
+  }
+#if TCL_THREADS
+  /* the slots only change in the thread of the client */
+  locked = client->userdata != NULL && Tcl_GetCurrentThread() != client->userdata_owner;
+#endif
+  callback = userdata_lookup(client, *(void **)argp, locked);
+  if (callback == NULL) {
+    ffidl_type *rtype = trampoline->cif->rtype;
+    if (rtype->typecode != FFIDL_VOID) {
+      memset(ret, 0, rtype->size > sizeof(ffi_arg) ? rtype->size : sizeof(ffi_arg));
+    }
+    return;
+  }
+  callback_callback(fficif, ret, args, (void *)callback);
+}
+
+/*
+ * Return the trampoline of the -userdata callbacks of a cif with userdata
+ * argument index, creating it for the first one.
+ */
+static ffidl_trampoline *trampoline_get(Tcl_Interp *interp, ffidl_client *client, ffidl_cif *cif, int index)
+{
+  ffidl_trampoline *trampoline;
+  ffidl_closure *closure;
+  Tcl_DString key;
+  char buff[32];
+  Tcl_DStringInit(&key);
+  sprintf(buff, "%d ", index);
+  Tcl_DStringAppend(&key, buff, -1);
+  Tcl_DStringAppend(&key, Tcl_GetHashKey(&client->cifs, cif_find(client, cif)), -1);
+  trampoline = entry_lookup(&client->trampolines, Tcl_DStringValue(&key));
+  if (trampoline != NULL) {
+    Tcl_DStringFree(&key);
+    return trampoline;
+  }
+  trampoline = (ffidl_trampoline *)Tcl_Alloc(sizeof(ffidl_trampoline)
+#if USE_LIBFFI_RAW_API
+					     +cif->argc*sizeof(ptrdiff_t)
+#endif
+  );
+  trampoline->client = client;
+  trampoline->cif = cif;
+  trampoline->index = index;
+  closure = &trampoline->closure;
+  if (closure_alloc(cif, closure) != TCL_OK) {
+    Tcl_AppendResult(interp, "libffi can't allocate closure for: ", Tcl_DStringValue(&key), NULL);
+    goto error;
+  }
+#if USE_LIBFFI_RAW_API
+  trampoline->offsets = (ptrdiff_t *)(trampoline+1);
+  trampoline->use_raw_api = cif_raw_supported(cif);
+  if (trampoline->use_raw_api &&
+      cif_raw_prep_offsets(cif, trampoline->offsets) == TCL_OK &&
+      ffi_prep_raw_closure_loc((ffi_raw_closure *)closure->lib_closure,
+			       &cif->lib_cif, trampoline_callback,
+			       (void *)trampoline, closure->executable) == FFI_OK) {
+    /* Prepared successfully, continue. */
+  }
+  else
+#endif
+  {
+#if USE_LIBFFI_RAW_API
+    trampoline->use_raw_api = 0;
+#endif
+    if (ffi_prep_closure_loc(closure->lib_closure, &cif->lib_cif,
+			     (void (*)(ffi_cif*,void*,void**,void*))trampoline_callback,
+			     (void *)trampoline, closure->executable) != FFI_OK) {
+      Tcl_AppendResult(interp, "libffi can't make closure for: ", Tcl_DStringValue(&key), NULL);
+      closure_release(cif, closure);
+      goto error;
+    }
+  }
+  cif_inc_ref(cif);
+  entry_define(&client->trampolines, Tcl_DStringValue(&key), (void *)trampoline);
+  Tcl_DStringFree(&key);
+  return trampoline;
+error:
+  Tcl_DStringFree(&key);
+  Tcl_Free((void *)trampoline);
+  return NULL;
+}
+#elif USE_LIBFFCALL
+static void callback_callback(void *user_data, va_alist alist)
+{
+  ffidl_callback *callback = (ffidl_callback *)user_data;
+  Tcl_Interp *interp = callback->interp;
+  ffidl_cif *cif = callback->cif;
+  Tcl_Obj *stackv[FFIDL_CALLBACK_STACK_OBJS], **cmdv, **objv, *obj;
+  char buff[128];
+  int i, status;
+  ffidl_tclobj_value obj_value = {0};
+  /* test for valid scope */
+  if (interp == NULL) {
+    Tcl_Panic("callback called out of scope!\n");
+  }
+  /* keep the callback and interp alive until the invocation is done */
+  Tcl_Preserve((ClientData)callback);
+  Tcl_Preserve((ClientData)interp);
+  /* initialize argument list */
+  cmdv = callback_objv_get(callback, stackv);
+  objv = cmdv+callback->cmdc;
+  /* start */
+  switch (cif->rtype->typecode) {
+  case FFIDL_VOID:	va_start_void(alist); break;
+  case FFIDL_INT:	va_start_int(alist); break;
+  case FFIDL_FLOAT:	va_start_float(alist); break;
+  case FFIDL_DOUBLE:	va_start_double(alist); break;
+  case FFIDL_UINT8:	va_start_uint8(alist); break;
+  case FFIDL_SINT8:	va_start_sint8(alist); break;
+  case FFIDL_UINT16:	va_start_uint16(alist); break;
+  case FFIDL_SINT16:	va_start_sint16(alist); break;
+  case FFIDL_UINT32:	va_start_uint32(alist); break;
+  case FFIDL_SINT32:	va_start_sint32(alist); break;
+#if HAVE_INT64
+  case FFIDL_UINT64:	va_start_uint64(alist); break;
+  case FFIDL_SINT64:	va_start_sint64(alist); break;
+#endif
+  case FFIDL_STRUCT:	_va_start_struct(alist,cif->rtype->size,cif->rtype->alignment,cif->rtype->splittable); break;
+  case FFIDL_PTR:	va_start_ptr(alist,void *); break;
+  case FFIDL_PTR_OBJ:	va_start_ptr(alist,Tcl_Obj *); break;
+  default:
+    Tcl_ResetResult(interp);
+    sprintf(buff, "unimplemented type for callback return: %d", cif->rtype->typecode);
+    Tcl_AppendResult(interp, buff, NULL);
+    goto escape;
+  }
+  /* fetch and convert argument values */
+  for (i = 0; i < cif->argc; i++) {
+    ffidl_value value;
+    void *argp = &value;
+    Tcl_Obj *argobj;
+    switch (cif->atypes[i]->typecode) {
+    case FFIDL_INT:	value.v_int = va_arg_int(alist); break;
+    case FFIDL_FLOAT:	value.v_float = va_arg_float(alist); break;
+    case FFIDL_DOUBLE:	value.v_double = va_arg_double(alist); break;
+    case FFIDL_UINT8:	value.v_uint8 = va_arg_uint8(alist); break;
+    case FFIDL_SINT8:	value.v_sint8 = va_arg_sint8(alist); break;
+    case FFIDL_UINT16:	value.v_uint16 = va_arg_uint16(alist); break;
+    case FFIDL_SINT16:	value.v_sint16 = va_arg_sint16(alist); break;
+    case FFIDL_UINT32:	value.v_uint32 = va_arg_uint32(alist); break;
+    case FFIDL_SINT32:	value.v_sint32 = va_arg_sint32(alist); break;
+#if HAVE_INT64
+    case FFIDL_UINT64:	value.v_uint64 = va_arg_uint64(alist); break;
+    case FFIDL_SINT64:	value.v_sint64 = va_arg_sint64(alist); break;
+#endif
+    case FFIDL_STRUCT:
+      argp = _va_arg_struct(alist, cif->atypes[i]->size, cif->atypes[i]->alignment);
+      break;
+    case FFIDL_PTR:	value.v_pointer = va_arg_ptr(alist,void *); break;
+    case FFIDL_PTR_OBJ:
+      objv[i] = va_arg_ptr(alist,Tcl_Obj *);
+      Tcl_IncrRefCount(objv[i]);
+      continue;
+    case FFIDL_PTR_UTF8:	value.v_pointer = va_arg_ptr(alist,char *); break;
+    case FFIDL_PTR_UTF16:	value.v_pointer = va_arg_ptr(alist,Tcl_UniChar *); break;
+    default:
+      sprintf(buff, "unimplemented type for callback argument: %d", cif->atypes[i]->typecode);
+      Tcl_AppendResult(interp, buff, NULL);
+      while (i-- > 0) {
+	Tcl_DecrRefCount(objv[i]);
+      }
+      callback_objv_put(callback, cmdv, stackv);
+      goto escape;
+    }
+    argobj = callback_arg_take(callback, i);
+    objv[i] = callback_arg_obj(argobj, cif->atypes[i], argp);
+    if (argobj != NULL) {
+      continue;
+    }
+    Tcl_IncrRefCount(objv[i]);
+  }
+  /* call */
+  status = callback_eval(callback, callback->cmdc+cif->argc, cmdv);
+  /* clean up arguments */
+  callback_args_release(callback, objv);
+  callback_objv_put(callback, cmdv, stackv);
+  if (status == TCL_ERROR) {
+    goto escape;
+  }
+  /* fetch return value */
+  obj = Tcl_GetObjResult(interp);
+  if (TCL_OK != value_convert_to_c(interp, cif->rtype, obj, &obj_value)) {
+    Tcl_AppendResult(interp, ", converting callback return value", NULL);
+    goto escape;
+  }
+  
+  /* convert return value */
+  switch (cif->rtype->typecode) {
+  case FFIDL_VOID:	va_return_void(alist); break;
+  case FFIDL_INT:	va_return_int(alist, obj_value.v_long); break;
+  case FFIDL_FLOAT:	va_return_float(alist, obj_value.v_double); break;
+  case FFIDL_DOUBLE:	va_return_double(alist, obj_value.v_double); break;
+  case FFIDL_UINT8:	va_return_uint8(alist, obj_value.v_long); break;
+  case FFIDL_SINT8:	va_return_sint8(alist, obj_value.v_long); break;
+  case FFIDL_UINT16:	va_return_uint16(alist, obj_value.v_long); break;
+  case FFIDL_SINT16:	va_return_sint16(alist, obj_value.v_long); break;
+  case FFIDL_UINT32:	va_return_uint32(alist, obj_value.v_long); break;
+  case FFIDL_SINT32:	va_return_sint32(alist, obj_value.v_long); break;
+#if HAVE_INT64
+  case FFIDL_UINT64:	va_return_uint64(alist, obj_value.v_wideint); break;
+  case FFIDL_SINT64:	va_return_sint64(alist, obj_value.v_wideint); break;
+#endif
+  case FFIDL_STRUCT:	
+    {
+      int len;
+      void *bytes = Tcl_GetByteArrayFromObj(obj, &len);
+      if (len != cif->rtype->size) {
+	Tcl_ResetResult(interp);
+	sprintf(buff, "byte array for callback struct return has %u bytes instead of %lu", len, (long)(cif->rtype->size));
+	Tcl_AppendResult(interp, buff, NULL);
+	goto escape;
+      }
+      _va_return_struct(alist, cif->rtype->size, cif->rtype->alignment, bytes);
+      break;
+    }
+  case FFIDL_PTR:	va_return_ptr(alist, void *, obj_value.v_long); break;
+  case FFIDL_PTR_OBJ:	va_return_ptr(alist, Tcl_Obj *, obj); break;
+  default:
+    Tcl_ResetResult(interp);
+    sprintf(buff, "unimplemented type for callback return: %d", cif->rtype->typecode);
+    Tcl_AppendResult(interp, buff, NULL);
+    goto escape;
+  }
+  /* done */
+  Tcl_Release((ClientData)interp);
+  Tcl_Release((ClientData)callback);
+  return;
+escape:
+  Tcl_BackgroundError(interp);
+  Tcl_Release((ClientData)interp);
+  Tcl_Release((ClientData)callback);
+}
+#endif
+#endif
+/*
+ * Client management.
+ */
+/* unload all libs, reporting errors into interp, if any */
+static void client_unload(ffidl_client *client, Tcl_Interp *interp)
+{
+  Tcl_HashSearch search;
+  Tcl_HashEntry *entry;
+
+  for (entry = Tcl_FirstHashEntry(&client->libs, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
+    char *libraryName = Tcl_GetHashKey(&client->libs, entry);
+    ffidl_lib *libentry = Tcl_GetHashValue(entry);
+    ffidlclose(interp, libraryName, libentry->loadHandle, libentry->unloadProc);
+    Tcl_Free((void *)libentry);
+    Tcl_DeleteHashEntry(entry);
+  }
+}
+/* free a client, once none of its -async calls is running any more */
+static void client_destroy(char *blockPtr)
+{
+  ffidl_client *client = (ffidl_client *)blockPtr;
+  Tcl_HashSearch search;
+  Tcl_HashEntry *entry;
+
+  /* there should be no callouts left */
+  for (entry = Tcl_FirstHashEntry(&client->callouts, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
+    char *name = Tcl_GetHashKey(&client->callouts, entry);
+    /* Couldn't do this while traversing the hash table anyway */
+    /* Tcl_DeleteCommand(interp, name); */
+    fprintf(stderr, "error - dangling callout in client_delete: %s\n", name);
+  }
+
+#if USE_CALLBACKS
+  /* free all callbacks */
+  for (entry = Tcl_FirstHashEntry(&client->callbacks, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
+    ffidl_callback *callback = Tcl_GetHashValue(entry);
+    callback_free(callback);
+  }
+  /* and the anonymous ones, leaving callouts still calling them a NULL callback */
+  for (entry = Tcl_FirstHashEntry(&client->anonymous, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
+    ffidl_callback_handle *handle = Tcl_GetHashValue(entry);
+    callback_free(handle->callback);
+    handle->callback = NULL;
+    callback_handle_release(handle);
+  }
+#endif
+
+#if USE_CALLBACKS && USE_LIBFFI
+  /* free the trampolines */
+  for (entry = Tcl_FirstHashEntry(&client->trampolines, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
+    ffidl_trampoline *trampoline = Tcl_GetHashValue(entry);
+    closure_release(trampoline->cif, &trampoline->closure);
+    cif_dec_ref(trampoline->cif);
+    Tcl_Free((void *)trampoline);
+  }
+  /* free the idle closures */
+  for (entry = Tcl_FirstHashEntry(&client->closures, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
+    ffidl_closure_pool *pool = Tcl_GetHashValue(entry);
+    while (pool->count > 0) {
+      ffi_closure_free(pool->idle[--pool->count].lib_closure);
+    }
+    Tcl_Free((void *)pool);
+  }
+#endif
+
+  /* there should be no cifs left */
+  for (entry = Tcl_FirstHashEntry(&client->cifs, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
+    char *signature = Tcl_GetHashKey(&client->cifs, entry);
+    fprintf(stderr, "error - dangling ffidl_cif in client_delete: %s\n",signature);
+  }
+
+  /* free all allocated typedefs */
+  for (entry = Tcl_FirstHashEntry(&client->types, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
+    ffidl_type *type = Tcl_GetHashValue(entry);
+    if ((type->class & FFIDL_STATIC_TYPE) == 0) {
+      type_dec_ref(type);
+    }
+  }
+
+  /* unload the libs client_delete left to the last -async call */
+  client_unload(client, NULL);
+
+  /* free hashtables */
+  Tcl_DeleteHashTable(&client->callouts);
+#if USE_CALLBACKS
+  Tcl_DeleteHashTable(&client->callbacks);
+  Tcl_DeleteHashTable(&client->anonymous);
+  Tcl_DeleteHashTable(&client->closures);
+  Tcl_DeleteHashTable(&client->trampolines);
+  if (client->userdata != NULL) {
+    Tcl_Free((char *)client->userdata);
+  }
+  Tcl_MutexFinalize(&client->userdata_mutex);
+#endif
+  Tcl_DeleteHashTable(&client->cifs);
+  Tcl_DeleteHashTable(&client->types);
+  Tcl_DeleteHashTable(&client->libs);
+
+  /* free client structure */
+  Tcl_Free((void *)client);
+}
+/* client interp deletion callback for cleanup */
+static void client_delete(ClientData clientData, Tcl_Interp *interp)
+{
+#if USE_CALLBACKS && USE_LIBFFI && TCL_THREADS
+  Tcl_DeleteThreadExitHandler(callback_marshal_thread_exit, clientData);
+  callback_marshal_close((ffidl_client *)clientData);
+#endif
+  /* unload now, while interp is valid, unless an -async call may still be
+   * running library code: then client_destroy unloads after the last one */
+  if (((ffidl_client *)clientData)->async_pending == 0) {
+    client_unload((ffidl_client *)clientData, interp);
+  }
+  Tcl_EventuallyFree(clientData, client_destroy);
+}
+/* set up the base types and the process wide registry, once */
+static void registry_init(void)
+{
+  Tcl_MutexLock(&registry_mutex);
+  if ( ! registry_initialized) {
+    ffidl_type_void.lib_type = lib_type_void;
+    ffidl_type_char.lib_type = lib_type_char;
+    ffidl_type_schar.lib_type = lib_type_schar;
+    ffidl_type_uchar.lib_type = lib_type_uchar;
+    ffidl_type_sshort.lib_type = lib_type_sshort;
+    ffidl_type_ushort.lib_type = lib_type_ushort;
+    ffidl_type_sint.lib_type = lib_type_sint;
+    ffidl_type_uint.lib_type = lib_type_uint;
+    ffidl_type_slong.lib_type = lib_type_slong;
+    ffidl_type_ulong.lib_type = lib_type_ulong;
+#if HAVE_LONG_LONG
+    ffidl_type_slonglong.lib_type = lib_type_slonglong;
+    ffidl_type_ulonglong.lib_type = lib_type_ulonglong;
+#endif
+    ffidl_type_float.lib_type = lib_type_float;
+    ffidl_type_double.lib_type = lib_type_double;
+#if HAVE_LONG_DOUBLE
+    ffidl_type_longdouble.lib_type = lib_type_longdouble;
+#endif
+    ffidl_type_sint8.lib_type = lib_type_sint8;
+    ffidl_type_uint8.lib_type = lib_type_uint8;
+    ffidl_type_sint16.lib_type = lib_type_sint16;
+    ffidl_type_uint16.lib_type = lib_type_uint16;
+    ffidl_type_sint32.lib_type = lib_type_sint32;
+    ffidl_type_uint32.lib_type = lib_type_uint32;
+#if HAVE_INT64
+    ffidl_type_sint64.lib_type = lib_type_sint64;
+    ffidl_type_uint64.lib_type = lib_type_uint64;
+#endif
+    ffidl_type_pointer.lib_type       = lib_type_pointer;
+    ffidl_type_pointer_obj.lib_type   = lib_type_pointer;
+    ffidl_type_pointer_utf8.lib_type  = lib_type_pointer;
+    ffidl_type_pointer_utf16.lib_type = lib_type_pointer;
+    ffidl_type_pointer_byte.lib_type  = lib_type_pointer;
+    ffidl_type_pointer_var.lib_type   = lib_type_pointer;
+#if USE_CALLBACKS
+    ffidl_type_pointer_proc.lib_type = lib_type_pointer;
+#endif
+    Tcl_InitHashTable(&registry_types, TCL_STRING_KEYS);
+    Tcl_InitHashTable(&registry_sigs, TCL_STRING_KEYS);
+    registry_initialized = 1;
+  }
+  Tcl_MutexUnlock(&registry_mutex);
+}
+/* client allocation and initialization */
+static ffidl_client *client_alloc(Tcl_Interp *interp)
+{
+  ffidl_client *client;
+
+  /* allocate client data structure */
+  client = (ffidl_client *)Tcl_Alloc(sizeof(ffidl_client));
+  client->interp = interp;
+  client->async_id = 0;
+  client->async_pending = 0;
+
+  /* allocate hashtables for this load */
+  Tcl_InitHashTable(&client->types, TCL_STRING_KEYS);
+  Tcl_InitHashTable(&client->callouts, TCL_STRING_KEYS);
+  Tcl_InitHashTable(&client->cifs, TCL_STRING_KEYS);
+  Tcl_InitHashTable(&client->libs, TCL_STRING_KEYS);
+#if USE_CALLBACKS
+  Tcl_InitHashTable(&client->callbacks, TCL_STRING_KEYS);
+  client->callback_epoch = callback_epoch_next();
+  Tcl_InitHashTable(&client->anonymous, TCL_ONE_WORD_KEYS);
+  Tcl_InitHashTable(&client->closures, TCL_STRING_KEYS);
+  Tcl_InitHashTable(&client->trampolines, TCL_STRING_KEYS);
+  client->userdata = NULL;
+  client->nuserdata = 0;
+  client->freeuserdata = -1;
+  client->userdata_mutex = NULL;
+#if TCL_THREADS
+  client->userdata_owner = Tcl_GetCurrentThread();
+  client->marshal_closed = 0;
+#endif
+#endif
+
+  /* set up the base types and the registry, once */
+  registry_init();
+
+  type_define(client, "void", &ffidl_type_void);
+  type_define(client, "char", &ffidl_type_char);
+  type_define(client, "signed char", &ffidl_type_schar);
+  type_define(client, "unsigned char", &ffidl_type_uchar);
+  type_define(client, "short", &ffidl_type_sshort);
+  type_define(client, "unsigned short", &ffidl_type_ushort);
+  type_define(client, "int", &ffidl_type_sint);
+  type_define(client, "unsigned", &ffidl_type_uint);
+  type_define(client, "long", &ffidl_type_slong);
+  type_define(client, "unsigned long", &ffidl_type_ulong);
+#if HAVE_LONG_LONG
+  type_define(client, "long long", &ffidl_type_slonglong);
+  type_define(client, "unsigned long long", &ffidl_type_ulonglong);
+#endif
+  type_define(client, "float", &ffidl_type_float);
+  type_define(client, "double", &ffidl_type_double);
+#if HAVE_LONG_DOUBLE
+  type_define(client, "long double", &ffidl_type_longdouble);
+#endif
+  type_define(client, "sint8", &ffidl_type_sint8);
+  type_define(client, "uint8", &ffidl_type_uint8);
+  type_define(client, "sint16", &ffidl_type_sint16);
+  type_define(client, "uint16", &ffidl_type_uint16);
+  type_define(client, "sint32", &ffidl_type_sint32);
+  type_define(client, "uint32", &ffidl_type_uint32);
+#if HAVE_INT64
+  type_define(client, "sint64", &ffidl_type_sint64);
+  type_define(client, "uint64", &ffidl_type_uint64);
+#endif
+  type_define(client, "pointer", &ffidl_type_pointer);
+  type_define(client, "pointer-obj", &ffidl_type_pointer_obj);
+  type_define(client, "pointer-utf8", &ffidl_type_pointer_utf8);
+  type_define(client, "pointer-utf16", &ffidl_type_pointer_utf16);
+  type_define(client, "pointer-byte", &ffidl_type_pointer_byte);
+  type_define(client, "pointer-var", &ffidl_type_pointer_var);
+#if USE_CALLBACKS
+  type_define(client, "pointer-proc", &ffidl_type_pointer_proc);
+#endif
+
+  /* arrange for cleanup on interpreter deletion */
+  Tcl_CallWhenDeleted(interp, client_delete, (ClientData)client);
+#if USE_CALLBACKS && USE_LIBFFI && TCL_THREADS
+  Tcl_CreateThreadExitHandler(callback_marshal_thread_exit, (ClientData)client);
+#endif
 
   /* finis */
   return client;
 }
-/*****************************************
- *
- * Functions exported as tcl commands.
- */
+/*****************************************
+ *
+ * Functions exported as tcl commands.
+ */
+
+/* usage: ::ffidl::info option ?...? */
+static int tcl_ffidl_info(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  enum {
+    command_ix,
+    option_ix,
+    minargs
+  };
+
+  int i;
+  char *arg;
+  Tcl_HashTable *table;
+  Tcl_HashSearch search;
+  Tcl_HashEntry *entry;
+  ffidl_type *type;
+  ffidl_client *client = (ffidl_client *)clientData;
+  static const char *options[] = {
+#define INFO_ALIGNOF 0
+    "alignof",
+#define INFO_CALLBACKS 1
+    "callbacks",
+#define INFO_CALLOUTS 2
+    "callouts",
+#define INFO_CANONICAL_HOST 3
+    "canonical-host",
+#define INFO_FORMAT 4
+    "format",
+#define INFO_HAVE_INT64 5
+    "have-int64",
+#define INFO_HAVE_LONG_DOUBLE 6
+    "have-long-double",
+#define INFO_HAVE_LONG_LONG 7
+    "have-long-long",
+#define INFO_INTERP 8
+    "interp",
+#define INFO_JIT_CALLOUTS 9
+    "jit-callouts",
+#define INFO_LIBRARIES 10
+    "libraries",
+#define INFO_MAP_THREADS 11
+    "map-threads",
+#define INFO_REGISTRY 12
+    "registry",
+#define INFO_SIGNATURES 13
+    "signatures",
+#define INFO_SIZEOF 14
+    "sizeof",
+#define INFO_THUNK_CALLOUTS 15
+    "thunk-callouts",
+#define INFO_TYPEDEFS 16
+    "typedefs",
+#define INFO_USE_CALLBACKS 17
+    "use-callbacks",
+#define INFO_USE_FFCALL 18
+    "use-ffcall",
+#define INFO_USE_JIT 19
+    "use-jit",
+#define INFO_USE_LIBFFCALL 20
+    "use-libffcall",
+#define INFO_USE_LIBFFI 21
+    "use-libffi",
+#define INFO_USE_LIBFFI_RAW 22
+    "use-libffi-raw",
+#define INFO_USE_THUNKS 23
+    "use-thunks",
+#define INFO_NULL 24
+    "NULL",
+    NULL
+  };
+
+  if (objc < minargs) {
+    Tcl_WrongNumArgs(interp, 1, objv, "option ?arg ...?");
+    return TCL_ERROR;
+  }
+
+  if (Tcl_GetIndexFromObj(interp, objv[option_ix], options, "option", TCL_EXACT, &i) == TCL_ERROR)
+    return TCL_ERROR;
+
+  switch (i) {
+  case INFO_CALLOUTS:		/* return list of callout names */
+    table = &client->callouts;
+  list_table_keys:		/* list the keys in a hash table */
+    if (objc != 2) {
+      Tcl_WrongNumArgs(interp,2,objv,"");
+      return TCL_ERROR;
+    }
+    for (entry = Tcl_FirstHashEntry(table, &search); entry != NULL; entry = Tcl_NextHashEntry(&search))
+      Tcl_ListObjAppendElement(interp, Tcl_GetObjResult(interp), Tcl_NewStringObj(Tcl_GetHashKey(table,entry),-1));
+    return TCL_OK;
+  case INFO_MAP_THREADS:	/* return number of ::ffidl::parallel-map worker threads */
+    if (objc != 2) {
+      Tcl_WrongNumArgs(interp,2,objv,"");
+      return TCL_ERROR;
+    }
+#if TCL_THREADS
+    Tcl_MutexLock(&map_pool_mutex);
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(map_pool_size));
+    Tcl_MutexUnlock(&map_pool_mutex);
+#else
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+#endif
+    return TCL_OK;
+  case INFO_REGISTRY:		/* return sizes of the process wide registry */
+    if (objc != 2) {
+      Tcl_WrongNumArgs(interp,2,objv,"");
+      return TCL_ERROR;
+    }
+    Tcl_MutexLock(&registry_mutex);
+    Tcl_ListObjAppendElement(interp, Tcl_GetObjResult(interp), Tcl_NewStringObj("types", -1));
+    Tcl_ListObjAppendElement(interp, Tcl_GetObjResult(interp), Tcl_NewIntObj(registry_types.numEntries));
+    Tcl_ListObjAppendElement(interp, Tcl_GetObjResult(interp), Tcl_NewStringObj("signatures", -1));
+    Tcl_ListObjAppendElement(interp, Tcl_GetObjResult(interp), Tcl_NewIntObj(registry_sigs.numEntries));
+    Tcl_MutexUnlock(&registry_mutex);
+    return TCL_OK;
+  case INFO_JIT_CALLOUTS:	/* return list of JIT-compiled callout names */
+    if (objc != 2) {
+      Tcl_WrongNumArgs(interp,2,objv,"");
+      return TCL_ERROR;
+    }
+#if USE_JIT
+    table = &client->callouts;
+    for (entry = Tcl_FirstHashEntry(table, &search); entry != NULL; entry = Tcl_NextHashEntry(&search))
+      if (((ffidl_callout *)Tcl_GetHashValue(entry))->jit_code)
+	Tcl_ListObjAppendElement(interp, Tcl_GetObjResult(interp), Tcl_NewStringObj(Tcl_GetHashKey(table,entry),-1));
+#endif
+    return TCL_OK;
+  case INFO_THUNK_CALLOUTS:	/* return list of callout names using a thunk */
+    if (objc != 2) {
+      Tcl_WrongNumArgs(interp,2,objv,"");
+      return TCL_ERROR;
+    }
+#if USE_THUNKS
+    table = &client->callouts;
+    for (entry = Tcl_FirstHashEntry(table, &search); entry != NULL; entry = Tcl_NextHashEntry(&search))
+      if (((ffidl_callout *)Tcl_GetHashValue(entry))->thunk)
+	Tcl_ListObjAppendElement(interp, Tcl_GetObjResult(interp), Tcl_NewStringObj(Tcl_GetHashKey(table,entry),-1));
+#endif
+    return TCL_OK;
+  case INFO_TYPEDEFS:		/* return list of typedef names */
+    table = &client->types;
+    goto list_table_keys;
+  case INFO_SIGNATURES:		/* return list of ffi signatures */
+    table = &client->cifs;
+    goto list_table_keys;
+  case INFO_LIBRARIES:		/* return list of lib names */
+    table = &client->libs;
+    goto list_table_keys;
+  case INFO_CALLBACKS:		/* return list of callback names */
+#if USE_CALLBACKS
+    table = &client->callbacks;
+    goto list_table_keys;
+#else
+    Tcl_AppendResult(interp, "callbacks are not supported in this configuration", NULL);
+    return TCL_ERROR;
+#endif
+
+  case INFO_SIZEOF:		/* return sizeof type */
+  case INFO_ALIGNOF:		/* return alignof type */
+  case INFO_FORMAT:		/* return binary format of type */
+    if (objc != 3) {
+      Tcl_WrongNumArgs(interp,2,objv,"type");
+      return TCL_ERROR;
+    }
+    arg = Tcl_GetString(objv[2]);
+    type = type_lookup(client, arg);
+    if (type == NULL) {
+      Tcl_AppendResult(interp, "undefined type: ", arg, NULL);
+      return TCL_ERROR;
+    }
+    if (i == INFO_SIZEOF) {
+      Tcl_SetObjResult(interp, Tcl_NewIntObj(type->size));
+      return TCL_OK;
+    }
+    if (i == INFO_ALIGNOF) {
+      Tcl_SetObjResult(interp, Tcl_NewIntObj(type->alignment));
+      return TCL_OK;
+    }
+    if (i == INFO_FORMAT) {
+      size_t offset = 0;
+      return type_format(interp, type, &offset);
+    }
+    Tcl_AppendResult(interp, "lost in ::ffidl::info?", NULL);
+    return TCL_ERROR;
+  case INFO_INTERP:
+    /* return the interp as integer */
+    if (objc != 2) {
+      Tcl_WrongNumArgs(interp,2,objv,"");
+      return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, Ffidl_NewPointerObj(interp));
+    return TCL_OK;
+  case INFO_USE_FFCALL:
+  case INFO_USE_LIBFFCALL:
+#if USE_LIBFFCALL
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
+#else
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+#endif
+    return TCL_OK;
+  case INFO_USE_LIBFFI:
+#if USE_LIBFFI
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
+#else
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+#endif
+    return TCL_OK;
+  case INFO_USE_CALLBACKS:
+#if USE_CALLBACKS
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
+#else
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+#endif
+    return TCL_OK;
+  case INFO_HAVE_LONG_LONG:
+#if HAVE_LONG_LONG
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
+#else
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+#endif
+    return TCL_OK;
+  case INFO_HAVE_LONG_DOUBLE:
+#if HAVE_LONG_DOUBLE
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
+#else
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+#endif
+    return TCL_OK;
+  case INFO_USE_LIBFFI_RAW:
+#if USE_LIBFFI_RAW_API
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
+#else
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+#endif
+    return TCL_OK;
+  case INFO_USE_JIT:
+#if USE_JIT
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
+#else
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+#endif
+    return TCL_OK;
+  case INFO_USE_THUNKS:
+#if USE_THUNKS
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
+#else
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+#endif
+    return TCL_OK;
+  case INFO_HAVE_INT64:
+#if HAVE_INT64
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
+#else
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+#endif
+    return TCL_OK;
+  case INFO_CANONICAL_HOST:
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(CANONICAL_HOST,-1));
+    return TCL_OK;
+  case INFO_NULL:
+    Tcl_SetObjResult(interp, Ffidl_NewPointerObj(NULL));
+    return TCL_OK;
+  }
+  
+  /* return an error */
+  Tcl_AppendResult(interp, "missing option implementation: ", Tcl_GetString(objv[option_ix]), NULL);
+  return TCL_ERROR;
+}
+
+/* usage: ffidl::typedef name type1 ?type2 ...? */
+static int tcl_ffidl_typedef(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  enum {
+    command_ix,
+    name_ix,
+    type_ix,
+    minargs
+  };
+
+  char *tname1, *tname2;
+  ffidl_type *newtype, *ttype2;
+  int nelts, i;
+  ffidl_client *client = (ffidl_client *)clientData;
+
+  /* check number of args */
+  if (objc < minargs) {
+    Tcl_WrongNumArgs(interp,1,objv,"name type ?...?");
+    return TCL_ERROR;
+  }
+  /* fetch new type name, verify that it is new */
+  tname1 = Tcl_GetString(objv[name_ix]);
+  if (type_lookup(client, tname1) != NULL) {
+    Tcl_AppendResult(interp, "type is already defined: ", tname1, NULL);
+    return TCL_ERROR;
+  }
+  nelts = objc - 2;
+  if (nelts == 1) {
+    /* define tname1 as an alias for tname2 */
+    tname2 = Tcl_GetString(objv[type_ix]);
+    ttype2 = type_lookup(client, tname2);
+    if (ttype2 == NULL) {
+      Tcl_AppendResult(interp, "undefined type: ", tname2, NULL);
+      return TCL_ERROR;
+    }
+    /* define alias */
+    type_define(client, tname1, ttype2);
+    type_inc_ref(ttype2);
+  } else {
+    /* allocate an aggregate type */
+    newtype = type_alloc(client, nelts);
+    if (newtype == NULL) {
+      Tcl_AppendResult(interp, "couldn't allocate the ffi_type", NULL);
+      return TCL_ERROR;
+    }
+    /* parse aggregate types */
+    newtype->size = 0;
+    newtype->alignment = 0;
+    for (i = 0; i < nelts; i += 1) {
+      tname2 = Tcl_GetString(objv[type_ix+i]);
+      ttype2 = type_lookup(client, tname2);
+      if (ttype2 == NULL) {
+	type_free(newtype);
+	Tcl_AppendResult(interp, "undefined element type: ", tname2, NULL);
+	return TCL_ERROR;
+      }
+      if ((ttype2->class & FFIDL_ELT) == 0) {
+	type_free(newtype);
+	Tcl_AppendResult(interp, "type ", tname2, " is not permitted in element context", NULL);
+	return TCL_ERROR;
+      }
+      newtype->elements[i] = ttype2;
+      /* accumulate the aggregate size and alignment */
+      /* align current size to element's alignment */
+      if ((ttype2->alignment-1) & newtype->size) {
+	newtype->size = ((newtype->size-1) | (ttype2->alignment-1)) + 1;
+      }
+      /* add the element's size */
+      newtype->size += ttype2->size;
+      /* bump the aggregate alignment as required */
+      if (ttype2->alignment > newtype->alignment) {
+	newtype->alignment = ttype2->alignment;
+      }
+    }
+    newtype->size = ((newtype->size-1) | (newtype->alignment-1)) + 1; /* tail padding as in libffi */
+    /* share the type of an identical definition */
+    newtype = type_intern(newtype);
+    if (newtype == NULL) {
+      Tcl_AppendResult(interp, "type definition error", NULL);
+      return TCL_ERROR;
+    }
+    /* define new type */
+    type_define(client, tname1, newtype);
+  }
+  /* return success */
+  return TCL_OK;
+}
+
+/* usage: depends on the signature defining the ffidl::callout */
+#if TCL_THREADS
+/* follow the waiting coroutine through renames, and forget it once deleted */
+static void await_trace(ClientData clientData, Tcl_Interp *interp,
+			const char *oldName, const char *newName, int flags)
+{
+  ffidl_await *await = (ffidl_await *)clientData;
+
+  Tcl_DecrRefCount(await->coroutine);
+  if (newName == NULL || newName[0] == '\0') {
+    await->coroutine = NULL;
+  } else {
+    await->coroutine = Tcl_NewStringObj(newName, -1);
+    Tcl_IncrRefCount(await->coroutine);
+  }
+}
+
+static void await_release(ffidl_await *await)
+{
+  if (--await->refCount == 0) {
+    if (await->coroutine) {
+      Tcl_UntraceCommand(await->interp, Tcl_GetString(await->coroutine),
+			 TCL_TRACE_RENAME|TCL_TRACE_DELETE, await_trace, (ClientData)await);
+      Tcl_DecrRefCount(await->coroutine);
+    }
+    Tcl_DecrRefCount(await->name);
+    if (await->result) {
+      Tcl_DecrRefCount(await->result);
+    }
+    Tcl_Free((void *)await);
+  }
+}
+
+/* resume the waiting coroutine, which looks at the await's state */
+static void await_resume(ffidl_await *await, int state)
+{
+  Tcl_Interp *interp = await->interp;
+  Tcl_Obj *name = await->coroutine;
+
+  await->state = state;
+  if (await->timer) {
+    Tcl_DeleteTimerHandler(await->timer);
+    await->timer = NULL;
+  }
+  if (name == NULL) {
+    return;
+  }
+  /* call the coroutine by its name now, which the trace followed */
+  Tcl_IncrRefCount(name);
+  Tcl_Preserve((ClientData)interp);
+  if (Tcl_EvalObjv(interp, 1, &name, TCL_EVAL_GLOBAL) == TCL_ERROR) {
+    Tcl_BackgroundError(interp);
+  }
+  Tcl_Release((ClientData)interp);
+  Tcl_DecrRefCount(name);
+}
+
+static void await_timeout(ClientData clientData)
+{
+  ffidl_await *await = (ffidl_await *)clientData;
+
+  await->timer = NULL;
+  await_resume(await, FFIDL_AWAIT_TIMEOUT);
+}
+
+/* complete an -async call on its calling thread */
+static int async_event_proc(Tcl_Event *evPtr, int flags)
+{
+  ffidl_async *async = (ffidl_async *)evPtr;
+  ffidl_callout *callout = async->callout;
+  ffidl_client *client = callout->client;
+  Tcl_Interp *interp = async->interp;
+  Tcl_Obj *command, *result;
+  int i;
+
+  /* the callee wrote into the variables' values: drop stale strings */
+  for (i = callout->nbound; i < callout->cif->argc; i += 1) {
+    if (callout->cif->atypes[i]->typecode == FFIDL_PTR_VAR) {
+      Tcl_InvalidateStringRep(async->objs[i-callout->nbound]);
+    }
+  }
+  if ( ! Tcl_InterpDeleted(interp)) {
+    if (callout->ret_converter) {
+      result = callout->ret_converter(NULL, async->frame->ret);
+    } else if (async->result) {
+      result = async->result;
+    } else {
+      result = Tcl_NewObj();
+    }
+    if (async->await) {
+      Tcl_IncrRefCount(result);
+      if (async->await->state == FFIDL_AWAIT_WAITING) {
+	async->await->result = result;
+	Tcl_IncrRefCount(result);
+	await_resume(async->await, FFIDL_AWAIT_DONE);
+      }
+      Tcl_DecrRefCount(result);
+    } else {
+      /* command id result */
+      command = Tcl_DuplicateObj(async->command);
+      Tcl_IncrRefCount(command);
+      Tcl_ListObjAppendElement(NULL, command, Tcl_NewLongObj(async->id));
+      Tcl_ListObjAppendElement(NULL, command, result);
+      if (Tcl_EvalObjEx(interp, command, TCL_EVAL_GLOBAL) == TCL_ERROR) {
+	Tcl_BackgroundError(interp);
+      }
+      Tcl_DecrRefCount(command);
+    }
+  }
+  for (i = 0; i < async->nobjs; i += 1) {
+    Tcl_DecrRefCount(async->objs[i]);
+  }
+  if (async->await) {
+    await_release(async->await);
+  } else {
+    Tcl_DecrRefCount(async->command);
+  }
+  if (async->result) {
+    Tcl_DecrRefCount(async->result);
+  }
+  callout_frame_release(callout, async->frame);
+  client->async_pending -= 1;
+  /* releasing the callout may free it */
+  Tcl_Release((ClientData)callout);
+  Tcl_Release((ClientData)client);
+  Tcl_Release((ClientData)interp);
+  return 1;
+}
+
+static Tcl_ThreadCreateType async_pool_worker(ClientData clientData)
+{
+  int worker = (int)(size_t)clientData, generation;
+  ffidl_async *async;
+
+  Tcl_MutexLock(&async_pool_mutex);
+  generation = async_pool_generation;
+  for (;;) {
+    while (async_pool_head == NULL && generation == async_pool_generation) {
+      async_pool_idle += 1;
+      Tcl_ConditionWait(&async_pool_work, &async_pool_mutex, NULL);
+      async_pool_idle -= 1;
+    }
+    if (generation != async_pool_generation) {
+      break;
+    }
+    async = async_pool_head;
+    if ((async_pool_head = async->next) == NULL) {
+      async_pool_tail = NULL;
+    }
+    async_pool_queued -= 1;
+    async_pool_busy[worker] = 1;
+    Tcl_MutexUnlock(&async_pool_mutex);
+    callout_call(async->callout, async->frame->args, async->frame->ret);
+    Tcl_MutexLock(&async_pool_mutex);
+    if (generation != async_pool_generation) {
+      /* the process is exiting, and nobody waits for the call any more */
+      break;
+    }
+    async_pool_busy[worker] = 0;
+    async->header.proc = async_event_proc;
+    Tcl_ThreadQueueEvent(async->owner, &async->header, TCL_QUEUE_TAIL);
+    Tcl_ThreadAlert(async->owner);
+  }
+  Tcl_MutexUnlock(&async_pool_mutex);
+  TCL_THREAD_CREATE_RETURN;
+}
+
+/*
+ * Stop the workers when the process exits, joining the idle ones.  Queued
+ * calls are dropped; workers blocked in a running call are not waited for,
+ * and drop its result should it return.
+ */
+static void async_pool_exit(ClientData clientData)
+{
+  int i, result, idle[FFIDL_ASYNC_MAXTHREADS];
+
+  Tcl_MutexLock(&async_pool_mutex);
+  async_pool_generation += 1;
+  Tcl_ConditionNotify(&async_pool_work);
+  for (i = 0; i < async_pool_size; i += 1) {
+    idle[i] = !async_pool_busy[i];
+  }
+  Tcl_MutexUnlock(&async_pool_mutex);
+  for (i = 0; i < async_pool_size; i += 1) {
+    if (idle[i]) {
+      Tcl_JoinThread(async_pool_threads[i], &result);
+    }
+  }
+  async_pool_size = 0;
+  async_pool_head = async_pool_tail = NULL;
+  async_pool_queued = 0;
+}
+
+/* let the pool grow up to n workers */
+static void async_pool_allow(int n)
+{
+  Tcl_MutexLock(&async_pool_mutex);
+  if (n > FFIDL_ASYNC_MAXTHREADS) {
+    n = FFIDL_ASYNC_MAXTHREADS;
+  }
+  if (n > async_pool_limit) {
+    async_pool_limit = n;
+  }
+  Tcl_MutexUnlock(&async_pool_mutex);
+}
+
+/*
+ * Queue an -async call, starting a worker if all are busy and the pool
+ * may grow.  Fails if there is no worker at all.
+ */
+static int async_pool_queue(ffidl_async *async)
+{
+  Tcl_MutexLock(&async_pool_mutex);
+  if (async_pool_queued >= async_pool_idle && async_pool_size < async_pool_limit) {
+    async_pool_busy[async_pool_size] = 0;
+    if (Tcl_CreateThread(&async_pool_threads[async_pool_size], async_pool_worker,
+			 (ClientData)(size_t)async_pool_size, TCL_THREAD_STACK_DEFAULT,
+			 TCL_THREAD_JOINABLE) == TCL_OK) {
+      if (async_pool_size == 0) {
+	Tcl_CreateExitHandler(async_pool_exit, NULL);
+      }
+      async_pool_size += 1;
+    }
+  }
+  if (async_pool_size == 0) {
+    Tcl_MutexUnlock(&async_pool_mutex);
+    return TCL_ERROR;
+  }
+  async->next = NULL;
+  if (async_pool_tail != NULL) {
+    async_pool_tail->next = async;
+  } else {
+    async_pool_head = async;
+  }
+  async_pool_tail = async;
+  async_pool_queued += 1;
+  Tcl_ConditionNotify(&async_pool_work);
+  Tcl_MutexUnlock(&async_pool_mutex);
+  return TCL_OK;
+}
+
+/*
+ * Queue a call of an -async callout, completed by the command prefix or by
+ * resuming the await's coroutine.  objv holds the callout's unbound
+ * arguments.  Leaves the call's id in the interpreter result.
+ */
+static int callout_async_queue(Tcl_Interp *interp, ffidl_callout *callout,
+			       Tcl_Obj *command, ffidl_await *await, Tcl_Obj *CONST objv[])
+{
+  ffidl_cif *cif = callout->cif;
+  ffidl_client *client = callout->client;
+  ffidl_async *async;
+  int i, argsIx = -callout->nbound;
+
+  async = (ffidl_async *)Tcl_Alloc(sizeof(ffidl_async)+cif->argc*sizeof(Tcl_Obj *));
+  async->objs = (Tcl_Obj **)(async+1);
+  async->nobjs = 0;
+  async->result = NULL;
+  async->frame = callout_frame_get(callout, &async->stackFrame, async->args, async->values);
+  /* fetch and convert argument values, keeping what they point into */
+  if (callout->nbound && callout_bind(interp, callout, async->frame) != TCL_OK) {
+    goto error;
+  }
+  for (i = callout->nbound; i < cif->argc; i += 1) {
+    Tcl_Obj *obj = objv[argsIx+i];
+    switch (cif->atypes[i]->typecode) {
+    case FFIDL_STRUCT:
+    case FFIDL_PTR_BYTE:
+    case FFIDL_PTR_UTF16:
+      /* point into a copy that scripts cannot change the type of */
+      if (Tcl_IsShared(obj)) {
+	obj = Tcl_DuplicateObj(obj);
+      }
+      /* fall through */
+    default:
+      Tcl_IncrRefCount(obj);
+      async->objs[async->nobjs++] = obj;
+      break;
+    case FFIDL_PTR_VAR:
+      break;
+    }
+    if (callout->converters[i](interp, callout, i, obj, &async->frame->args[i]) != TCL_OK) {
+      goto error;
+    }
+    if (cif->atypes[i]->typecode == FFIDL_PTR_VAR) {
+      /* the variable's value, made unshared by the conversion */
+      obj = Tcl_ObjGetVar2(interp, obj, NULL, 0);
+      Tcl_IncrRefCount(obj);
+      async->objs[async->nobjs++] = obj;
+    }
+  }
+  if (cif->rtype->typecode == FFIDL_STRUCT) {
+    async->result = Tcl_NewByteArrayObj(NULL, 0);
+    async->frame->ret = Tcl_SetByteArrayLength(async->result, cif->rtype->size);
+    Tcl_IncrRefCount(async->result);
+  }
+  async->callout = callout;
+  async->interp = interp;
+  async->owner = Tcl_GetCurrentThread();
+  async->id = ++client->async_id;
+  async->command = command;
+  async->await = await;
+  Tcl_Preserve((ClientData)interp);
+  Tcl_Preserve((ClientData)client);
+  Tcl_Preserve((ClientData)callout);
+  if (async_pool_queue(async) == TCL_ERROR) {
+    Tcl_Release((ClientData)callout);
+    Tcl_Release((ClientData)client);
+    Tcl_Release((ClientData)interp);
+    Tcl_AppendResult(interp, "can't start a thread for -async calls", NULL);
+    goto error;
+  }
+  client->async_pending += 1;
+  if (command) {
+    Tcl_IncrRefCount(command);
+  }
+  Tcl_SetObjResult(interp, Tcl_NewLongObj(async->id));
+  return TCL_OK;
+
+ error:
+  for (i = 0; i < async->nobjs; i += 1) {
+    Tcl_DecrRefCount(async->objs[i]);
+  }
+  if (async->result) {
+    Tcl_DecrRefCount(async->result);
+  }
+  callout_frame_release(callout, async->frame);
+  Tcl_Free((void *)async);
+  return TCL_ERROR;
+}
+
+/*
+ * Make a call of an -async callout: objv holds the completion command
+ * prefix followed by the arguments.  Returns the call's id.
+ */
+static int callout_call_async(Tcl_Interp *interp, ffidl_callout *callout, int objc, Tcl_Obj *CONST objv[])
+{
+  int length;
+
+  /* usage check */
+  if (objc-2 != callout->cif->argc-callout->nbound) {
+    Tcl_WrongNumArgs(interp, 1, objv, callout->usage);
+    return TCL_ERROR;
+  }
+  if (Tcl_ListObjLength(interp, objv[1], &length) == TCL_ERROR) {
+    return TCL_ERROR;
+  }
+  return callout_async_queue(interp, callout, objv[1], NULL, objv+2);
+}
+#endif
+
+static int tcl_ffidl_call(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  enum {
+    command_ix,
+    args_ix,
+    minargs = args_ix
+  };
+
+  ffidl_callout *callout = (ffidl_callout *)clientData;
+  ffidl_cif *cif = callout->cif;
+  int i, itmp, argsIx = args_ix;
+  Tcl_Obj *obj = NULL, *result, *varNameObj = NULL;
+  ffidl_frame *frame, stackFrame;
+  void *stackArgs[FFIDL_FRAME_ARGS];
+  ffidl_value stackValues[FFIDL_FRAME_ARGS];
+
+#if TCL_THREADS
+  if (callout->flags & FFIDL_CALLOUT_ASYNC) {
+    return callout_call_async(interp, callout, objc, objv);
+  }
+#endif
+  if (callout->flags & FFIDL_CALLOUT_RESULTVAR) {
+    argsIx += 1;
+  }
+  /* usage check */
+  if (objc-argsIx != cif->argc-callout->nbound) {
+    Tcl_WrongNumArgs(interp, 1, objv, callout->usage);
+    return TCL_ERROR;
+  }
+  if (callout->flags & FFIDL_CALLOUT_RESULTVAR) {
+    varNameObj = objv[args_ix];
+  }
+  frame = callout_frame_get(callout, &stackFrame, stackArgs, stackValues);
+  /* fetch and convert argument values */
+  if (callout->nbound && callout_bind(interp, callout, frame) != TCL_OK) {
+    callout_frame_release(callout, frame);
+    return TCL_ERROR;
+  }
+  argsIx -= callout->nbound;
+  for (i = callout->nbound; i < cif->argc; i += 1) {
+    if (callout->converters[i](interp, callout, i, objv[argsIx+i], &frame->args[i]) != TCL_OK) {
+      callout_frame_release(callout, frame);
+      return TCL_ERROR;
+    }
+  }
+  /* prepare for structure return, reusing the result variable's value if it
+     is an unshared bytearray of the right size */
+  if (cif->rtype->typecode == FFIDL_STRUCT) {
+    if (varNameObj) {
+      obj = Tcl_ObjGetVar2(interp, varNameObj, NULL, 0);
+      if (obj != NULL && !Tcl_IsShared(obj) && obj->typePtr == ffidl_bytearray_ObjType) {
+	frame->ret = Tcl_GetByteArrayFromObj(obj, &itmp);
+	if (itmp == cif->rtype->size) {
+	  Tcl_InvalidateStringRep(obj);
+	} else {
+	  obj = NULL;
+	}
+      } else {
+	obj = NULL;
+      }
+    }
+    if (obj == NULL) {
+      obj = Tcl_NewByteArrayObj(NULL, 0);
+      frame->ret = Tcl_SetByteArrayLength(obj, cif->rtype->size);
+    }
+    Tcl_IncrRefCount(obj);
+  }
+  /* call */
+  if (callout->memo) {
+    memo_call(callout, frame->args, frame->ret);
+  } else {
+    callout_call(callout, frame->args, frame->ret);
+  }
+  /* convert return value, in place if the interp result is unshared */
+  if (callout->ret_converter) {
+    result = Tcl_GetObjResult(interp);
+    obj = callout->ret_converter(Tcl_IsShared(result) ? NULL : result, frame->ret);
+    if (obj != result) {
+      Tcl_SetObjResult(interp, obj);
+    }
+  } else if (obj) {
+    if (varNameObj) {
+      if (Tcl_ObjSetVar2(interp, varNameObj, NULL, obj, TCL_LEAVE_ERR_MSG) == NULL) {
+	Tcl_DecrRefCount(obj);
+	callout_frame_release(callout, frame);
+	return TCL_ERROR;
+      }
+      Tcl_ResetResult(interp);
+    } else {
+      Tcl_SetObjResult(interp, obj);
+    }
+    Tcl_DecrRefCount(obj);
+  }
+  callout_frame_release(callout, frame);
+  return TCL_OK;
+}
 
-/* usage: ::ffidl::info option ?...? */
-static int tcl_ffidl_info(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+/* usage: ffidl::callout ?options? name {?argument_type ...?} return_type address ?protocol? */
+static int tcl_ffidl_callout(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
   enum {
     command_ix,
-    option_ix,
-    minargs
+    name_ix,
+    args_ix,
+    return_ix,
+    address_ix,
+    protocol_ix,
+    minargs = address_ix + 1,
+    maxargs = protocol_ix + 1,
   };
 
-  int i;
-  char *arg;
-  Tcl_HashTable *table;
-  Tcl_HashSearch search;
-  Tcl_HashEntry *entry;
-  ffidl_type *type;
+  char *name;
+  void (*fn)(void);
+  int argc, i;
+  Tcl_Obj **argv;
+  Tcl_DString usage, ds;
+  Tcl_Command res;
+  ffidl_cif *cif = NULL;
+  ffidl_callout *callout = NULL;
   ffidl_client *client = (ffidl_client *)clientData;
+  int has_protocol, option, flags = 0, memoize = 0, threads = 0;
+  Tcl_Obj *CONST *cmdv = objv;
   static const char *options[] = {
-#define INFO_ALIGNOF 0
-    "alignof",
-#define INFO_CALLBACKS 1
-    "callbacks",
-#define INFO_CALLOUTS 2
-    "callouts",
-#define INFO_CANONICAL_HOST 3
-    "canonical-host",
-#define INFO_FORMAT 4
-    "format",
-#define INFO_HAVE_INT64 5
-    "have-int64",
-#define INFO_HAVE_LONG_DOUBLE 6
-    "have-long-double",
-#define INFO_HAVE_LONG_LONG 7
-    "have-long-long",
-#define INFO_INTERP 8
-    "interp",
-#define INFO_LIBRARIES 9
-    "libraries",
-#define INFO_SIGNATURES 10
-    "signatures",
-#define INFO_SIZEOF 11
-    "sizeof",
-#define INFO_TYPEDEFS 12
-    "typedefs",
-#define INFO_USE_CALLBACKS 13
-    "use-callbacks",
-#define INFO_USE_FFCALL 14
-    "use-ffcall",
-#define INFO_USE_LIBFFCALL 15
-    "use-libffcall",
-#define INFO_USE_LIBFFI 16
-    "use-libffi",
-#define INFO_USE_LIBFFI_RAW 17
-    "use-libffi-raw",
-#define INFO_NULL 18
-    "NULL",
+#define CALLOUT_ASYNC 0
+    "-async",
+#define CALLOUT_MEMOIZE 1
+    "-memoize",
+#define CALLOUT_PURE 2
+    "-pure",
+#define CALLOUT_RESULTVAR 3
+    "-resultvar",
+#define CALLOUT_THREADSAFE 4
+    "-threadsafe",
     NULL
   };
 
-  if (objc < minargs) {
-    Tcl_WrongNumArgs(interp, 1, objv, "option ?arg ...?");
-    return TCL_ERROR;
-  }
-
-  if (Tcl_GetIndexFromObj(interp, objv[option_ix], options, "option", TCL_EXACT, &i) == TCL_ERROR)
-    return TCL_ERROR;
-
-  switch (i) {
-  case INFO_CALLOUTS:		/* return list of callout names */
-    table = &client->callouts;
-  list_table_keys:		/* list the keys in a hash table */
-    if (objc != 2) {
-      Tcl_WrongNumArgs(interp,2,objv,"");
+  /* fetch options, up to the first word not starting with - or -- */
+  for (i = name_ix; i < objc; i += 1) {
+    char *arg = Tcl_GetString(objv[i]);
+    if (arg[0] != '-') {
+      break;
+    }
+    if (strcmp(arg, "--") == 0) {
+      i += 1;
+      break;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[i], options, "option", TCL_EXACT, &option) == TCL_ERROR) {
       return TCL_ERROR;
     }
-    for (entry = Tcl_FirstHashEntry(table, &search); entry != NULL; entry = Tcl_NextHashEntry(&search))
-      Tcl_ListObjAppendElement(interp, Tcl_GetObjResult(interp), Tcl_NewStringObj(Tcl_GetHashKey(table,entry),-1));
-    return TCL_OK;
-  case INFO_TYPEDEFS:		/* return list of typedef names */
-    table = &client->types;
-    goto list_table_keys;
-  case INFO_SIGNATURES:		/* return list of ffi signatures */
-    table = &client->cifs;
-    goto list_table_keys;
-  case INFO_LIBRARIES:		/* return list of lib names */
-    table = &client->libs;
-    goto list_table_keys;
-  case INFO_CALLBACKS:		/* return list of callback names */
-#if USE_CALLBACKS
-    table = &client->callbacks;
-    goto list_table_keys;
+    switch (option) {
+    case CALLOUT_ASYNC:
+      /* an integer followed by more words is the number of threads */
+      threads = FFIDL_ASYNC_THREADS;
+      if (i+2 < objc && Tcl_GetIntFromObj(NULL, objv[i+1], &threads) == TCL_OK) {
+	if (threads < 1) {
+	  Tcl_AppendResult(interp, "-async threads must be at least 1", NULL);
+	  return TCL_ERROR;
+	}
+	i += 1;
+      }
+#if TCL_THREADS
+      flags |= FFIDL_CALLOUT_ASYNC;
 #else
-    Tcl_AppendResult(interp, "callbacks are not supported in this configuration", NULL);
-    return TCL_ERROR;
+      Tcl_AppendResult(interp, "-async requires a threaded Tcl", NULL);
+      return TCL_ERROR;
 #endif
+      break;
+    case CALLOUT_MEMOIZE:
+      /* an integer followed by more words is the cache size */
+      memoize = FFIDL_MEMO_SIZE;
+      if (i+2 < objc && Tcl_GetIntFromObj(NULL, objv[i+1], &memoize) == TCL_OK) {
+	if (memoize < 1) {
+	  Tcl_AppendResult(interp, "-memoize size must be at least 1", NULL);
+	  return TCL_ERROR;
+	}
+	i += 1;
+      }
+      break;
+    case CALLOUT_PURE:
+      flags |= FFIDL_CALLOUT_PURE|FFIDL_CALLOUT_THREADSAFE;
+      break;
+    case CALLOUT_RESULTVAR:
+      flags |= FFIDL_CALLOUT_RESULTVAR;
+      break;
+    case CALLOUT_THREADSAFE:
+      flags |= FFIDL_CALLOUT_THREADSAFE;
+      break;
+    }
+  }
+  objc -= i - name_ix;
+  objv += i - name_ix;
+  has_protocol = objc - 1 >= protocol_ix;
 
-  case INFO_SIZEOF:		/* return sizeof type */
-  case INFO_ALIGNOF:		/* return alignof type */
-  case INFO_FORMAT:		/* return binary format of type */
-    if (objc != 3) {
-      Tcl_WrongNumArgs(interp,2,objv,"type");
-      return TCL_ERROR;
+  /* usage check */
+  if (objc != minargs && objc != maxargs) {
+    Tcl_WrongNumArgs(interp, 1, cmdv, "?options? name {?argument_type ...?} return_type address ?protocol?");
+    return TCL_ERROR;
+  }
+  Tcl_DStringInit(&ds);
+  Tcl_DStringInit(&usage);
+  /* fetch name */
+  name = Tcl_GetString(objv[name_ix]);
+  if (!strstr(name, "::")) {
+    Tcl_Namespace *ns;
+    ns = Tcl_GetCurrentNamespace(interp);
+    if (ns != Tcl_GetGlobalNamespace(interp)) {
+      Tcl_DStringAppend(&ds, ns->fullName, -1);
     }
-    arg = Tcl_GetString(objv[2]);
-    type = type_lookup(client, arg);
-    if (type == NULL) {
-      Tcl_AppendResult(interp, "undefined type: ", arg, NULL);
-      return TCL_ERROR;
+    Tcl_DStringAppend(&ds, "::", 2);
+    Tcl_DStringAppend(&ds, name, -1);
+    name = Tcl_DStringValue(&ds);
+  }
+  /* fetch cif */
+  if (cif_parse(interp, client,
+		objv[args_ix],
+		objv[return_ix],
+		has_protocol ? objv[protocol_ix] : NULL,
+		&cif) == TCL_ERROR) {
+    goto error;
+  }
+  if (flags & FFIDL_CALLOUT_ASYNC) {
+    if (flags & FFIDL_CALLOUT_RESULTVAR) {
+      Tcl_AppendResult(interp, "-async and -resultvar are exclusive", NULL);
+      goto error;
     }
-    if (i == INFO_SIZEOF) {
-      Tcl_SetObjResult(interp, Tcl_NewIntObj(type->size));
-      return TCL_OK;
+    if (memoize) {
+      Tcl_AppendResult(interp, "-async and -memoize are exclusive", NULL);
+      goto error;
     }
-    if (i == INFO_ALIGNOF) {
-      Tcl_SetObjResult(interp, Tcl_NewIntObj(type->alignment));
-      return TCL_OK;
+    /* Tcl_Objs cannot be passed between threads */
+    for (i = 0; i < cif->argc; i += 1) {
+      if (cif->atypes[i]->typecode == FFIDL_PTR_OBJ) {
+	break;
+      }
     }
-    if (i == INFO_FORMAT) {
-      size_t offset = 0;
-      return type_format(interp, type, &offset);
+    if (i < cif->argc || cif->rtype->typecode == FFIDL_PTR_OBJ) {
+      Tcl_AppendResult(interp, "-async callouts cannot pass pointer-obj values", NULL);
+      goto error;
     }
-    Tcl_AppendResult(interp, "lost in ::ffidl::info?", NULL);
-    return TCL_ERROR;
-  case INFO_INTERP:
-    /* return the interp as integer */
-    if (objc != 2) {
-      Tcl_WrongNumArgs(interp,2,objv,"");
-      return TCL_ERROR;
+    /* callbacks run Tcl scripts, which must stay in the interp's thread */
+    for (i = 0; i < cif->argc; i += 1) {
+      if (cif->atypes[i]->typecode == FFIDL_PTR_PROC) {
+	Tcl_AppendResult(interp, "-async callouts cannot take pointer-proc arguments", NULL);
+	goto error;
+      }
     }
-    Tcl_SetObjResult(interp, Ffidl_NewPointerObj(interp));
-    return TCL_OK;
-  case INFO_USE_FFCALL:
-  case INFO_USE_LIBFFCALL:
-#if USE_LIBFFCALL
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
-#else
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
-#endif
-    return TCL_OK;
-  case INFO_USE_LIBFFI:
-#if USE_LIBFFI
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
-#else
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+  }
+  if ((flags & FFIDL_CALLOUT_RESULTVAR) && cif->rtype->typecode != FFIDL_STRUCT) {
+    Tcl_AppendResult(interp, "-resultvar requires a struct return type", NULL);
+    goto error;
+  }
+  if (memoize) {
+    if ((flags & FFIDL_CALLOUT_PURE) == 0) {
+      Tcl_AppendResult(interp, "-memoize requires -pure", NULL);
+      goto error;
+    }
+    if (cif->rtype->typecode == FFIDL_PTR_OBJ) {
+      Tcl_AppendResult(interp, "-memoize cannot remember pointer-obj return values", NULL);
+      goto error;
+    }
+    for (i = 0; i < cif->argc; i += 1) {
+      if ( ! MEMO_ARG_OK(cif->atypes[i])) {
+	Tcl_AppendResult(interp, "-memoize requires arguments passed by value", NULL);
+	goto error;
+      }
+    }
+  }
+  /* fetch function pointer */
+  if (Ffidl_GetPointerFromObj(interp, objv[address_ix], (void **)&fn) == TCL_ERROR) {
+    goto error;
+  }
+  /* if callout is already defined, redefine it */
+  if (callout_lookup(client, name)) {
+    Tcl_DeleteCommand(interp, name);
+  }
+  /* build the usage string */
+  if (flags & FFIDL_CALLOUT_RESULTVAR) {
+    Tcl_DStringAppend(&usage, "resultVar", -1);
+  }
+  if (flags & FFIDL_CALLOUT_ASYNC) {
+    Tcl_DStringAppend(&usage, "command", -1);
+  }
+  Tcl_ListObjGetElements(interp, objv[args_ix], &argc, &argv);
+  for (i = 0; i < argc; i += 1) {
+    if (Tcl_DStringLength(&usage) != 0) Tcl_DStringAppend(&usage, " ", 1);
+    Tcl_DStringAppend(&usage, Tcl_GetString(argv[i]), -1);
+  }
+  /* allocate the callout structure, including:
+     - usage string
+     - argument value offsets
+     - argument converters */
+  callout = (ffidl_callout *)Tcl_Alloc(sizeof(ffidl_callout)
+				       +cif->argc*sizeof(ptrdiff_t) /* offsets */
+				       +cif->argc*sizeof(ffidl_arg_converter *) /* converters */
+				       +Tcl_DStringLength(&usage)+1); /* usage */
+  if (callout == NULL) {
+    Tcl_AppendResult(interp, "can't allocate ffidl_callout for: ", name, NULL);
+    goto error;
+  }
+  /* initialize the callout */
+  callout->cif = cif;
+  callout->fn = fn;
+  callout->client = client;
+  callout->flags = flags;
+  callout->frames = NULL;
+  callout->nbound = 0;
+  callout->bound = NULL;
+  callout->bound_values = NULL;
+  callout->memo = NULL;
+  callout->handle = NULL;
+  /* set up argument offsets and converters */
+  callout->offsets = (ptrdiff_t *)(callout+1);
+  callout->converters = (ffidl_arg_converter **)(callout->offsets+cif->argc);
+  /* check return value */
+  if (callout_prep_value(interp, FFIDL_RET, objv[return_ix], cif->rtype) == TCL_ERROR) {
+    goto error;
+  }
+  /* check argument values */
+  for (i = 0; i < argc; i += 1) {
+    if (callout_prep_value(interp, FFIDL_ARG, argv[i], cif->atypes[i]) == TCL_ERROR) {
+      goto error;
+    }
+  }
+  /* select the converters */
+  if (callout_prep(interp, callout) == TCL_ERROR) {
+    goto error;
+  }
+  /* set up usage string */
+  callout->usage = (char *)(callout->converters+cif->argc);
+  strcpy(callout->usage, Tcl_DStringValue(&usage));
+  if (memoize) {
+    callout->memo = memo_new(callout, memoize);
+  }
+#if TCL_THREADS
+  if (flags & FFIDL_CALLOUT_ASYNC) {
+    async_pool_allow(threads);
+  }
 #endif
-    return TCL_OK;
-  case INFO_USE_CALLBACKS:
+  /* free the usage string */
+  Tcl_DStringFree(&usage);
 #if USE_CALLBACKS
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
-#else
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
-#endif
-    return TCL_OK;
-  case INFO_HAVE_LONG_LONG:
-#if HAVE_LONG_LONG
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
-#else
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
-#endif
-    return TCL_OK;
-  case INFO_HAVE_LONG_DOUBLE:
-#if HAVE_LONG_DOUBLE
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
-#else
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
-#endif
-    return TCL_OK;
-  case INFO_USE_LIBFFI_RAW:
-#if USE_LIBFFI_RAW_API
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
-#else
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
-#endif
-    return TCL_OK;
-  case INFO_HAVE_INT64:
-#if HAVE_INT64
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
-#else
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+  /* the callout calling an anonymous callback keeps it alive */
+  if ((callout->handle = callback_handle_lookup(client, objv[address_ix])) != NULL) {
+    callout->handle->refs += 1;
+  }
 #endif
-    return TCL_OK;
-  case INFO_CANONICAL_HOST:
-    Tcl_SetObjResult(interp, Tcl_NewStringObj(CANONICAL_HOST,-1));
-    return TCL_OK;
-  case INFO_NULL:
-    Tcl_SetObjResult(interp, Ffidl_NewPointerObj(NULL));
-    return TCL_OK;
+  /* define the callout */
+  callout_define(client, name, callout);
+  /* create the tcl command */
+  res = Tcl_CreateObjCommand(interp, name, tcl_ffidl_call, (ClientData) callout, callout_delete);
+  Tcl_DStringFree(&ds);
+  return (res ? TCL_OK : TCL_ERROR);
+error:
+  Tcl_DStringFree(&ds);
+  Tcl_DStringFree(&usage);
+  if (callout) {
+    Tcl_Free((void *)callout);
+  }
+  if (cif) {
+    cif_dec_ref(cif);
   }
-  
-  /* return an error */
-  Tcl_AppendResult(interp, "missing option implementation: ", Tcl_GetString(objv[option_ix]), NULL);
   return TCL_ERROR;
 }
 
-/* usage: ffidl::typedef name type1 ?type2 ...? */
-static int tcl_ffidl_typedef(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+/* find the callout defining the command named by obj */
+static int callout_from_command(Tcl_Interp *interp, Tcl_Obj *obj, ffidl_callout **calloutPtr)
+{
+  Tcl_CmdInfo info;
+  if ( ! Tcl_GetCommandInfo(interp, Tcl_GetString(obj), &info) || info.objProc != tcl_ffidl_call) {
+    Tcl_AppendResult(interp, "\"", Tcl_GetString(obj), "\" is not a callout", NULL);
+    return TCL_ERROR;
+  }
+  *calloutPtr = (ffidl_callout *)info.objClientData;
+  return TCL_OK;
+}
+
+/* usage: ffidl::curry name callout ?arg ...? -> */
+static int tcl_ffidl_curry(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
   enum {
     command_ix,
     name_ix,
-    type_ix,
-    minargs
+    callout_ix,
+    args_ix,
+    minargs = callout_ix + 1
   };
 
-  char *tname1, *tname2;
-  ffidl_type *newtype, *ttype2;
-  int nelts, i;
+  char *name;
+  int i, nbound;
+  Tcl_DString usage, ds;
+  Tcl_Command res;
+  ffidl_callout *parent, *callout = NULL;
   ffidl_client *client = (ffidl_client *)clientData;
+  ffidl_cif *cif;
 
-  /* check number of args */
+  /* usage check */
   if (objc < minargs) {
-    Tcl_WrongNumArgs(interp,1,objv,"name type ?...?");
+    Tcl_WrongNumArgs(interp, 1, objv, "name callout ?arg ...?");
     return TCL_ERROR;
   }
-  /* fetch new type name, verify that it is new */
-  tname1 = Tcl_GetString(objv[name_ix]);
-  if (type_lookup(client, tname1) != NULL) {
-    Tcl_AppendResult(interp, "type is already defined: ", tname1, NULL);
+  /* fetch the callout to bind arguments of */
+  if (callout_from_command(interp, objv[callout_ix], &parent) == TCL_ERROR) {
     return TCL_ERROR;
   }
-  nelts = objc - 2;
-  if (nelts == 1) {
-    /* define tname1 as an alias for tname2 */
-    tname2 = Tcl_GetString(objv[type_ix]);
-    ttype2 = type_lookup(client, tname2);
-    if (ttype2 == NULL) {
-      Tcl_AppendResult(interp, "undefined type: ", tname2, NULL);
+  cif = parent->cif;
+  nbound = parent->nbound + objc - args_ix;
+  if (nbound > cif->argc) {
+    Tcl_AppendResult(interp, "too many arguments to bind to \"", Tcl_GetString(objv[callout_ix]), "\"", NULL);
+    return TCL_ERROR;
+  }
+  Tcl_DStringInit(&ds);
+  Tcl_DStringInit(&usage);
+  /* fetch name */
+  name = Tcl_GetString(objv[name_ix]);
+  if (!strstr(name, "::")) {
+    Tcl_Namespace *ns;
+    ns = Tcl_GetCurrentNamespace(interp);
+    if (ns != Tcl_GetGlobalNamespace(interp)) {
+      Tcl_DStringAppend(&ds, ns->fullName, -1);
+    }
+    Tcl_DStringAppend(&ds, "::", 2);
+    Tcl_DStringAppend(&ds, name, -1);
+    name = Tcl_DStringValue(&ds);
+  }
+  /* build the usage string from the cif's argument type names, leaving
+     out the bound ones */
+  if (parent->flags & FFIDL_CALLOUT_RESULTVAR) {
+    Tcl_DStringAppend(&usage, "resultVar", -1);
+  }
+  if (parent->flags & FFIDL_CALLOUT_ASYNC) {
+    Tcl_DStringAppend(&usage, "command", -1);
+  }
+  for (i = nbound; i < cif->argc; i += 1) {
+    if (Tcl_DStringLength(&usage) != 0) Tcl_DStringAppend(&usage, " ", 1);
+    Tcl_DStringAppend(&usage, cif->anames[i], -1);
+  }
+  /* allocate the callout structure, as ffidl::callout does, and its bound
+     argument values */
+  callout = (ffidl_callout *)Tcl_Alloc(sizeof(ffidl_callout)
+				       +cif->argc*sizeof(ptrdiff_t) /* offsets */
+				       +cif->argc*sizeof(ffidl_arg_converter *) /* converters */
+				       +Tcl_DStringLength(&usage)+1); /* usage */
+  callout->cif = cif;
+  callout->fn = parent->fn;
+  callout->client = client;
+  callout->flags = parent->flags;
+  callout->frames = NULL;
+  callout->offsets = (ptrdiff_t *)(callout+1);
+  callout->converters = (ffidl_arg_converter **)(callout->offsets+cif->argc);
+  callout->usage = (char *)(callout->converters+cif->argc);
+  strcpy(callout->usage, Tcl_DStringValue(&usage));
+  callout->nbound = 0;
+  callout->bound_values = (ffidl_value *)Tcl_Alloc(cif->argc*sizeof(ffidl_value)
+						   +nbound*sizeof(Tcl_Obj *));
+  callout->bound = (Tcl_Obj **)(callout->bound_values+cif->argc);
+  callout->memo = NULL;
+  callout->handle = parent->handle;
+#if USE_JIT
+  callout->jit_code = NULL;
+  callout->jit_page = NULL;
+#endif
+  if (callout_prep(interp, callout) == TCL_ERROR) {
+    goto error;
+  }
+  /* bind the arguments, converting ahead those which allow it */
+  for (i = 0; i < nbound; i += 1) {
+    Tcl_Obj *obj = i < parent->nbound ? parent->bound[i] : objv[args_ix+i-parent->nbound];
+    if (CALLOUT_BIND_AHEAD(cif->atypes[i])) {
+      void *arg = (char *)callout->bound_values + callout->offsets[i];
+      if (callout->converters[i](interp, callout, i, obj, &arg) != TCL_OK) {
+	goto error;
+      }
+    }
+    Tcl_IncrRefCount(obj);
+    callout->bound[i] = obj;
+    callout->nbound += 1;
+  }
+  cif_inc_ref(cif);
+  if (parent->memo) {
+    callout->memo = memo_new(callout, parent->memo->size);
+  }
+  if (callout->handle) {
+    callout->handle->refs += 1;
+  }
+  /* if callout is already defined, redefine it */
+  if (callout_lookup(client, name)) {
+    Tcl_DeleteCommand(interp, name);
+  }
+  /* define the callout */
+  callout_define(client, name, callout);
+  /* create the tcl command */
+  res = Tcl_CreateObjCommand(interp, name, tcl_ffidl_call, (ClientData) callout, callout_delete);
+  Tcl_DStringFree(&ds);
+  Tcl_DStringFree(&usage);
+  return (res ? TCL_OK : TCL_ERROR);
+error:
+  Tcl_DStringFree(&ds);
+  Tcl_DStringFree(&usage);
+  for (i = 0; i < callout->nbound; i += 1) {
+    Tcl_DecrRefCount(callout->bound[i]);
+  }
+#if USE_JIT
+  jit_free(callout);
+#endif
+  Tcl_Free((void *)callout->bound_values);
+  Tcl_Free((void *)callout);
+  return TCL_ERROR;
+}
+
+/* usage: ffidl::batch ?-packed? name {?{?arg ...?} ...?} -> results */
+static int tcl_ffidl_batch(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  enum {
+    command_ix,
+    name_ix,
+    lists_ix,
+    minargs = lists_ix + 1,
+    maxargs = minargs + 1
+  };
+
+  char buff[128];
+  int i, k, n, argc, option, packed = 0, skip = 0;
+  Tcl_Obj **lists, **argv, *obj, *results = NULL;
+  unsigned char *bytes = NULL;
+  ffidl_callout *callout;
+  ffidl_cif *cif;
+  ffidl_frame *frame, stackFrame;
+  void *stackArgs[FFIDL_FRAME_ARGS];
+  ffidl_value stackValues[FFIDL_FRAME_ARGS];
+  static const char *options[] = {
+#define BATCH_PACKED 0
+    "-packed",
+    NULL
+  };
+
+  /* usage check */
+  if (objc != minargs && objc != maxargs) {
+    Tcl_WrongNumArgs(interp, 1, objv, "?-packed? name argLists");
+    return TCL_ERROR;
+  }
+  if (objc == maxargs) {
+    if (Tcl_GetIndexFromObj(interp, objv[name_ix], options, "option", TCL_EXACT, &option) == TCL_ERROR) {
       return TCL_ERROR;
     }
-    /* define alias */
-    type_define(client, tname1, ttype2);
-    type_inc_ref(ttype2);
+    packed = 1;
+    skip = 1;
+  }
+  /* fetch callout */
+  if (callout_from_command(interp, objv[skip+name_ix], &callout) == TCL_ERROR) {
+    return TCL_ERROR;
+  }
+  cif = callout->cif;
+  if (callout->flags & FFIDL_CALLOUT_RESULTVAR) {
+    Tcl_AppendResult(interp, "cannot batch a -resultvar callout", NULL);
+    return TCL_ERROR;
+  }
+  if (callout->flags & FFIDL_CALLOUT_ASYNC) {
+    Tcl_AppendResult(interp, "cannot batch an -async callout", NULL);
+    return TCL_ERROR;
+  }
+  if (packed && cif->rtype->typecode == FFIDL_PTR_OBJ) {
+    Tcl_AppendResult(interp, "cannot pack pointer-obj return values", NULL);
+    return TCL_ERROR;
+  }
+  /* fetch argument lists */
+  obj = objv[skip+lists_ix];
+  if (Tcl_ListObjGetElements(interp, obj, &n, &lists) == TCL_ERROR) {
+    return TCL_ERROR;
+  }
+  Tcl_IncrRefCount(obj);
+  /* prepare results */
+  if (packed) {
+    results = Tcl_NewByteArrayObj(NULL, 0);
+    if (cif->rtype->typecode != FFIDL_VOID) {
+      bytes = Tcl_SetByteArrayLength(results, n * cif->rtype->size);
+    }
   } else {
-    /* allocate an aggregate type */
-    newtype = type_alloc(client, nelts);
-    if (newtype == NULL) {
-      Tcl_AppendResult(interp, "couldn't allocate the ffi_type", NULL);
+    results = Tcl_NewListObj(0, NULL);
+  }
+  Tcl_IncrRefCount(results);
+  frame = callout_frame_get(callout, &stackFrame, stackArgs, stackValues);
+  if (callout->nbound && callout_bind(interp, callout, frame) != TCL_OK) {
+    goto error;
+  }
+  for (k = 0; k < n; k += 1) {
+    /* fetch and convert argument values */
+    if (Tcl_ListObjGetElements(interp, lists[k], &argc, &argv) == TCL_ERROR) {
+      goto error;
+    }
+    if (argc != cif->argc-callout->nbound) {
+      sprintf(buff, "wrong # args in argument list %d: should be \"", k);
+      Tcl_AppendResult(interp, buff, Tcl_GetString(objv[skip+name_ix]),
+		       callout->usage[0] ? " " : "", callout->usage, "\"", NULL);
+      goto error;
+    }
+    for (i = callout->nbound; i < cif->argc; i += 1) {
+      if (callout->converters[i](interp, callout, i, argv[i-callout->nbound], &frame->args[i]) != TCL_OK) {
+	sprintf(buff, ", in argument list %d", k);
+	Tcl_AppendResult(interp, buff, NULL);
+	goto error;
+      }
+    }
+    /* prepare for structure return */
+    if (cif->rtype->typecode == FFIDL_STRUCT) {
+      if (packed) {
+	frame->ret = bytes + k * cif->rtype->size;
+      } else {
+	obj = Tcl_NewByteArrayObj(NULL, 0);
+	frame->ret = Tcl_SetByteArrayLength(obj, cif->rtype->size);
+      }
+    }
+    /* call */
+    if (callout->memo) {
+      memo_call(callout, frame->args, frame->ret);
+    } else {
+      callout_call(callout, frame->args, frame->ret);
+    }
+    /* collect return value */
+    if (packed) {
+      callout_ret_pack(cif->rtype, bytes + k * cif->rtype->size, frame->ret);
+    } else if (callout->ret_converter) {
+      Tcl_ListObjAppendElement(NULL, results, callout->ret_converter(NULL, frame->ret));
+    } else if (cif->rtype->typecode == FFIDL_STRUCT) {
+      Tcl_ListObjAppendElement(NULL, results, obj);
+    }
+  }
+  callout_frame_release(callout, frame);
+  Tcl_DecrRefCount(objv[skip+lists_ix]);
+  Tcl_SetObjResult(interp, results);
+  Tcl_DecrRefCount(results);
+  return TCL_OK;
+error:
+  callout_frame_release(callout, frame);
+  Tcl_DecrRefCount(objv[skip+lists_ix]);
+  Tcl_DecrRefCount(results);
+  return TCL_ERROR;
+}
+
+/*
+ * Make the calls k, from <= k < to, of a map into the results, using frame
+ * for the argument values.
+ */
+static void map_run(ffidl_map *map, ffidl_frame *frame, int from, int to)
+{
+  ffidl_callout *callout = map->callout;
+  ffidl_cif *cif = callout->cif;
+  ffidl_type *rtype = cif->rtype;
+  int i, j, k, size, osize = map->otype->size;
+
+  for (k = from; k < to; k += 1) {
+    /* copy in this call's packed argument values */
+    for (j = 0; j < map->npacked; j += 1) {
+      i = map->packed[j];
+      size = cif->atypes[i]->size;
+      if (callout->offsets[i] < 0) {
+	frame->args[i] = map->data[j] + k * size;
+      } else if (cif->atypes[i]->typecode == FFIDL_STRUCT) {
+	/* a raw slot */
+	*(void **)frame->args[i] = map->data[j] + k * size;
+      } else {
+	memcpy(frame->args[i], map->data[j] + k * size, size);
+      }
+    }
+    if (rtype->typecode == FFIDL_STRUCT) {
+      frame->ret = map->out + k * osize;
+    }
+    callout_call(callout, frame->args, frame->ret);
+    if (rtype->typecode != FFIDL_STRUCT && osize != 0) {
+      callout_ret_convert(map->otype, map->out + k * osize, rtype, frame->ret);
+    }
+  }
+}
+
+/*
+ * Prepare a map of the callout over the argument values in objv: convert
+ * the broadcast arguments into frame and find the packed ones.  The packed
+ * arguments are those whose indices are listed in packedObj or, when it is
+ * NULL, all those whose type can be an element of a structure.  The map
+ * must be given back with map_free().
+ */
+static int map_prep(Tcl_Interp *interp, ffidl_map *map, ffidl_frame *frame, Tcl_Obj *packedObj, Tcl_Obj *CONST objv[])
+{
+  ffidl_callout *callout = map->callout;
+  ffidl_cif *cif = callout->cif;
+  ffidl_type *type;
+  Tcl_Obj **indices;
+  char buff[128], *ispacked;
+  int i, k, n, len, nindices;
+
+  map->n = -1;
+  map->npacked = 0;
+  map->data = (unsigned char **)Tcl_Alloc(cif->argc * (sizeof(unsigned char *) + sizeof(int) + 1) + 1);
+  map->packed = (int *)(map->data + cif->argc);
+  ispacked = (char *)(map->packed + cif->argc);
+  /* choose the packed arguments */
+  for (i = 0; i < cif->argc; i += 1) {
+    ispacked[i] = packedObj == NULL && i >= callout->nbound && (cif->atypes[i]->class & FFIDL_ELT) != 0;
+  }
+  if (packedObj != NULL) {
+    if (Tcl_ListObjGetElements(interp, packedObj, &nindices, &indices) == TCL_ERROR) {
       return TCL_ERROR;
     }
-    /* parse aggregate types */
-    newtype->size = 0;
-    newtype->alignment = 0;
-    for (i = 0; i < nelts; i += 1) {
-      tname2 = Tcl_GetString(objv[type_ix+i]);
-      ttype2 = type_lookup(client, tname2);
-      if (ttype2 == NULL) {
-	type_free(newtype);
-	Tcl_AppendResult(interp, "undefined element type: ", tname2, NULL);
+    for (k = 0; k < nindices; k += 1) {
+      if (Tcl_GetIntFromObj(interp, indices[k], &i) == TCL_ERROR) {
 	return TCL_ERROR;
       }
-      if ((ttype2->class & FFIDL_ELT) == 0) {
-	type_free(newtype);
-	Tcl_AppendResult(interp, "type ", tname2, " is not permitted in element context", NULL);
+      if (i < 0 || i >= cif->argc - callout->nbound) {
+	sprintf(buff, "packed argument index %d is out of range", i);
+	Tcl_AppendResult(interp, buff, NULL);
 	return TCL_ERROR;
       }
-      newtype->elements[i] = ttype2;
-      /* accumulate the aggregate size and alignment */
-      /* align current size to element's alignment */
-      if ((ttype2->alignment-1) & newtype->size) {
-	newtype->size = ((newtype->size-1) | (ttype2->alignment-1)) + 1;
+      if ((cif->atypes[i+callout->nbound]->class & FFIDL_ELT) == 0) {
+	sprintf(buff, "argument %d cannot be packed", i);
+	Tcl_AppendResult(interp, buff, NULL);
+	return TCL_ERROR;
       }
-      /* add the element's size */
-      newtype->size += ttype2->size;
-      /* bump the aggregate alignment as required */
-      if (ttype2->alignment > newtype->alignment) {
-	newtype->alignment = ttype2->alignment;
+      ispacked[i+callout->nbound] = 1;
+    }
+  }
+  if (callout->nbound && callout_bind(interp, callout, frame) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  objv -= callout->nbound;
+  for (i = callout->nbound; i < cif->argc; i += 1) {
+    type = cif->atypes[i];
+    if ( ! ispacked[i]) {
+      if (callout->converters[i](interp, callout, i, objv[i], &frame->args[i]) != TCL_OK) {
+	return TCL_ERROR;
       }
+      continue;
+    }
+    map->data[map->npacked] = Tcl_GetByteArrayFromObj(objv[i], &len);
+    map->packed[map->npacked] = i;
+    map->npacked += 1;
+    n = len / type->size;
+    if (len != n * type->size) {
+      sprintf(buff, "length of packed argument %d is not a multiple of %d", i-callout->nbound, (int)type->size);
+      Tcl_AppendResult(interp, buff, NULL);
+      return TCL_ERROR;
     }
-    newtype->size = ((newtype->size-1) | (newtype->alignment-1)) + 1; /* tail padding as in libffi */
-    if (type_prep(newtype) != TCL_OK) {
-      type_free(newtype);
-      Tcl_AppendResult(interp, "type definition error", NULL);
+    if (map->n >= 0 && n != map->n) {
+      Tcl_AppendResult(interp, "packed arguments have different lengths", NULL);
       return TCL_ERROR;
     }
-    /* define new type */
-    type_define(client, tname1, newtype);
-    type_inc_ref(newtype);
+    map->n = n;
+  }
+  /* only broadcast arguments: a single call */
+  if (map->n < 0) {
+    map->n = 1;
   }
-  /* return success */
   return TCL_OK;
 }
 
-/* usage: depends on the signature defining the ffidl::callout */
-static int tcl_ffidl_call(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+static void map_free(ffidl_map *map)
+{
+  Tcl_Free((char *)map->data);
+}
+
+#if TCL_THREADS
+static Tcl_ThreadCreateType map_pool_worker(ClientData clientData)
+{
+  ffidl_map_task *task;
+
+  Tcl_MutexLock(&map_pool_mutex);
+  for (;;) {
+    while (map_pool_queue == NULL && !map_pool_exiting) {
+      Tcl_ConditionWait(&map_pool_work, &map_pool_mutex, NULL);
+    }
+    if (map_pool_queue == NULL) {
+      break;
+    }
+    task = map_pool_queue;
+    map_pool_queue = task->next;
+    Tcl_MutexUnlock(&map_pool_mutex);
+    map_run(task->map, task->frame, task->from, task->to);
+    Tcl_MutexLock(&map_pool_mutex);
+    if (--*task->pending == 0) {
+      Tcl_ConditionNotify(&map_pool_done);
+    }
+  }
+  Tcl_MutexUnlock(&map_pool_mutex);
+  TCL_THREAD_CREATE_RETURN;
+}
+
+/* stop and join the workers when the process exits */
+static void map_pool_exit(ClientData clientData)
+{
+  int i, result;
+
+  Tcl_MutexLock(&map_pool_mutex);
+  map_pool_exiting = 1;
+  Tcl_ConditionNotify(&map_pool_work);
+  Tcl_MutexUnlock(&map_pool_mutex);
+  for (i = 0; i < map_pool_size; i += 1) {
+    Tcl_JoinThread(map_pool_threads[i], &result);
+  }
+  map_pool_size = 0;
+  map_pool_exiting = 0;
+}
+
+/*
+ * Start workers until there are n of them, must hold map_pool_mutex.  Fewer
+ * may be started when thread creation fails.
+ */
+static void map_pool_grow(int n)
+{
+  if (n > FFIDL_MAP_MAXTHREADS) {
+    n = FFIDL_MAP_MAXTHREADS;
+  }
+  while (map_pool_size < n) {
+    if (Tcl_CreateThread(&map_pool_threads[map_pool_size], map_pool_worker, NULL,
+			 TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK) {
+      break;
+    }
+    if (map_pool_size == 0) {
+      Tcl_CreateExitHandler(map_pool_exit, NULL);
+    }
+    map_pool_size += 1;
+  }
+}
+
+/*
+ * Run the calls of a map in nchunks chunks, one on the calling thread with
+ * frame and the others on the pool's workers, each with a copy of frame.
+ */
+static void map_run_parallel(ffidl_map *map, ffidl_frame *frame, int nchunks)
+{
+  ffidl_callout *callout = map->callout;
+  int argc = callout->cif->argc;
+  int c, i, size = (map->n + nchunks - 1) / nchunks, pending;
+  ffidl_map_task *tasks;
+  ffidl_frame *frames;
+  ffidl_value *values;
+  void **args;
+
+  nchunks = (map->n + size - 1) / size;
+  pending = nchunks - 1;
+  /* one block holds the tasks, then their frames, values and args */
+  tasks = (ffidl_map_task *)Tcl_Alloc(pending * (sizeof(ffidl_map_task)
+						+sizeof(ffidl_frame)
+						+argc*sizeof(ffidl_value)
+						+argc*sizeof(void *)));
+  frames = (ffidl_frame *)(tasks+pending);
+  values = (ffidl_value *)(frames+pending);
+  args = (void **)(values+pending*argc);
+  for (c = 0; c < pending; c += 1) {
+    ffidl_frame *f = &frames[c];
+    f->next = NULL;
+    f->values = values + c*argc;
+    f->args = args + c*argc;
+    memcpy(f->values, frame->values, argc*sizeof(ffidl_value));
+    for (i = 0; i < argc; i += 1) {
+      f->args[i] = callout->offsets[i] < 0 ? frame->args[i] : (char *)f->values + callout->offsets[i];
+    }
+    f->ret = frame->ret == NULL ? NULL : (void *)&f->rvalue;
+    tasks[c].map = map;
+    tasks[c].frame = f;
+    tasks[c].from = (c+1) * size;
+    tasks[c].to = (c+2) * size < map->n ? (c+2) * size : map->n;
+    tasks[c].pending = &pending;
+  }
+  /* queue the tasks, run the first chunk here, and wait for the others */
+  Tcl_MutexLock(&map_pool_mutex);
+  map_pool_grow(pending);
+  for (c = pending-1; c >= 0; c -= 1) {
+    tasks[c].next = map_pool_queue;
+    map_pool_queue = &tasks[c];
+  }
+  Tcl_ConditionNotify(&map_pool_work);
+  Tcl_MutexUnlock(&map_pool_mutex);
+  map_run(map, frame, 0, size);
+  /* run the tasks no worker has taken yet here too, so the map completes
+     even when fewer workers could be started than there are chunks */
+  Tcl_MutexLock(&map_pool_mutex);
+  for (;;) {
+    ffidl_map_task **taskp = &map_pool_queue, *task;
+    while (*taskp != NULL && (*taskp)->map != map) {
+      taskp = &(*taskp)->next;
+    }
+    if (*taskp == NULL) {
+      break;
+    }
+    task = *taskp;
+    *taskp = task->next;
+    Tcl_MutexUnlock(&map_pool_mutex);
+    map_run(map, task->frame, task->from, task->to);
+    Tcl_MutexLock(&map_pool_mutex);
+    pending -= 1;
+  }
+  while (pending > 0) {
+    Tcl_ConditionWait(&map_pool_done, &map_pool_mutex, NULL);
+  }
+  Tcl_MutexUnlock(&map_pool_mutex);
+  Tcl_Free((char *)tasks);
+}
+#endif
+
+/* shared implementation of ::ffidl::map and ::ffidl::parallel-map */
+static int map_command(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], int parallel)
 {
   enum {
     command_ix,
+    name_ix,
     args_ix,
-    minargs = args_ix
+    minargs = name_ix + 1
   };
 
-  ffidl_callout *callout = (ffidl_callout *)clientData;
-  ffidl_cif *cif = callout->cif;
-  int i, itmp;
-  Tcl_Obj *obj = NULL;
-  char buff[128];
-  ffidl_tclobj_value obj_value = {0};
+  ffidl_client *client = (ffidl_client *)clientData;
+  int i, argsIx, threads = FFIDL_MAP_THREADS;
+  Tcl_Obj *results, *otypeObj = NULL, *packedObj = NULL;
+  ffidl_callout *callout;
+  ffidl_cif *cif;
+  ffidl_map map;
+  ffidl_frame *frame, stackFrame;
+  void *stackArgs[FFIDL_FRAME_ARGS];
+  ffidl_value stackValues[FFIDL_FRAME_ARGS];
+  const char *options = parallel ? " ?-out type? ?-packed indices? ?-threads n?" : " ?-out type? ?-packed indices?";
 
   /* usage check */
-  if (objc-args_ix != cif->argc) {
-    Tcl_WrongNumArgs(interp, 1, objv, callout->usage);
+  if (objc < minargs) {
+    Tcl_AppendResult(interp, "wrong # args: should be \"", Tcl_GetString(objv[command_ix]),
+		     " name", options, " ?arg ...?\"", NULL);
     return TCL_ERROR;
   }
-  /* fetch and convert argument values */
-  for (i = 0; i < cif->argc; i += 1) {
-    /* fetch object */
-    obj = objv[args_ix+i];
-    /* fetch value from object and store value into arg value array */
-    if (TCL_OK != value_convert_to_c(interp, cif->atypes[i], obj, &obj_value)) {
-      Tcl_AppendResult(interp, ", converting callout argument value", NULL);
-      goto cleanup;
-    }
-    switch (cif->atypes[i]->typecode) {
-    case FFIDL_INT:
-      *(int *)callout->args[i] = (int)obj_value.v_long;
-      continue;
-    case FFIDL_FLOAT:
-      *(float *)callout->args[i] = (float)obj_value.v_double;
-      continue;
-    case FFIDL_DOUBLE:
-      *(double *)callout->args[i] = (double)obj_value.v_double;
-      continue;
-#if HAVE_LONG_DOUBLE
-    case FFIDL_LONGDOUBLE:
-      *(long double *)callout->args[i] = (long double)obj_value.v_double;
-      continue;
-#endif
-    case FFIDL_UINT8:
-      *(UINT8_T *)callout->args[i] = (UINT8_T)obj_value.v_long;
-      continue;
-    case FFIDL_SINT8:
-      *(SINT8_T *)callout->args[i] = (SINT8_T)obj_value.v_long;
-      continue;
-    case FFIDL_UINT16:
-      *(UINT16_T *)callout->args[i] = (UINT16_T)obj_value.v_long;
-      continue;
-    case FFIDL_SINT16:
-      *(SINT16_T *)callout->args[i] = (SINT16_T)obj_value.v_long;
-      continue;
-    case FFIDL_UINT32:
-      *(UINT32_T *)callout->args[i] = (UINT32_T)obj_value.v_long;
-      continue;
-    case FFIDL_SINT32:
-      *(SINT32_T *)callout->args[i] = (SINT32_T)obj_value.v_long;
-      continue;
-#if HAVE_INT64
-    case FFIDL_UINT64:
-      *(UINT64_T *)callout->args[i] = (UINT64_T)obj_value.v_wideint;
-      continue;
-    case FFIDL_SINT64:
-      *(SINT64_T *)callout->args[i] = (SINT64_T)obj_value.v_wideint;
-      continue;
-#endif
-    case FFIDL_STRUCT:
-      if (obj->typePtr != ffidl_bytearray_ObjType) {
-	sprintf(buff, "parameter %d must be a binary string", i);
-	Tcl_AppendResult(interp, buff, NULL);
-	goto cleanup;
-      }
-      callout->args[i] = (void *)Tcl_GetByteArrayFromObj(obj, &itmp);
-      if (itmp != cif->atypes[i]->size) {
-	sprintf(buff, "parameter %d is the wrong size, %u bytes instead of %lu.", i, itmp, (long)(cif->atypes[i]->size));
-	Tcl_AppendResult(interp, buff, NULL);
-	goto cleanup;
-      }
-      continue;
-    case FFIDL_PTR:
-#if FFIDL_POINTER_IS_LONG
-      *(void **)callout->args[i] = (void *)obj_value.v_long;
-#else
-      *(void **)callout->args[i] = (void *)obj_value.v_wideint;
-#endif
-      continue;
-    case FFIDL_PTR_OBJ:
-      *(void **)callout->args[i] = (void *)obj;
-      continue;
-    case FFIDL_PTR_UTF8:
-      *(void **)callout->args[i] = (void *)Tcl_GetString(obj);
-      continue;
-    case FFIDL_PTR_UTF16:
-      *(void **)callout->args[i] = (void *)Tcl_GetUnicode(obj);
-      continue;
-    case FFIDL_PTR_BYTE:
-      if (obj->typePtr != ffidl_bytearray_ObjType) {
-	sprintf(buff, "parameter %d must be a binary string", i);
-	Tcl_AppendResult(interp, buff, NULL);
-	goto cleanup;
+  /* fetch callout */
+  if (callout_from_command(interp, objv[name_ix], &callout) == TCL_ERROR) {
+    return TCL_ERROR;
+  }
+  cif = callout->cif;
+  map.callout = callout;
+  map.otype = cif->rtype;
+  if (callout->flags & FFIDL_CALLOUT_RESULTVAR) {
+    Tcl_AppendResult(interp, "cannot map a -resultvar callout", NULL);
+    return TCL_ERROR;
+  }
+  if (callout->flags & FFIDL_CALLOUT_ASYNC) {
+    Tcl_AppendResult(interp, "cannot map an -async callout", NULL);
+    return TCL_ERROR;
+  }
+  if (parallel && (callout->flags & FFIDL_CALLOUT_THREADSAFE) == 0) {
+    Tcl_AppendResult(interp, "callout \"", Tcl_GetString(objv[name_ix]),
+		     "\" is not declared -threadsafe", NULL);
+    return TCL_ERROR;
+  }
+  /* fetch options, only while there are more words than arguments, so the
+     string of a packed argument is never made */
+  for (argsIx = args_ix; argsIx+1 < objc && objc-argsIx > cif->argc-callout->nbound; argsIx += 2) {
+    char *arg = Tcl_GetString(objv[argsIx]);
+    if (strcmp(arg, "-out") == 0) {
+      otypeObj = objv[argsIx+1];
+    } else if (strcmp(arg, "-packed") == 0) {
+      packedObj = objv[argsIx+1];
+    } else if (parallel && strcmp(arg, "-threads") == 0) {
+      if (Tcl_GetIntFromObj(interp, objv[argsIx+1], &threads) == TCL_ERROR) {
+	return TCL_ERROR;
       }
-      *(void **)callout->args[i] = (void *)Tcl_GetByteArrayFromObj(obj, &itmp);
-      continue;
-    case FFIDL_PTR_VAR:
-      obj = Tcl_ObjGetVar2(interp, obj, NULL, TCL_LEAVE_ERR_MSG);
-      if (obj == NULL) return TCL_ERROR;
-      if (obj->typePtr != ffidl_bytearray_ObjType) {
-	sprintf(buff, "parameter %d must be a binary string", i);
-	Tcl_AppendResult(interp, buff, NULL);
-	goto cleanup;
+      if (threads < 1) {
+	Tcl_AppendResult(interp, "-threads must be at least 1", NULL);
+	return TCL_ERROR;
       }
-      if (Tcl_IsShared(obj)) {
-	obj = Tcl_ObjSetVar2(interp, obj, NULL, Tcl_DuplicateObj(obj), TCL_LEAVE_ERR_MSG);
-	if (obj == NULL) {
-	  goto cleanup;
-	}
+    } else {
+      break;
+    }
+  }
+  /* fetch the results type */
+  if (otypeObj) {
+    if (cif_type_parse(interp, client, otypeObj, &map.otype) == TCL_ERROR) {
+      return TCL_ERROR;
+    }
+    if (cif->rtype->typecode == FFIDL_VOID || cif->rtype->typecode == FFIDL_STRUCT) {
+      if (map.otype != cif->rtype) {
+	Tcl_AppendResult(interp, "cannot convert return type to ", Tcl_GetString(otypeObj), NULL);
+	return TCL_ERROR;
       }
-      *(void **)callout->args[i] = (void *)Tcl_GetByteArrayFromObj(obj, &itmp);
-      /* printf("pointer-var -> %d\n", cif->avalues[i].v_pointer); */
-      Tcl_InvalidateStringRep(obj);
-      continue;
-#if USE_CALLBACKS
-    case FFIDL_PTR_PROC: {
-      ffidl_callback *callback;
-      ffidl_closure *closure;
-      Tcl_DString ds;
-      char *name = Tcl_GetString(obj);
-      Tcl_DStringInit(&ds);
-      if (!strstr(name, "::")) {
-        Tcl_Namespace *ns;
-        ns = Tcl_GetCurrentNamespace(interp);
-        if (ns != Tcl_GetGlobalNamespace(interp)) {
-          Tcl_DStringAppend(&ds, ns->fullName, -1);
-        }
-        Tcl_DStringAppend(&ds, "::", 2);
-        Tcl_DStringAppend(&ds, name, -1);
-        name = Tcl_DStringValue(&ds);
-      }
-      callback = callback_lookup(callout->client, name);
-      Tcl_DStringFree(&ds);
-      if (callback == NULL) {
-	Tcl_AppendResult(interp, "no callback named \"", Tcl_GetString(obj), "\" is defined", NULL);
-	goto cleanup;
-      }
-      closure = &(callback->closure);
-#if USE_LIBFFI
-      *(void **)callout->args[i] = (void *)closure->executable;
-#elif USE_LIBFFCALL
-      *(void **)callout->args[i] = (void *)closure->lib_closure;
-#endif
+    } else if ((map.otype->class & FFIDL_ELT) == 0 || map.otype->typecode == FFIDL_STRUCT) {
+      Tcl_AppendResult(interp, "type ", Tcl_GetString(otypeObj), " cannot hold packed results", NULL);
+      return TCL_ERROR;
     }
-    continue;
-#endif
-    default:
-      sprintf(buff, "unknown type for argument: %d", cif->atypes[i]->typecode);
-      Tcl_AppendResult(interp, buff, NULL);
-      goto cleanup;
+  }
+  if (map.otype->typecode == FFIDL_PTR_OBJ) {
+    Tcl_AppendResult(interp, "cannot pack pointer-obj return values", NULL);
+    return TCL_ERROR;
+  }
+  if (objc-argsIx != cif->argc-callout->nbound) {
+    Tcl_AppendResult(interp, "wrong # args: should be \"", Tcl_GetString(objv[command_ix]), " ",
+		     Tcl_GetString(objv[name_ix]), options, callout->usage[0] ? " " : "",
+		     callout->usage, "\"", NULL);
+    return TCL_ERROR;
+  }
+  if (parallel) {
+    /* callbacks run Tcl scripts, which must stay in the interp's thread */
+    for (i = 0; i < cif->argc; i += 1) {
+      if (cif->atypes[i]->typecode == FFIDL_PTR_PROC) {
+	Tcl_AppendResult(interp, "cannot map a callout taking pointer-proc arguments in parallel", NULL);
+	return TCL_ERROR;
+      }
     }
-    /* Note: change "continue" to "break" if further work must be done here. */
   }
-  /* prepare for structure return */
-  if (cif->rtype->typecode == FFIDL_STRUCT) {
-    obj = Tcl_NewByteArrayObj(NULL, 0);
-    Tcl_SetByteArrayLength(obj, cif->rtype->size);
-    Tcl_IncrRefCount(obj);
-    callout->ret = Tcl_GetByteArrayFromObj(obj, &itmp);
+  frame = callout_frame_get(callout, &stackFrame, stackArgs, stackValues);
+  if (map_prep(interp, &map, frame, packedObj, objv+argsIx) == TCL_ERROR) {
+    map_free(&map);
+    callout_frame_release(callout, frame);
+    return TCL_ERROR;
   }
-  /* call */
-  callout_call(callout);
-  /* convert return value */
-  switch (cif->rtype->typecode) {
-  case FFIDL_VOID:	break;
-  case FFIDL_INT:	Tcl_SetObjResult(interp, Tcl_NewLongObj((long)FFIDL_RVALUE_PEEK_UNWIDEN(INT, callout->ret))); break;
-  case FFIDL_FLOAT:	Tcl_SetObjResult(interp, Tcl_NewDoubleObj((double)FFIDL_RVALUE_PEEK_UNWIDEN(FLOAT, callout->ret))); break;
-  case FFIDL_DOUBLE:	Tcl_SetObjResult(interp, Tcl_NewDoubleObj((double)FFIDL_RVALUE_PEEK_UNWIDEN(DOUBLE, callout->ret))); break;
-#if HAVE_LONG_DOUBLE
-  case FFIDL_LONGDOUBLE:Tcl_SetObjResult(interp, Tcl_NewDoubleObj((double)FFIDL_RVALUE_PEEK_UNWIDEN(LONGDOUBLE, callout->ret))); break;
-#endif
-  case FFIDL_UINT8:	Tcl_SetObjResult(interp, Tcl_NewLongObj((long)FFIDL_RVALUE_PEEK_UNWIDEN(UINT8, callout->ret))); break;
-  case FFIDL_SINT8:	Tcl_SetObjResult(interp, Tcl_NewLongObj((long)FFIDL_RVALUE_PEEK_UNWIDEN(SINT8, callout->ret))); break;
-  case FFIDL_UINT16:	Tcl_SetObjResult(interp, Tcl_NewLongObj((long)FFIDL_RVALUE_PEEK_UNWIDEN(UINT16, callout->ret))); break;
-  case FFIDL_SINT16:	Tcl_SetObjResult(interp, Tcl_NewLongObj((long)FFIDL_RVALUE_PEEK_UNWIDEN(SINT16, callout->ret))); break;
-  case FFIDL_UINT32:	Tcl_SetObjResult(interp, Tcl_NewLongObj((long)FFIDL_RVALUE_PEEK_UNWIDEN(UINT32, callout->ret))); break;
-  case FFIDL_SINT32:	Tcl_SetObjResult(interp, Tcl_NewLongObj((long)FFIDL_RVALUE_PEEK_UNWIDEN(SINT32, callout->ret))); break;
-#if HAVE_INT64
-  case FFIDL_UINT64:	Tcl_SetObjResult(interp, Ffidl_NewInt64Obj((Ffidl_Int64)FFIDL_RVALUE_PEEK_UNWIDEN(UINT64, callout->ret))); break;
-  case FFIDL_SINT64:	Tcl_SetObjResult(interp, Ffidl_NewInt64Obj((Ffidl_Int64)FFIDL_RVALUE_PEEK_UNWIDEN(SINT64, callout->ret))); break;
-#endif
-  case FFIDL_STRUCT:	Tcl_SetObjResult(interp, obj); Tcl_DecrRefCount(obj); break;
-  case FFIDL_PTR:	Tcl_SetObjResult(interp, Ffidl_NewPointerObj(FFIDL_RVALUE_PEEK_UNWIDEN(PTR, callout->ret))); break;
-  case FFIDL_PTR_OBJ:	Tcl_SetObjResult(interp, (Tcl_Obj *)FFIDL_RVALUE_PEEK_UNWIDEN(PTR, callout->ret)); break;
-  case FFIDL_PTR_UTF8:	Tcl_SetObjResult(interp, Tcl_NewStringObj(FFIDL_RVALUE_PEEK_UNWIDEN(PTR, callout->ret), -1)); break;
-  case FFIDL_PTR_UTF16:	Tcl_SetObjResult(interp, Tcl_NewUnicodeObj(FFIDL_RVALUE_PEEK_UNWIDEN(PTR, callout->ret), -1)); break;
-  default:
-    sprintf(buff, "Invalid return type: %d", cif->rtype->typecode);
-    Tcl_AppendResult(interp, buff, NULL);
-    goto cleanup;
-  }    
-  /* done */
+  results = Tcl_NewByteArrayObj(NULL, 0);
+  map.out = Tcl_SetByteArrayLength(results, map.n * map.otype->size);
+  Tcl_IncrRefCount(results);
+#if TCL_THREADS
+  if (threads > map.n) {
+    threads = map.n;
+  }
+  if (parallel && threads > 1) {
+    map_run_parallel(&map, frame, threads);
+  } else
+#endif
+  map_run(&map, frame, 0, map.n);
+  map_free(&map);
+  callout_frame_release(callout, frame);
+  Tcl_SetObjResult(interp, results);
+  Tcl_DecrRefCount(results);
   return TCL_OK;
-  /* blew it */
- cleanup:
-  return TCL_ERROR;
 }
 
-/* usage: ffidl::callout name {?argument_type ...?} return_type address ?protocol? */
-static int tcl_ffidl_callout(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+/* usage: ffidl::map name ?-out type? ?-packed indices? ?arg ...? -> packed results */
+static int tcl_ffidl_map(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  return map_command(clientData, interp, objc, objv, 0);
+}
+
+/* usage: ffidl::parallel-map name ?-out type? ?-packed indices? ?-threads n? ?arg ...? -> packed results */
+static int tcl_ffidl_parallel_map(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  return map_command(clientData, interp, objc, objv, 1);
+}
+
+#if TCL_THREADS
+/*
+ * Called when the coroutine waiting in ::ffidl::await is resumed, by the
+ * completed call, by the timeout, or by anything else, in which case it
+ * waits again.
+ */
+static int await_resumed(ClientData data[], Tcl_Interp *interp, int result)
+{
+  ffidl_await *await = (ffidl_await *)data[0];
+
+  if (result != TCL_OK) {
+    /* the coroutine was deleted, or could not yield */
+    if (await->state == FFIDL_AWAIT_WAITING) {
+      await->state = FFIDL_AWAIT_ABANDONED;
+      if (await->timer) {
+	Tcl_DeleteTimerHandler(await->timer);
+	await->timer = NULL;
+      }
+    }
+  } else if (await->state == FFIDL_AWAIT_WAITING) {
+    Tcl_NRAddCallback(interp, await_resumed, (ClientData)await, NULL, NULL, NULL);
+    return Tcl_NREvalObj(interp, Tcl_NewStringObj("::yield", -1), 0);
+  } else if (await->state == FFIDL_AWAIT_DONE) {
+    Tcl_SetObjResult(interp, await->result);
+  } else {
+    Tcl_ResetResult(interp);
+    Tcl_AppendResult(interp, "callout \"", Tcl_GetString(await->name), "\" timed out", NULL);
+    result = TCL_ERROR;
+  }
+  await_release(await);
+  return result;
+}
+
+/* usage: ffidl::await ?-timeout ms? name ?arg ...? -> result */
+static int tcl_ffidl_nr_await(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
   enum {
     command_ix,
     name_ix,
-    args_ix,
-    return_ix,
-    address_ix,
-    protocol_ix,
-    minargs = address_ix + 1,
-    maxargs = protocol_ix + 1,
+    minargs
   };
 
-  char *name;
-  void (*fn)(void);
-  int argc, i;
-  Tcl_Obj **argv;
-  Tcl_DString usage, ds;
-  Tcl_Command res;
-  ffidl_cif *cif = NULL;
+  int option, timeout = 0, skip = 0;
+  char *usage;
+  Tcl_Obj *coroutine;
+  Tcl_Command token;
   ffidl_callout *callout;
-  ffidl_client *client = (ffidl_client *)clientData;
-  ffidl_value *rvalue = NULL;
-  ffidl_value *avalues = NULL;
-  int has_protocol = objc - 1 >= protocol_ix;
+  ffidl_await *await;
+  static const char *options[] = {
+#define AWAIT_TIMEOUT 0
+    "-timeout",
+    NULL
+  };
 
   /* usage check */
-  if (objc != minargs && objc != maxargs) {
-    Tcl_WrongNumArgs(interp, 1, objv, "name {?argument_type ...?} return_type address ?protocol?");
+  if (objc < minargs) {
+    Tcl_WrongNumArgs(interp, 1, objv, "?-timeout ms? name ?arg ...?");
     return TCL_ERROR;
   }
-  Tcl_DStringInit(&ds);
-  Tcl_DStringInit(&usage);
-  /* fetch name */
-  name = Tcl_GetString(objv[name_ix]);
-  if (!strstr(name, "::")) {
-    Tcl_Namespace *ns;
-    ns = Tcl_GetCurrentNamespace(interp);
-    if (ns != Tcl_GetGlobalNamespace(interp)) {
-      Tcl_DStringAppend(&ds, ns->fullName, -1);
+  if (objc >= minargs+2 && Tcl_GetString(objv[name_ix])[0] == '-') {
+    if (Tcl_GetIndexFromObj(interp, objv[name_ix], options, "option", TCL_EXACT, &option) == TCL_ERROR ||
+	Tcl_GetIntFromObj(interp, objv[name_ix+1], &timeout) == TCL_ERROR) {
+      return TCL_ERROR;
     }
-    Tcl_DStringAppend(&ds, "::", 2);
-    Tcl_DStringAppend(&ds, name, -1);
-    name = Tcl_DStringValue(&ds);
-  }
-  /* fetch cif */
-  if (cif_parse(interp, client,
-		objv[args_ix],
-		objv[return_ix],
-		has_protocol ? objv[protocol_ix] : NULL,
-		&cif) == TCL_ERROR) {
-    goto error;
+    if (timeout < 1) {
+      Tcl_AppendResult(interp, "-timeout must be at least 1", NULL);
+      return TCL_ERROR;
+    }
+    skip = 2;
   }
-  /* fetch function pointer */
-  if (Ffidl_GetPointerFromObj(interp, objv[address_ix], (void **)&fn) == TCL_ERROR) {
-    goto error;
+  /* fetch callout */
+  if (callout_from_command(interp, objv[skip+name_ix], &callout) == TCL_ERROR) {
+    return TCL_ERROR;
   }
-  /* if callout is already defined, redefine it */
-  if ((callout = callout_lookup(client, name))) {
-    Tcl_DeleteCommand(interp, name);
+  if ((callout->flags & FFIDL_CALLOUT_ASYNC) == 0) {
+    Tcl_AppendResult(interp, "callout \"", Tcl_GetString(objv[skip+name_ix]),
+		     "\" is not declared -async", NULL);
+    return TCL_ERROR;
   }
-  /* build the usage string */
-  Tcl_ListObjGetElements(interp, objv[args_ix], &argc, &argv);
-  for (i = 0; i < argc; i += 1) {
-    if (i != 0) Tcl_DStringAppend(&usage, " ", 1);
-    Tcl_DStringAppend(&usage, Tcl_GetString(argv[i]), -1);
+  if (objc-skip-minargs != callout->cif->argc-callout->nbound) {
+    /* the callout's usage, without the completion command */
+    usage = callout->usage + strlen("command");
+    Tcl_WrongNumArgs(interp, skip+minargs, objv, usage[0] ? usage+1 : usage);
+    return TCL_ERROR;
   }
-  /* allocate the callout structure, including:
-     - usage string
-     - argument value pointers
-     - argument values */
-  callout = (ffidl_callout *)Tcl_Alloc(sizeof(ffidl_callout)
-				       +cif->argc*sizeof(void*) /* args */
-				       +sizeof(ffidl_value)	/* rvalue */
-				       +cif->argc*sizeof(ffidl_value) /* avalues */
-				       +Tcl_DStringLength(&usage)+1); /* usage */
-  if (callout == NULL) {
-    Tcl_AppendResult(interp, "can't allocate ffidl_callout for: ", name, NULL);
-    goto error;
+  /* the command of the running coroutine, if any */
+  if (Tcl_EvalEx(interp, "::info coroutine", -1, TCL_EVAL_GLOBAL) == TCL_ERROR) {
+    return TCL_ERROR;
   }
-  /* initialize the callout */
-  callout->cif = cif;
-  callout->fn = fn;
-  callout->client = client;
-  /* set up return and argument pointers */
-  callout->args = (void **)(callout+1);
-  rvalue = (ffidl_value *)(callout->args+cif->argc);
-  avalues = (ffidl_value *)(rvalue+1);
-  /* prep return value */
-  if (callout_prep_value(interp, FFIDL_RET, objv[return_ix], cif->rtype,
-			 rvalue, &callout->ret) == TCL_ERROR) {
-    goto error;
+  token = Tcl_GetCommandFromObj(interp, Tcl_GetObjResult(interp));
+  Tcl_ResetResult(interp);
+  if (token == NULL) {
+    Tcl_AppendResult(interp, "::ffidl::await must be called in a coroutine", NULL);
+    return TCL_ERROR;
   }
-  /* prep argument values */
-  for (i = 0; i < argc; i += 1) {
-    if (callout_prep_value(interp, FFIDL_ARG, argv[i], cif->atypes[i],
-			   &avalues[i], &callout->args[i]) == TCL_ERROR) {
-      goto error;
-    }
+  coroutine = Tcl_NewObj();
+  Tcl_GetCommandFullName(interp, token, coroutine);
+  Tcl_IncrRefCount(coroutine);
+  /* shared by the call and the waiting coroutine */
+  await = (ffidl_await *)Tcl_Alloc(sizeof(ffidl_await));
+  await->refCount = 2;
+  await->state = FFIDL_AWAIT_WAITING;
+  await->interp = interp;
+  await->coroutine = coroutine;
+  Tcl_TraceCommand(interp, Tcl_GetString(coroutine), TCL_TRACE_RENAME|TCL_TRACE_DELETE,
+		   await_trace, (ClientData)await);
+  await->name = objv[skip+name_ix];
+  Tcl_IncrRefCount(await->name);
+  await->result = NULL;
+  await->timer = NULL;
+  if (callout_async_queue(interp, callout, NULL, await, objv+skip+minargs) == TCL_ERROR) {
+    await->refCount = 1;
+    await_release(await);
+    return TCL_ERROR;
   }
-  callout_prep(callout);
-  /* set up usage string */
-  callout->usage = (char *)((avalues+cif->argc));
-  strcpy(callout->usage, Tcl_DStringValue(&usage));
-  /* free the usage string */
-  Tcl_DStringFree(&usage);
-  /* define the callout */
-  callout_define(client, name, callout);
-  /* create the tcl command */
-  res = Tcl_CreateObjCommand(interp, name, tcl_ffidl_call, (ClientData) callout, callout_delete);
-  Tcl_DStringFree(&ds);
-  return (res ? TCL_OK : TCL_ERROR);
-error:
-  Tcl_DStringFree(&ds);
-  Tcl_DStringFree(&usage);
-  if (cif) {
-    cif_dec_ref(cif);
+  if (timeout) {
+    await->timer = Tcl_CreateTimerHandler(timeout, await_timeout, (ClientData)await);
   }
-  return TCL_ERROR;
+  Tcl_NRAddCallback(interp, await_resumed, (ClientData)await, NULL, NULL, NULL);
+  return Tcl_NREvalObj(interp, Tcl_NewStringObj("::yield", -1), 0);
 }
 
+static int tcl_ffidl_await(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  return Tcl_NRCallObjProc(interp, tcl_ffidl_nr_await, clientData, objc, objv);
+}
+#endif
+
 #if USE_CALLBACKS
-/* usage: ffidl::callback name {?argument_type ...?} return_type ?protocol? ?cmdprefix? -> */
+/*
+ * usage: ffidl::callback ?options? name {?argument_type ...?} return_type ?protocol? ?cmdprefix? -> address
+ *        ffidl::callback -anonymous ?options? {?argument_type ...?} return_type ?protocol? cmdprefix -> handle
+ *        ffidl::callback -delete handle
+ */
 static int tcl_ffidl_callback(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
   enum {
@@ -3345,6 +7726,7 @@ static int tcl_ffidl_callback(ClientData clientData, Tcl_Interp *interp, int obj
 
   char *name;
   Tcl_Obj *nameObj;
+  Tcl_Obj *argsObj, *returnObj, *protocolObj = NULL, *cmdprefixObj = NULL;
   ffidl_cif *cif = NULL;
   Tcl_Obj **cmdv = NULL;
   int cmdc;
@@ -3352,21 +7734,176 @@ static int tcl_ffidl_callback(ClientData clientData, Tcl_Interp *interp, int obj
   ffidl_callback *callback = NULL;
   ffidl_client *client = (ffidl_client *)clientData;
   ffidl_closure *closure = NULL;
-  void (*fn)();
-  int has_protocol = objc - 1 >= protocol_ix;
-  int has_cmdprefix = objc - 1 >= cmdprefix_ix;
-  int i, argc = 0;
-  Tcl_Obj **argv = NULL;
+  int anonymous = 0, has_userdata = 0, userdata = 0;
+  ffidl_trampoline *trampoline = NULL;
+  int i, argc = 0, option, flags = 0, poolsize = 0, batch = -1;
+  Tcl_Obj **argv = NULL, *init = NULL, *deleteObj = NULL;
+  Tcl_Obj *CONST *objv0 = objv;
+  static const char *options[] = {
+#define CALLBACK_ANONYMOUS 0
+    "-anonymous",
+#define CALLBACK_BATCH 1
+    "-batch",
+#define CALLBACK_DELETE 2
+    "-delete",
+#define CALLBACK_INIT 3
+    "-init",
+#define CALLBACK_POOL 4
+    "-pool",
+#define CALLBACK_THREAD 5
+    "-thread",
+#define CALLBACK_USERDATA 6
+    "-userdata",
+    NULL
+  };
+  static const char *batches[] = {
+#define CALLBACK_BATCH_COLUMNS 0
+    "columns",
+#define CALLBACK_BATCH_TUPLES 1
+    "tuples",
+    NULL
+  };
+  static const char *threads[] = {
+#define CALLBACK_THREAD_MARSHAL 0
+    "marshal",
+#define CALLBACK_THREAD_OWNER 1
+    "owner",
+    NULL
+  };
 
-  /* usage check */
-  if (objc < minargs || objc > maxargs) {
-    Tcl_WrongNumArgs(interp, 1, objv, "name {?argument_type ...?} return_type ?protocol? ?cmdprefix?");
+  /* fetch options, up to the first word not starting with - or -- */
+  for (i = name_ix; i < objc; i += 1) {
+    char *arg = Tcl_GetString(objv[i]);
+    int value;
+    if (arg[0] != '-') {
+      break;
+    }
+    if (strcmp(arg, "--") == 0) {
+      i += 1;
+      break;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[i], options, "option", TCL_EXACT, &option) == TCL_ERROR) {
+      return TCL_ERROR;
+    }
+    if (option == CALLBACK_ANONYMOUS) {
+      anonymous = 1;
+      continue;
+    }
+    if (i+1 >= objc) {
+      Tcl_AppendResult(interp, "value for \"", arg, "\" missing", NULL);
+      return TCL_ERROR;
+    }
+    i += 1;
+    switch (option) {
+    case CALLBACK_BATCH:
+      if (Tcl_GetIndexFromObj(interp, objv[i], batches, "batch", TCL_EXACT, &batch) == TCL_ERROR) {
+	return TCL_ERROR;
+      }
+#if ! USE_LIBFFI
+      Tcl_AppendResult(interp, "-batch requires libffi", NULL);
+      return TCL_ERROR;
+#endif
+      break;
+    case CALLBACK_DELETE:
+      deleteObj = objv[i];
+      break;
+    case CALLBACK_INIT:
+      init = objv[i];
+      break;
+    case CALLBACK_POOL:
+      if (Tcl_GetIntFromObj(interp, objv[i], &poolsize) == TCL_ERROR) {
+	return TCL_ERROR;
+      }
+      if (poolsize < 1) {
+	Tcl_AppendResult(interp, "-pool size must be at least 1", NULL);
+	return TCL_ERROR;
+      }
+#if ! (TCL_THREADS && USE_LIBFFI)
+      Tcl_AppendResult(interp, "-pool requires a threaded Tcl and libffi", NULL);
+      return TCL_ERROR;
+#endif
+      break;
+    case CALLBACK_THREAD:
+      if (Tcl_GetIndexFromObj(interp, objv[i], threads, "thread", TCL_EXACT, &value) == TCL_ERROR) {
+	return TCL_ERROR;
+      }
+      if (value == CALLBACK_THREAD_MARSHAL) {
+#if TCL_THREADS && USE_LIBFFI
+	flags |= FFIDL_CALLBACK_MARSHAL;
+#else
+	Tcl_AppendResult(interp, "-thread marshal requires a threaded Tcl and libffi", NULL);
+	return TCL_ERROR;
+#endif
+      } else {
+	flags &= ~FFIDL_CALLBACK_MARSHAL;
+      }
+      break;
+    case CALLBACK_USERDATA:
+      if (Tcl_GetIntFromObj(interp, objv[i], &userdata) == TCL_ERROR) {
+	return TCL_ERROR;
+      }
+      has_userdata = 1;
+#if ! USE_LIBFFI
+      Tcl_AppendResult(interp, "-userdata requires libffi", NULL);
+      return TCL_ERROR;
+#endif
+      break;
+    }
+  }
+  if (deleteObj != NULL) {
+    /* free an anonymous callback */
+    if (objc != 3 || i != objc) {
+      Tcl_WrongNumArgs(interp, 1, objv0, "-delete handle");
+      return TCL_ERROR;
+    }
+    return callback_handle_delete(interp, client, deleteObj);
+  }
+  objc -= i - name_ix;
+  objv += i - name_ix;
+  if (init != NULL && poolsize == 0) {
+    Tcl_AppendResult(interp, "-init requires -pool", NULL);
+    return TCL_ERROR;
+  }
+  if (poolsize != 0 && (flags & FFIDL_CALLBACK_MARSHAL)) {
+    Tcl_AppendResult(interp, "-pool and -thread marshal are exclusive", NULL);
+    return TCL_ERROR;
+  }
+  if (poolsize != 0 && batch >= 0) {
+    Tcl_AppendResult(interp, "-pool and -batch are exclusive", NULL);
     return TCL_ERROR;
   }
+
+  /* usage check */
+  if (anonymous) {
+    /* there is no name, and the command prefix is required */
+    if (objc < minargs || objc > maxargs - 1) {
+      Tcl_WrongNumArgs(interp, 1, objv0, "-anonymous ?options? {?argument_type ...?} return_type ?protocol? cmdprefix");
+      return TCL_ERROR;
+    }
+    argsObj = objv[args_ix-1];
+    returnObj = objv[return_ix-1];
+    if (objc - 1 >= cmdprefix_ix - 1) {
+      protocolObj = objv[protocol_ix-1];
+    }
+    cmdprefixObj = objv[objc-1];
+  } else {
+    if (objc < minargs || objc > maxargs) {
+      Tcl_WrongNumArgs(interp, 1, objv0, "?options? name {?argument_type ...?} return_type ?protocol? ?cmdprefix?");
+      return TCL_ERROR;
+    }
+    argsObj = objv[args_ix];
+    returnObj = objv[return_ix];
+    if (objc - 1 >= protocol_ix) {
+      protocolObj = objv[protocol_ix];
+    }
+    if (objc - 1 >= cmdprefix_ix) {
+      cmdprefixObj = objv[cmdprefix_ix];
+    }
+  }
   /* fetch name */
   Tcl_DStringInit(&ds);
-  name = Tcl_GetString(objv[name_ix]);
-  if (!strstr(name, "::")) {
+  name = anonymous ? "-anonymous" : Tcl_GetString(objv[name_ix]);
+  if (!anonymous && !strstr(name, "::")) {
     Tcl_Namespace *ns;
     ns = Tcl_GetCurrentNamespace(interp);
     if (ns != Tcl_GetGlobalNamespace(interp)) {
@@ -3378,26 +7915,60 @@ static int tcl_ffidl_callback(ClientData clientData, Tcl_Interp *interp, int obj
   }
   /* fetch cif */
   if (cif_parse(interp, client,
-		objv[args_ix],
-		objv[return_ix],
-		has_protocol ? objv[protocol_ix] : NULL,
+		argsObj,
+		returnObj,
+		protocolObj,
 		&cif) == TCL_ERROR) {
       goto error;
   }
   /* check types */
   if (cif_type_check_context(interp, FFIDL_CBRET,
-			     objv[return_ix], cif->rtype) == TCL_ERROR) {
+			     returnObj, cif->rtype) == TCL_ERROR) {
     goto error;
   }
-  Tcl_ListObjGetElements(interp, objv[args_ix], &argc, &argv);
+  Tcl_ListObjGetElements(interp, argsObj, &argc, &argv);
   for (i = 0; i < argc; i += 1)
     if (cif_type_check_context(interp, FFIDL_ARG,
-			       objv[args_ix], cif->atypes[i]) == TCL_ERROR) {
+			       argsObj, cif->atypes[i]) == TCL_ERROR) {
+      goto error;
+    }
+  if (poolsize != 0) {
+    /* Tcl_Objs cannot be passed between threads */
+    int has_obj = cif->rtype->typecode == FFIDL_PTR_OBJ;
+    for (i = 0; i < cif->argc; i += 1) {
+      has_obj |= cif->atypes[i]->typecode == FFIDL_PTR_OBJ;
+    }
+    if (has_obj) {
+      Tcl_AppendResult(interp, "-pool callbacks cannot pass pointer-obj values", NULL);
+      goto error;
+    }
+  }
+  if (has_userdata) {
+    if (userdata < 0 || userdata >= cif->argc) {
+      Tcl_AppendResult(interp, "-userdata argument index out of range", NULL);
+      goto error;
+    }
+    if (cif->atypes[userdata]->typecode != FFIDL_PTR) {
+      Tcl_AppendResult(interp, "-userdata argument must be of type pointer", NULL);
       goto error;
     }
+  }
+  if (batch >= 0) {
+    /* the arguments are kept after the call returns */
+    if (cif->rtype->typecode != FFIDL_VOID) {
+      Tcl_AppendResult(interp, "-batch requires a void return type", NULL);
+      goto error;
+    }
+    for (i = 0; i < cif->argc; i += 1) {
+      if ( ! MEMO_ARG_OK(cif->atypes[i])) {
+	Tcl_AppendResult(interp, "-batch requires arguments passed by value", NULL);
+	goto error;
+      }
+    }
+  }
   /* create Tcl proc */
-  if (has_cmdprefix) {
-    Tcl_Obj *cmdprefix = objv[cmdprefix_ix];
+  if (cmdprefixObj != NULL) {
+    Tcl_Obj *cmdprefix = cmdprefixObj;
     Tcl_IncrRefCount(cmdprefix);
     if (Tcl_ListObjGetElements(interp, cmdprefix, &cmdc, &cmdv) != TCL_OK) {
       goto error;
@@ -3416,8 +7987,10 @@ static int tcl_ffidl_callback(ClientData clientData, Tcl_Interp *interp, int obj
 
   /* allocate the callback structure */
   callback = (ffidl_callback *)Tcl_Alloc(sizeof(ffidl_callback)
-					 /* cmdprefix and argument Tcl_Objs */
-					 +(cmdc+cif->argc)*sizeof(Tcl_Obj *)
+					 /* cmdprefix Tcl_Objs */
+					 +cmdc*sizeof(Tcl_Obj *)
+					 /* reusable argument Tcl_Objs */
+					 +cif->argc*sizeof(Tcl_Obj *)
 #if USE_LIBFFI_RAW_API
 					 /* raw argument offsets */
 					 +cif->argc*sizeof(ptrdiff_t)
@@ -3434,11 +8007,47 @@ static int tcl_ffidl_callback(ClientData clientData, Tcl_Interp *interp, int obj
   callback->cmdc = cmdc;
   callback->cmdv = (Tcl_Obj **)(callback+1);
   memcpy(callback->cmdv, cmdv, cmdc*sizeof(Tcl_Obj *));
+  callback->frames = NULL;
+  callback->flags = flags;
+  callback->batch = NULL;
+#if TCL_THREADS
+  callback->owner = Tcl_GetCurrentThread();
+  callback->pool = NULL;
+#endif
+  callback->argobjs = callback->cmdv+cmdc;
+  memset(callback->argobjs, 0, cif->argc*sizeof(Tcl_Obj *));
+  callback->userdata = NULL;
+  callback->trampoline = NULL;
+  callback->native = NULL;
+#if USE_LIBFFI
+  if (has_userdata) {
+    /* share the trampoline of the cif, and take a userdata handle */
+    if ((trampoline = trampoline_get(interp, client, cif, userdata)) == NULL) {
+      goto error;
+    }
+#if USE_LIBFFI_RAW_API
+    callback->offsets = (ptrdiff_t *)(callback->argobjs+cif->argc);
+    callback->use_raw_api = trampoline->use_raw_api;
+    if (callback->use_raw_api) {
+      memcpy(callback->offsets, trampoline->offsets, cif->argc*sizeof(ptrdiff_t));
+    }
+#endif
+    if ((callback->userdata = userdata_alloc(client, callback)) == NULL) {
+      Tcl_AppendResult(interp, "too many -userdata callbacks", NULL);
+      goto error;
+    }
+    callback->trampoline = trampoline;
+    goto prepared;
+  }
+#endif
   closure = &(callback->closure);
 #if USE_LIBFFI
-  closure->lib_closure = ffi_closure_alloc(sizeof(ffi_closure), &(closure->executable));
+  if (closure_alloc(cif, closure) != TCL_OK) {
+    Tcl_AppendResult(interp, "libffi can't allocate closure for: ", name, NULL);
+    goto error;
+  }
 #if USE_LIBFFI_RAW_API
-  callback->offsets = (ptrdiff_t *)(callback->cmdv+cmdc+cif->argc);
+  callback->offsets = (ptrdiff_t *)(callback->argobjs+cif->argc);
   callback->use_raw_api = cif_raw_supported(cif);
   if (callback->use_raw_api &&
       ffi_prep_raw_closure_loc((ffi_raw_closure *)closure->lib_closure,
@@ -3466,25 +8075,35 @@ static int tcl_ffidl_callback(ClientData clientData, Tcl_Interp *interp, int obj
   closure->lib_closure = alloc_callback((callback_function_t)&callback_callback,
 					(void *)callback);
 #endif
+#if USE_LIBFFI
+ prepared:
+#endif
+#if TCL_THREADS && USE_LIBFFI
+  /* start the worker interps */
+  if (poolsize != 0 && (callback->pool = callback_pool_new(interp, callback, poolsize, init)) == NULL) {
+    goto error;
+  }
+#endif
+  if (batch >= 0) {
+    callback->batch = callback_batch_new(cif, batch == CALLBACK_BATCH_COLUMNS, FFIDL_BATCH_SIZE);
+  }
+  if (anonymous) {
+    /* the callback lives until ::ffidl::callback -delete */
+    Tcl_SetObjResult(interp, callback_handle_new(client, callback));
+    return TCL_OK;
+  }
   /* define the callback */
   callback_define(client, name, callback);
   Tcl_DStringFree(&ds);
 
-  /* Return function pointer to the callback. */
-#if USE_LIBFFI
-  fn = FFI_FN(closure->executable);
-#elif USE_LIBFFCALL
-  fn = (void (*)())closure->lib_closure;
-#endif
-  Tcl_SetObjResult(interp, Ffidl_NewPointerObj(fn));
+  /* Return function pointer to the callback, or its userdata handle. */
+  Tcl_SetObjResult(interp, Ffidl_NewPointerObj(callback->trampoline != NULL
+					       ? callback->userdata : callback_address(callback)));
 
   return TCL_OK;
 
 error:
   Tcl_DStringFree(&ds);
-  if (cif) {
-    cif_dec_ref(cif);
-  }
   if (cmdv) {
     for (i = 0; i < cmdc; i++) {
       Tcl_DecrRefCount(cmdv[i]);
@@ -3492,16 +8111,278 @@ error:
   }
   if (closure && closure->lib_closure) {
 #if USE_LIBFFI
-    ffi_closure_free(closure->lib_closure);
+    closure_release(cif, closure);
 #elif USE_LIBFFCALL
     free_callback(closure->lib_closure);
 #endif
   }
+  if (callback && callback->trampoline) {
+    userdata_free(client, callback->userdata);
+  }
+  if (cif) {
+    cif_dec_ref(cif);
+  }
   if (callback) {
       Tcl_Free((void *)callback);
   }
   return TCL_ERROR;
 }
+
+/*
+ * usage: ffidl::native-comparator ?-descending? ?-type struct -field index? ?-size n? type -> handle
+ *
+ * A native int compare(const void *, const void *) ordering the values of
+ * type, or of a field of struct, or the bytes of a struct type, or the size
+ * bytes of type bytes.
+ */
+static int tcl_ffidl_native_comparator(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  ffidl_client *client = (ffidl_client *)clientData;
+  ffidl_native native;
+  ffidl_type *type = NULL, *stype = NULL;
+  Tcl_Obj *stypeObj = NULL;
+  char *tname;
+  int i, option, field = -1, size = -1;
+  static const char *options[] = {
+#define COMPARATOR_DESCENDING 0
+    "-descending",
+#define COMPARATOR_FIELD 1
+    "-field",
+#define COMPARATOR_SIZE 2
+    "-size",
+#define COMPARATOR_TYPE 3
+    "-type",
+    NULL
+  };
+
+  native.offset = 0;
+  native.descending = 0;
+  native.algorithm = 0;
+  native.length = FFIDL_NATIVE_BYTES;
+  native.seed = 0;
+  /* fetch options, up to the first word not starting with - */
+  for (i = 1; i < objc - 1; i += 1) {
+    char *arg = Tcl_GetString(objv[i]);
+    if (arg[0] != '-') {
+      break;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[i], options, "option", TCL_EXACT, &option) == TCL_ERROR) {
+      return TCL_ERROR;
+    }
+    if (option == COMPARATOR_DESCENDING) {
+      native.descending = 1;
+      continue;
+    }
+    if (i+1 >= objc - 1) {
+      Tcl_AppendResult(interp, "value for \"", arg, "\" missing", NULL);
+      return TCL_ERROR;
+    }
+    i += 1;
+    switch (option) {
+    case COMPARATOR_FIELD:
+      if (Tcl_GetIntFromObj(interp, objv[i], &field) == TCL_ERROR) {
+	return TCL_ERROR;
+      }
+      break;
+    case COMPARATOR_SIZE:
+      if (Tcl_GetIntFromObj(interp, objv[i], &size) == TCL_ERROR) {
+	return TCL_ERROR;
+      }
+      if (size < 0) {
+	Tcl_AppendResult(interp, "-size must not be negative", NULL);
+	return TCL_ERROR;
+      }
+      break;
+    case COMPARATOR_TYPE:
+      stypeObj = objv[i];
+      if ((stype = type_lookup(client, Tcl_GetString(objv[i]))) == NULL) {
+	Tcl_AppendResult(interp, "no type defined for: ", Tcl_GetString(objv[i]), NULL);
+	return TCL_ERROR;
+      }
+      if (stype->typecode != FFIDL_STRUCT) {
+	Tcl_AppendResult(interp, "-type must be a struct type", NULL);
+	return TCL_ERROR;
+      }
+      break;
+    }
+  }
+  if (i != objc - 1) {
+    Tcl_WrongNumArgs(interp, 1, objv, "?-descending? ?-type struct -field index? ?-size n? type");
+    return TCL_ERROR;
+  }
+  /* fetch the compared type, bytes is a plain memcmp */
+  tname = Tcl_GetString(objv[i]);
+  if (strcmp(tname, "bytes") != 0 && (type = type_lookup(client, tname)) == NULL) {
+    Tcl_AppendResult(interp, "no type defined for: ", tname, NULL);
+    return TCL_ERROR;
+  }
+  if ((stype == NULL) != (field < 0)) {
+    Tcl_AppendResult(interp, "-type and -field go together", NULL);
+    return TCL_ERROR;
+  }
+  native.size = 0;
+  if (stype != NULL) {
+    ffidl_type *ftype;
+    if (field >= stype->nelts) {
+      Tcl_AppendResult(interp, "-field index out of range", NULL);
+      return TCL_ERROR;
+    }
+    /* lay out the struct up to the field, as ffidl::info format does */
+    for (i = 0; ; i += 1) {
+      ftype = stype->elements[i];
+      native.offset = (native.offset+ftype->alignment-1)/ftype->alignment*ftype->alignment;
+      if (i == field) {
+	break;
+      }
+      native.offset += ftype->size;
+    }
+    if (type == NULL) {
+      native.size = ftype->size;
+    } else if (type->typecode != ftype->typecode) {
+      char buff[TCL_INTEGER_SPACE];
+      sprintf(buff, "%d", field);
+      Tcl_AppendResult(interp, "field ", buff, " of ", Tcl_GetString(stypeObj),
+		       " is not of type ", tname, NULL);
+      return TCL_ERROR;
+    }
+  }
+  if (type == NULL) {
+    native.typecode = FFIDL_STRUCT;
+    if (size >= 0) {
+      native.size = size;
+    } else if (stype == NULL) {
+      Tcl_AppendResult(interp, "type bytes requires -size", NULL);
+      return TCL_ERROR;
+    }
+  } else {
+    if (size >= 0) {
+      Tcl_AppendResult(interp, "-size requires type bytes", NULL);
+      return TCL_ERROR;
+    }
+    switch (type->typecode) {
+    case FFIDL_INT:
+    case FFIDL_FLOAT:
+    case FFIDL_DOUBLE:
+#if HAVE_LONG_DOUBLE
+    case FFIDL_LONGDOUBLE:
+#endif
+    case FFIDL_UINT8:
+    case FFIDL_SINT8:
+    case FFIDL_UINT16:
+    case FFIDL_SINT16:
+    case FFIDL_UINT32:
+    case FFIDL_SINT32:
+#if HAVE_INT64
+    case FFIDL_UINT64:
+    case FFIDL_SINT64:
+#endif
+    case FFIDL_PTR:
+    case FFIDL_STRUCT:
+      native.typecode = type->typecode;
+      native.size = type->size;
+      break;
+    default:
+      Tcl_AppendResult(interp, "cannot compare values of type: ", tname, NULL);
+      return TCL_ERROR;
+    }
+  }
+  return native_new(interp, client, "pointer pointer", "int", 0, &native);
+}
+
+/*
+ * usage: ffidl::native-hash ?-seed seed? ?-size n|-string? algorithm -> handle
+ *
+ * A native uint32 hash(const void *key, size_t length), or with -size the
+ * uint32 hash(const void *key) of n byte keys, or with -string that of NUL
+ * terminated keys.
+ */
+static int tcl_ffidl_native_hash(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  ffidl_client *client = (ffidl_client *)clientData;
+  ffidl_native native;
+  Tcl_WideInt seed;
+  int i, option, size;
+  static const char *options[] = {
+#define HASH_SEED 0
+    "-seed",
+#define HASH_SIZE 1
+    "-size",
+#define HASH_STRING 2
+    "-string",
+    NULL
+  };
+  static const char *algorithms[] = {
+    "fnv1a",
+    "xxhash32",
+    NULL
+  };
+
+  native.typecode = FFIDL_STRUCT;
+  native.offset = 0;
+  native.size = 0;
+  native.descending = 0;
+  native.length = FFIDL_NATIVE_LENGTH;
+  native.seed = 0;
+  /* fetch options, up to the first word not starting with - */
+  for (i = 1; i < objc - 1; i += 1) {
+    char *arg = Tcl_GetString(objv[i]);
+    if (arg[0] != '-') {
+      break;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[i], options, "option", TCL_EXACT, &option) == TCL_ERROR) {
+      return TCL_ERROR;
+    }
+    if (option == HASH_STRING) {
+      if (native.length == FFIDL_NATIVE_BYTES) {
+	goto exclusive;
+      }
+      native.length = FFIDL_NATIVE_STRING;
+      continue;
+    }
+    if (i+1 >= objc - 1) {
+      Tcl_AppendResult(interp, "value for \"", arg, "\" missing", NULL);
+      return TCL_ERROR;
+    }
+    i += 1;
+    switch (option) {
+    case HASH_SEED:
+      if (Tcl_GetWideIntFromObj(interp, objv[i], &seed) == TCL_ERROR) {
+	return TCL_ERROR;
+      }
+      native.seed = (UINT32_T)seed;
+      break;
+    case HASH_SIZE:
+      if (native.length == FFIDL_NATIVE_STRING) {
+	goto exclusive;
+      }
+      if (Tcl_GetIntFromObj(interp, objv[i], &size) == TCL_ERROR) {
+	return TCL_ERROR;
+      }
+      if (size < 0) {
+	Tcl_AppendResult(interp, "-size must not be negative", NULL);
+	return TCL_ERROR;
+      }
+      native.length = FFIDL_NATIVE_BYTES;
+      native.size = size;
+      break;
+    }
+  }
+  if (i != objc - 1) {
+    Tcl_WrongNumArgs(interp, 1, objv, "?-seed seed? ?-size n|-string? algorithm");
+    return TCL_ERROR;
+  }
+  if (Tcl_GetIndexFromObj(interp, objv[i], algorithms, "algorithm", TCL_EXACT, &native.algorithm) == TCL_ERROR) {
+    return TCL_ERROR;
+  }
+  /* the length argument is a size_t, passed as a pointer sized integer */
+  return native_new(interp, client,
+		    native.length == FFIDL_NATIVE_LENGTH ? "pointer pointer" : "pointer",
+		    "uint32", 1, &native);
+
+ exclusive:
+  Tcl_AppendResult(interp, "-size and -string are exclusive", NULL);
+  return TCL_ERROR;
+}
 #endif
 
 /* usage: ffidl::library library ?options...?*/
@@ -3814,8 +8695,17 @@ int Ffidl_Init(Tcl_Interp *interp)
   Tcl_CreateObjCommand(interp,"::ffidl::symbol", tcl_ffidl_symbol, (ClientData) client, NULL);
   Tcl_CreateObjCommand(interp,"::ffidl::stubsymbol", tcl_ffidl_stubsymbol, (ClientData) client, NULL);
   Tcl_CreateObjCommand(interp,"::ffidl::callout", tcl_ffidl_callout, (ClientData) client, NULL);
+  Tcl_CreateObjCommand(interp,"::ffidl::curry", tcl_ffidl_curry, (ClientData) client, NULL);
+  Tcl_CreateObjCommand(interp,"::ffidl::batch", tcl_ffidl_batch, (ClientData) client, NULL);
+  Tcl_CreateObjCommand(interp,"::ffidl::map", tcl_ffidl_map, (ClientData) client, NULL);
+  Tcl_CreateObjCommand(interp,"::ffidl::parallel-map", tcl_ffidl_parallel_map, (ClientData) client, NULL);
+#if TCL_THREADS
+  Tcl_NRCreateCommand(interp,"::ffidl::await", tcl_ffidl_await, tcl_ffidl_nr_await, (ClientData) client, NULL);
+#endif
 #if USE_CALLBACKS
   Tcl_CreateObjCommand(interp,"::ffidl::callback", tcl_ffidl_callback, (ClientData) client, NULL);
+  Tcl_CreateObjCommand(interp,"::ffidl::native-comparator", tcl_ffidl_native_comparator, (ClientData) client, NULL);
+  Tcl_CreateObjCommand(interp,"::ffidl::native-hash", tcl_ffidl_native_hash, (ClientData) client, NULL);
 #endif
 
   /* determine Tcl_ObjType * for some types */
@@ -7,8 +7,11 @@
  *	2nd long long in callback gets trashed
  */
 
+#include <ffidlConfig.h>
+
 #include <tcl.h>
 #include <stdint.h>		/* uintptr_t */
+#include <string.h>
 
 #ifdef __WIN32__
 #undef TCL_STORAGE_CLASS
@@ -496,6 +499,19 @@ EXTERN long ffidl_flong(long (*f)(long a, long b), long a, long b) { return f(a,
 EXTERN long long ffidl_flonglong(long long (*f)(long long a, long long b), long long a, long long b) { return f(a,b); }
 EXTERN float ffidl_ffloat(float (*f)(float a, float b), float a, float b) { return f(a,b); }
 EXTERN double ffidl_fdouble(double (*f)(double a, double b), double a, double b) { return f(a,b); }
+
+typedef struct { int x, y; } ffidl_test_point;
+EXTERN int ffidl_fpoint(int (*f)(int a, ffidl_test_point p, int b), int a, int x, int y, int b)
+{
+  ffidl_test_point p;
+  p.x = x;
+  p.y = y;
+  return f(a, p, b);
+}
+EXTERN ffidl_test_point ffidl_fpoint_swap(ffidl_test_point (*f)(ffidl_test_point p), ffidl_test_point p)
+{
+  return f(p);
+}
 EXTERN void ffidl_isort(int *base, int nmemb, int (*compar)(const int *,const int *))
 {
   int i, j, t;
@@ -507,3 +523,186 @@ EXTERN void ffidl_isort(int *base, int nmemb, int (*compar)(const int *,const in
     }
   }
 }
+EXTERN int ffidl_fint_userdata(int (*f)(int, int, void *), void *userdata, int a, int b)
+{
+  return f(a, b, userdata);
+}
+EXTERN int ffidl_icompar(const int *a, const int *b)
+{
+  return *a < *b ? -1 : *a > *b;
+}
+/*
+ * argument passing tests
+ */
+EXTERN double ffidl_mixed_args(signed char a, double b, unsigned short c, float d, long e, void *f, int g, double h)
+{
+  return a + b + c + d + e + (double)(uintptr_t)f + g + h;
+}
+EXTERN long ffidl_seven_ints(int a, int b, int c, int d, int e, int f, int g)
+{
+  return a + 10*b + 100*c + 1000*d + 10000*e + 100000*f + 1000000L*g;
+}
+EXTERN double ffidl_four_args(int a, long long b, void *c, double d)
+{
+  return a + 10.0*b + 100.0*(uintptr_t)c + d;
+}
+/*
+ * re-entrancy tests
+ */
+EXTERN int ffidl_int_plus_first(int a, int *b)
+{
+  return a + b[0];
+}
+EXTERN int ffidl_nine_plus_first(int a, int b, int c, int d, int e, int f, int g, int h, int *i)
+{
+  return a + b + c + d + e + f + g + h + i[0];
+}
+/*
+ * result object reuse tests: evaluate cmd n times, without compiling it, and
+ * return the number of distinct interp result objects it left, or -1 on error.
+ */
+EXTERN int ffidl_count_result_objs(Tcl_Interp *interp, Tcl_Obj *cmd, int n)
+{
+  Tcl_Obj *objs[16];
+  int i, j, nobjs = 0;
+  Tcl_IncrRefCount(cmd);
+  for (i = 0; i < n; i += 1) {
+    if (Tcl_EvalObjEx(interp, cmd, TCL_EVAL_DIRECT) != TCL_OK) {
+      nobjs = -1;
+      break;
+    }
+    for (j = 0; j < nobjs && objs[j] != Tcl_GetObjResult(interp); j += 1)
+      ;
+    if (j == nobjs && nobjs < 16) {
+      objs[nobjs++] = Tcl_GetObjResult(interp);
+    }
+  }
+  Tcl_DecrRefCount(cmd);
+  return nobjs;
+}
+/*
+ * memoization tests: a function which counts its calls
+ */
+static int ffidl_counted_calls = 0;
+EXTERN double ffidl_counted_scale(double a, int b)
+{
+  ffidl_counted_calls += 1;
+  return a * b;
+}
+struct ffidl_counted_pad { char c; int i; };
+EXTERN int ffidl_counted_pad_sum(struct ffidl_counted_pad p)
+{
+  ffidl_counted_calls += 1;
+  return p.c + p.i;
+}
+EXTERN int ffidl_counted(void)
+{
+  return ffidl_counted_calls;
+}
+/*
+ * batched callback tests: call f n times
+ */
+EXTERN void ffidl_repeat_fvoid(void (*f)(int a, double b), int n)
+{
+  int i;
+  for (i = 0; i < n; i += 1) {
+    f(i, i/2.0);
+  }
+}
+/*
+ * thread marshalling tests: call f(a,b) from a new thread, and collect its
+ * result once the thread is done.
+ */
+#if TCL_THREADS
+static struct {
+  Tcl_ThreadId id;
+  int (*f)(int a, int b);
+  void (*vf)(int a, int b);
+  void (*sf)(char *s);
+  int a, b, result;
+  char *s;
+} ffidl_thread_call;
+static Tcl_ThreadCreateType ffidl_thread_call_proc(ClientData clientData)
+{
+  if (ffidl_thread_call.f) {
+    ffidl_thread_call.result = ffidl_thread_call.f(ffidl_thread_call.a, ffidl_thread_call.b);
+  } else if (ffidl_thread_call.vf) {
+    ffidl_thread_call.vf(ffidl_thread_call.a, ffidl_thread_call.b);
+  } else {
+    /* pass a copy of s, gone once f returns */
+    char *copy = strcpy(Tcl_Alloc(strlen(ffidl_thread_call.s)+1), ffidl_thread_call.s);
+    ffidl_thread_call.sf(copy);
+    memset(copy, 'x', strlen(copy));
+    Tcl_Free(copy);
+    Tcl_Free(ffidl_thread_call.s);
+  }
+  TCL_THREAD_CREATE_RETURN;
+}
+static int ffidl_thread_start(int a, int b)
+{
+  ffidl_thread_call.a = a;
+  ffidl_thread_call.b = b;
+  return Tcl_CreateThread(&ffidl_thread_call.id, ffidl_thread_call_proc, NULL,
+			  TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) == TCL_OK;
+}
+EXTERN int ffidl_thread_fint(int (*f)(int a, int b), int a, int b)
+{
+  ffidl_thread_call.f = f;
+  ffidl_thread_call.vf = NULL;
+  return ffidl_thread_start(a, b);
+}
+EXTERN int ffidl_thread_fvoid(void (*f)(int a, int b), int a, int b)
+{
+  ffidl_thread_call.f = NULL;
+  ffidl_thread_call.vf = f;
+  return ffidl_thread_start(a, b);
+}
+EXTERN int ffidl_thread_fstring(void (*f)(char *s), char *s)
+{
+  ffidl_thread_call.f = NULL;
+  ffidl_thread_call.vf = NULL;
+  ffidl_thread_call.sf = f;
+  ffidl_thread_call.s = strcpy(Tcl_Alloc(strlen(s)+1), s);
+  return ffidl_thread_start(0, 0);
+}
+EXTERN int ffidl_thread_result(void)
+{
+  int status;
+  Tcl_JoinThread(ffidl_thread_call.id, &status);
+  return ffidl_thread_call.result;
+}
+/*
+ * async callout tests: wait, for at most a second, until n callers are
+ * waiting or the rendezvous is reset, and return the number of callers
+ * seen.
+ */
+static Tcl_Mutex ffidl_rendezvous_mutex;
+static Tcl_Condition ffidl_rendezvous_cond;
+static int ffidl_rendezvous_count;
+static int ffidl_rendezvous_generation;
+EXTERN int ffidl_rendezvous(int n)
+{
+  Tcl_Time timeout = { 0, 100000 };
+  int i, count, generation;
+  Tcl_MutexLock(&ffidl_rendezvous_mutex);
+  count = ++ffidl_rendezvous_count;
+  generation = ffidl_rendezvous_generation;
+  Tcl_ConditionNotify(&ffidl_rendezvous_cond);
+  for (i = 0; i < 10 && ffidl_rendezvous_count < n && generation == ffidl_rendezvous_generation; i += 1) {
+    Tcl_ConditionWait(&ffidl_rendezvous_cond, &ffidl_rendezvous_mutex, &timeout);
+  }
+  if (ffidl_rendezvous_count > count)
+    count = ffidl_rendezvous_count;
+  Tcl_MutexUnlock(&ffidl_rendezvous_mutex);
+  return count;
+}
+/* forget the callers seen by earlier tests, and release those still waiting */
+EXTERN void ffidl_rendezvous_reset(void)
+{
+  Tcl_MutexLock(&ffidl_rendezvous_mutex);
+  ffidl_rendezvous_count = 0;
+  ffidl_rendezvous_generation += 1;
+  Tcl_ConditionNotify(&ffidl_rendezvous_cond);
+  Tcl_MutexUnlock(&ffidl_rendezvous_mutex);
+}
+#endif
@@ -0,0 +1,86 @@
+#
+# Generate ffidl_thunks.h, the specialized call thunks for common callout
+# signatures.
+#
+# usage: tclsh ffidl_thunks.tcl > ffidl_thunks.h
+#
+# A thunk is generated for every signature of up to $maxargs arguments whose
+# argument types are int, long (64 bit), pointer or double, and whose return
+# type is one of those or void.  The thunks are stored in a table indexed by
+# the number of arguments, the return type and the argument types, see
+# thunk_lookup() in ffidl.c.
+#
+
+set maxargs 4
+
+# class letter -> C type, ffidl return value type
+set classes {i l p d}
+array set ctype {
+    v void
+    i SINT32_T
+    l SINT64_T
+    p {void *}
+    d double
+}
+array set rvtype {
+    i SINT32
+    l SINT64
+    p PTR
+    d DOUBLE
+}
+
+# Return all argument class sequences of length n, in table order.
+proc sequences {n} {
+    if {$n == 0} {
+	return [list {}]
+    }
+    set result {}
+    foreach head $::classes {
+	foreach tail [sequences [expr {$n-1}]] {
+	    lappend result [concat $head $tail]
+	}
+    }
+    return $result
+}
+
+puts "/*"
+puts " * Generated by ffidl_thunks.tcl, do not edit."
+puts " */"
+puts ""
+puts "#define FFIDL_THUNK_MAXARGS $maxargs"
+puts ""
+
+set table {}
+for {set n 0} {$n <= $maxargs} {incr n} {
+    foreach r [concat v $classes] {
+	foreach seq [sequences $n] {
+	    set name ffidl_thunk_${r}_[join $seq ""]
+	    set params {}
+	    set args {}
+	    set i 0
+	    foreach a $seq {
+		lappend params $ctype($a)
+		lappend args "*($ctype($a) *)args\[$i\]"
+		incr i
+	    }
+	    if {$n == 0} {
+		set params void
+	    }
+	    set call "(($ctype($r) (*)([join $params {, }]))fn)([join $args {, }])"
+	    puts "static void ${name}(void (*fn)(void), void **args, void *ret)"
+	    puts "{"
+	    if {$r eq "v"} {
+		puts "  $call;"
+	    } else {
+		puts "  FFIDL_RVALUE_POKE_WIDENED($rvtype($r), ret, $call);"
+	    }
+	    puts "}"
+	    lappend table $name
+	}
+    }
+}
+
+puts ""
+puts "static ffidl_thunk *const ffidl_thunks\[\] = {"
+puts "  [join $table ",\n  "]"
+puts "};"